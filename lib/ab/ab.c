@@ -49,6 +49,7 @@ extern "C"
 #include <ab/eip_cip.h>
 #include <ab/eip_pccc.h>
 #include <ab/eip_dhp_pccc.h>
+#include <ab/tag_cache.h>
 #include <util/attr.h>
 
 
@@ -74,7 +75,10 @@ plc_tag ab_tag_create(attr attribs)
 {
     ab_tag_p tag = AB_TAG_NULL;
     const char *path;
+    const char *priority;
 	int rc;
+	int use_connected_msg;
+	int use_instance_id;
 	int debug = attr_get_int(attribs,"debug",0);
 
     pdebug(debug,"Starting.");
@@ -143,6 +147,46 @@ plc_tag ab_tag_create(attr attribs)
 
     tag->first_read = 1;
 
+    /* combine small requests with those of other tags by default. */
+    tag->allow_packing = attr_get_int(attribs,"allow_packing",1);
+
+    /* use connected messaging by default. */
+    use_connected_msg = attr_get_int(attribs,"use_connected_msg",1);
+
+    /* only address Logix tags by Symbol Object instance if asked, it reads the whole symbol table. */
+    use_instance_id = attr_get_int(attribs,"use_instance_id",0);
+
+    /* have the IO thread read and/or write the tag in the background. */
+    tag->auto_sync_read_ms = attr_get_int(attribs,"auto_sync_read_ms",0);
+    tag->auto_sync_write_ms = attr_get_int(attribs,"auto_sync_write_ms",0);
+
+    if(tag->auto_sync_read_ms < 0 || tag->auto_sync_write_ms < 0) {
+    	tag->status = PLCTAG_ERR_BAD_PARAM;
+    	return (plc_tag)tag;
+    }
+
+    /* the IO thread fails requests that take longer than this. */
+    tag->timeout_ms = attr_get_int(attribs,"timeout_ms",0);
+
+    if(tag->timeout_ms < 0) {
+    	tag->status = PLCTAG_ERR_BAD_PARAM;
+    	return (plc_tag)tag;
+    }
+
+    /* high priority requests go ahead of the others, bulk ones after. */
+    priority = attr_get_str(attribs,"priority","normal");
+
+    if(str_cmp_i(priority,"high") == 0) {
+    	tag->priority = AB_PRIORITY_HIGH;
+    } else if(str_cmp_i(priority,"normal") == 0) {
+    	tag->priority = AB_PRIORITY_NORMAL;
+    } else if(str_cmp_i(priority,"bulk") == 0) {
+    	tag->priority = AB_PRIORITY_BULK;
+    } else {
+    	tag->status = PLCTAG_ERR_BAD_PARAM;
+    	return (plc_tag)tag;
+    }
+
 	/*
 	 * now we start the part that might conflict with other threads.
 	 *
@@ -161,24 +205,14 @@ plc_tag ab_tag_create(attr attribs)
 			break;
 		}
 
-		/*
-		 * Check the request IO handler thread.
-		 */
-		if(!io_handler_thread) {
-			rc = thread_create((thread_p*)&io_handler_thread,request_handler_func, 32*1024, NULL);
-			if(rc != PLCTAG_STATUS_OK) {
-				pdebug(debug,"Unable to create request handler thread!");
-				tag->status = rc;
-				break;
-			}
-		}
-
 		/*
 		 * Find or create a session.
 		 */
-		if(find_or_create_session(tag, attribs) != PLCTAG_STATUS_OK) {
+		rc = find_or_create_session(tag, attribs);
+
+		if(rc != PLCTAG_STATUS_OK) {
 			pdebug(debug,"Unable to create session!");
-			tag->status = PLCTAG_ERR_BAD_GATEWAY;
+			tag->status = rc;
 			break;
 		}
 
@@ -196,6 +230,27 @@ plc_tag ab_tag_create(attr attribs)
 		}
 
 
+		/*
+		 * Logix tags share a CIP connection with other tags going to the
+		 * same PLC unless asked not to.
+		 */
+		if(tag->protocol_type == AB_PROTOCOL_LGX && use_connected_msg) {
+			if(connection_find_or_create_unsafe(tag, tag->session) != PLCTAG_STATUS_OK) {
+				pdebug(debug,"Unable to create connection!");
+				tag->status = PLCTAG_ERR_CREATE;
+				break;
+			}
+
+			/* the IO thread reads the symbol table on the connection. */
+			if(use_instance_id) {
+				critical_block(tag->session->mutex) {
+					tag->connection->use_symbols = 1;
+				}
+
+				tag->instance_state = AB_INSTANCE_UNRESOLVED;
+			}
+		}
+
 		/*
 		 * check the tag name, this is protocol specific.
 		 */
@@ -206,6 +261,23 @@ plc_tag ab_tag_create(attr attribs)
 			break;
 		}
 
+		/*
+		 * start from what the last run found out about the tag if
+		 * it is in a metadata cache file.  The cache only holds hints,
+		 * so without it the tag finds things out on its first read.
+		 */
+		if(tag->protocol_type == AB_PROTOCOL_LGX) {
+			rc = tag_cache_open_unsafe(tag, attribs);
+
+			if(rc == PLCTAG_STATUS_OK) {
+				rc = eip_cip_tag_restore(tag);
+			}
+
+			if(rc != PLCTAG_STATUS_OK) {
+				pdebug(debug,"Unable to use the metadata cache, rc=%d.  Continuing without it.",rc);
+			}
+		}
+
 		/*
 		 * add the tag to the session's list.
 		 */
@@ -217,6 +289,9 @@ plc_tag ab_tag_create(attr attribs)
 		}
     }
 
+    /* sessions that failed to set up may have left a stopped IO thread. */
+    io_worker_reap();
+
     pdebug(debug,"Done.");
 
     return (plc_tag)tag;
@@ -241,6 +316,7 @@ tag_vtable_p set_tag_vtable(ab_tag_p tag)
 				if(!plc_dhp_vtable.abort) {
 					plc_dhp_vtable.abort     = (tag_abort_func)ab_tag_abort;
 					plc_dhp_vtable.destroy   = (tag_destroy_func)ab_tag_destroy;
+					plc_dhp_vtable.start     = (tag_start_func)ab_tag_start;
 					plc_dhp_vtable.read      = (tag_read_func)eip_dhp_pccc_tag_read_start;
 					plc_dhp_vtable.status    = (tag_status_func)eip_dhp_pccc_tag_status;
 					plc_dhp_vtable.write     = (tag_write_func)eip_dhp_pccc_tag_write_start;
@@ -250,6 +326,7 @@ tag_vtable_p set_tag_vtable(ab_tag_p tag)
 				if(!plc_vtable.abort) {
 					plc_vtable.abort     = (tag_abort_func)ab_tag_abort;
 					plc_vtable.destroy   = (tag_destroy_func)ab_tag_destroy;
+					plc_vtable.start     = (tag_start_func)ab_tag_start;
 					plc_vtable.read      = (tag_read_func)eip_pccc_tag_read_start;
 					plc_vtable.status    = (tag_status_func)eip_pccc_tag_status;
 					plc_vtable.write     = (tag_write_func)eip_pccc_tag_write_start;
@@ -262,6 +339,7 @@ tag_vtable_p set_tag_vtable(ab_tag_p tag)
 			if(!plc_vtable.abort) {
 				plc_vtable.abort     = (tag_abort_func)ab_tag_abort;
 				plc_vtable.destroy   = (tag_destroy_func)ab_tag_destroy;
+				plc_vtable.start     = (tag_start_func)ab_tag_start;
 				plc_vtable.read      = (tag_read_func)eip_pccc_tag_read_start;
 				plc_vtable.status    = (tag_status_func)eip_pccc_tag_status;
 				plc_vtable.write     = (tag_write_func)eip_pccc_tag_write_start;
@@ -274,6 +352,7 @@ tag_vtable_p set_tag_vtable(ab_tag_p tag)
 			if(!cip_vtable.abort) {
 				cip_vtable.abort     = (tag_abort_func)ab_tag_abort;
 				cip_vtable.destroy   = (tag_destroy_func)ab_tag_destroy;
+				cip_vtable.start     = (tag_start_func)ab_tag_start;
 				cip_vtable.read      = (tag_read_func)eip_cip_tag_read_start;
 				cip_vtable.status    = (tag_status_func)eip_cip_tag_status;
 				cip_vtable.write     = (tag_write_func)eip_cip_tag_write_start;
@@ -36,6 +36,7 @@
 
 
 plc_tag ab_tag_create(attr attribs);
+int ab_request_pool_stats(uint64_t *hits, uint64_t *misses, int *num_free);
 
 
 
@@ -42,7 +42,15 @@
 #define MAX_MSG_SIZE		(1024)
 #define MAX_TAG_NAME 		(64)
 #define MAX_TAG_TYPE_INFO 	(64)
-#define MAX_REQ_RESP_SIZE	(768) /* enough? */
+#define MAX_REQ_RESP_SIZE	(768) /* default buffer size, enough for a standard packet */
+#define MAX_LARGE_REQ_RESP_SIZE	(MAX_CIP_LARGE_PAYLOAD_SIZE + 128) /* buffers grow up to this for Large Forward Open */
+
+/*
+ * requests and their buffers are recycled through a pool.  Buffers come
+ * in two sizes, MAX_REQ_RESP_SIZE and MAX_LARGE_REQ_RESP_SIZE.  This
+ * is how many of each are kept around when they are not in use.
+ */
+#define REQUEST_POOL_MAX_FREE	(256)
 #define MAX_EIP_PACKET_SIZE	(540) /*
 								   * AB says somewhere that you must
 								   * support packets of 544 bytes.  We support 768.  That should
@@ -52,6 +60,13 @@
 								   * Hopefully 540 is safe.  This should be checked.
 								   */
 
+/*
+ * CIP payload sizes of a class 3 connection.  Large Forward Open allows
+ * up to 4002 bytes.  Older PLCs only do the standard 504 bytes.
+ */
+#define MAX_CIP_STD_PAYLOAD_SIZE	(504)
+#define MAX_CIP_LARGE_PAYLOAD_SIZE	(4002)
+
 #define MAX_PCCC_PACKET_SIZE (244) /*
 									* That's what the docs say.
 									*
@@ -60,6 +75,8 @@
 
 #define DEFAULT_MAX_REQUESTS (10)	/* number of requests and request sizes to allocate by default. */
 
+#define MAX_PACKED_REQS		(100)	/* most CIP requests we put into one Multiple Service Packet. */
+
 
 /* AB Constants*/
 #define AB_EIP_OK   (0)
@@ -82,18 +99,34 @@
 #define AB_EIP_CMD_FORWARD_CLOSE    	((uint8_t)0x4E)
 #define AB_EIP_CMD_UNCONNECTED_SEND 	((uint8_t)0x52)
 #define AB_EIP_CMD_FORWARD_OPEN     	((uint8_t)0x54)
+#define AB_EIP_CMD_FORWARD_OPEN_EX  	((uint8_t)0x5B)
 
 /* CIP embedded packet commands */
 #define AB_EIP_CMD_CIP_READ         	((uint8_t)0x4C)
 #define AB_EIP_CMD_CIP_WRITE        	((uint8_t)0x4D)
 #define AB_EIP_CMD_CIP_READ_FRAG		((uint8_t)0x52)
 #define AB_EIP_CMD_CIP_WRITE_FRAG		((uint8_t)0x53)
+#define AB_EIP_CMD_CIP_MULTI			((uint8_t)0x0A)
+#define AB_EIP_CMD_CIP_LIST_INSTANCES	((uint8_t)0x55) /* Get Instance Attribute List */
 
 /* flag set when command is OK */
 #define AB_EIP_CMD_CIP_OK           	((uint8_t)0x80)
 
 #define AB_CIP_STATUS_OK				((uint8_t)0x00)
 #define AB_CIP_STATUS_FRAG				((uint8_t)0x06)
+#define AB_CIP_STATUS_EMBEDDED_ERR		((uint8_t)0x1E)
+#define AB_CIP_STATUS_NO_RESOURCE		((uint8_t)0x02)
+#define AB_CIP_STATUS_PATH_SEGMENT_ERR	((uint8_t)0x04)
+#define AB_CIP_STATUS_PATH_DEST_UNKNOWN	((uint8_t)0x05)
+
+/* the Symbol Object, one instance per tag in a Logix PLC */
+#define AB_CIP_SYMBOL_CLASS				((uint8_t)0x6B)
+#define AB_CIP_SYMBOL_ATTR_NAME			(1)
+#define AB_CIP_SYMBOL_ATTR_TYPE			(2)
+#define AB_CIP_SYMBOL_TYPE_SYSTEM		(0x1000) /* controller internal, not for us */
+
+/* EIP encapsulation status when the target is out of memory */
+#define AB_EIP_ERR_NO_MEMORY	(0x0002)
 
 /* PCCC commands */
 #define AB_EIP_PCCC_TYPED_CMD ((uint8_t)0x0F)
@@ -169,8 +202,16 @@
 #define AB_EIP_PLC5_PARAM 0x4302
 #define AB_EIP_SLC_PARAM 0x4302
 #define AB_EIP_LGX_PARAM 0x43F8
+#define AB_EIP_LGX_PARAM_EX (0x42000000 | MAX_CIP_LARGE_PAYLOAD_SIZE) /* 32-bit params for Large Forward Open */
 #define AB_EIP_TRANSPORT 0xA3
 
+/* connected messaging, the RPI is in microseconds */
+#define AB_EIP_CONN_RPI 1000000
+#define AB_EIP_CONN_TIMEOUT_MULTIPLIER 0x05 /* 4 << 5 = 128 RPIs before the target drops us */
+#define AB_EIP_CONN_IDLE_REOPEN_MS (60000) /* reopen connections idle longer than this */
+#define AB_EIP_CONN_CLOSE_TIMEOUT_MS (5000) /* give up on a Forward Close after this */
+#define AB_EIP_CONN_CLOSE_WAIT_MS (250) /* how long a closing session waits for Forward Close replies */
+
 
 /* EIP Item Types */
 #define AB_EIP_ITEM_NAI ((uint16_t)0x0000) /* NULL Address Item */
@@ -193,16 +234,32 @@
 typedef struct ab_session_t *ab_session_p;
 #define AB_SESSION_NULL ((ab_session_p)NULL)
 
-typedef struct ab_connection_t *ab_connection_old;
-#define AB_CONNECTION_NULL ((ab_connection_old)NULL)
+typedef struct ab_connection_t *ab_connection_p;
+#define AB_CONNECTION_NULL ((ab_connection_p)NULL)
 
 typedef struct ab_tag_t *ab_tag_p;
 #define AB_TAG_NULL ((ab_tag_p)NULL)
 
+typedef struct ab_tag_cache_t *ab_tag_cache_p;
+#define AB_TAG_CACHE_NULL ((ab_tag_cache_p)NULL)
+
 
 typedef struct ab_request_t *ab_request_p;
 #define AB_REQUEST_NULL ((ab_request_p)NULL)
 
+typedef struct ab_io_worker_t *ab_io_worker_p;
+#define AB_IO_WORKER_NULL ((ab_io_worker_p)NULL)
+
+/*
+ * a sent request and the key its response is matched on.  Connected
+ * replies are matched by connection ID and sequence number, all others
+ * by the encapsulation sender context.
+ */
+struct ab_dispatch_entry_t {
+    uint64_t key;
+    ab_request_p req;
+};
+
 
 /*struct ab_protocol_t {
     struct plc_protocol_t p_protocol;
@@ -213,16 +270,162 @@ typedef struct ab_request_t *ab_request_p;
 
 
 #define MAX_REQS_IN_FLIGHT	(20)
+#define DEFAULT_REQS_IN_FLIGHT	(5)
+
+/*
+ * the in-flight window of a session adapts to the PLC.  It grows by one
+ * for each full window of good responses while requests are waiting for
+ * a slot, and is cut in half, at most once per round trip, when the
+ * round trip time goes over twice the lowest seen plus the slack or the
+ * PLC reports it is out of resources.  The lowest round trip time is
+ * forgotten after a while in case the route to the PLC changes.
+ */
+#define WINDOW_RTT_SLACK_MS		(2)
+#define WINDOW_MIN_RTT_RESET_MS	(10000)
+
+/* how long the IO thread waits for socket events before checking anyway */
+#define IO_THREAD_IDLE_WAIT_MS	(100)
+
+/* starting size of the session hash table, always a power of two */
+#define SESSION_TABLE_MIN_SIZE	(64)
+
+/*
+ * starting size of a session's table of requests waiting for a
+ * response, always a power of two.  It is kept at most half full.
+ */
+#define DISPATCH_TABLE_MIN_SIZE	(64)
+
+/*
+ * starting size of a connection's symbol table, always a power of
+ * two.  It is kept at most half full.
+ */
+#define SYMBOL_TABLE_MIN_SIZE	(256)
+
+/* maximum number of shared IO threads that sessions are spread across */
+#define MAX_IO_THREADS		(16)
+#define DEFAULT_IO_THREADS	(1)
+
+/*
+ * a session pool opens several sessions to the same gateway.  Each
+ * member uses a different range of connection IDs so that the PLC
+ * does not see duplicate connection serial numbers.
+ */
+#define MAX_SESSION_POOL_SIZE		(16)
+#define SESSION_POOL_CONN_ID_STEP	(0x1000)
+
+/*
+ * auto sync tags are kept on a timer wheel in their IO worker.  Each
+ * slot covers one tick.  Tags due further out than one turn of the
+ * wheel just stay in their slot until their time comes.
+ */
+#define AUTO_SYNC_TICK_MS	(5)
+#define AUTO_SYNC_WHEEL_SLOTS	(256)
+
+/*
+ * request deadlines are kept on a hierarchical timer wheel in each
+ * session.  Each level has REQUEST_TIMER_SLOTS slots, each slot of a
+ * level covers a whole turn of the level below.  Three levels of 64
+ * slots at 10ms cover about 45 minutes, longer timeouts are put in
+ * the last slot and moved down as time goes on.
+ */
+#define REQUEST_TIMER_TICK_MS	(10)
+#define REQUEST_TIMER_BITS		(6)
+#define REQUEST_TIMER_SLOTS		(1 << REQUEST_TIMER_BITS)
+#define REQUEST_TIMER_LEVELS	(3)
+
+/*
+ * request priorities.  Higher priority requests are sent first.  Bulk
+ * requests are not sent into the last free in-flight slot so that the
+ * others never wait behind a full window of them.
+ */
+#define AB_PRIORITY_HIGH	(0)
+#define AB_PRIORITY_NORMAL	(1)
+#define AB_PRIORITY_BULK	(2)
+#define AB_NUM_PRIORITIES	(3)
+
+
+/*
+ * An IO worker is a thread with its own poller that services
+ * a set of sessions.  Sessions are either spread across a small
+ * shared pool of workers or each get a dedicated worker.
+ */
+
+struct ab_io_worker_t {
+    thread_p thread;
+    poller_p poller;
+
+    /* protects the session list below */
+    mutex_p mutex;
+
+    /* sessions serviced by this worker, linked via worker_next */
+    ab_session_p sessions;
+    int num_sessions;
+
+    /* dedicated workers are shut down with their session */
+    int dedicated;
+
+    /* stopped workers waiting to be joined, protected by io_thread_mutex */
+    ab_io_worker_p stopped_next;
+
+    /* tags whose callbacks are run after each pass, only used by the worker thread */
+    ab_tag_p *callback_tags;
+    int num_callback_tags;
+    int max_callback_tags;
+
+    /* auto sync scan wheel, protected by the mutex */
+    ab_tag_p scan_wheel[AUTO_SYNC_WHEEL_SLOTS];
+    int64_t scan_time;
+    int num_scan_tags;
+    unsigned int scan_seq;
+
+    /* sessions still connecting or with request deadlines are checked every tick */
+    int num_connecting;
+    int num_timed;
+
+    /* tags due for a scan, only used by the worker thread */
+    ab_tag_p *due_tags;
+    int num_due_tags;
+    int max_due_tags;
+    volatile int terminate;
+};
 
 struct ab_session_t {
+    /* hash bucket chain */
     ab_session_p next;
     ab_session_p prev;
+    unsigned int hash;
+
+    /* the IO worker that handles this session */
+    ab_io_worker_p worker;
+    ab_session_p worker_next;
+
+    /*
+     * session pool.  The first session of a pool is the one in the
+     * registry and the one with the tags.  New requests go to the
+     * member with the fewest outstanding requests.
+     */
+    ab_session_p pool_head;
+    ab_session_p pool_next;
+    volatile int num_outstanding;
+
+    /*
+     * protects the request list and the IO state below.  The global
+     * io_thread_mutex only protects the session and tag lists.
+     */
+    mutex_p mutex;
 
     /* gateway connection related info */
     char host[MAX_SESSION_HOST];
     int port;
     sock_p sock;
-    int is_connected;
+    int is_connected;	/* the socket is connected and in the IO thread's poller */
+
+    /* set up state, requests are only sent once the session is ready. */
+    int state;
+    int status;
+    int64_t setup_deadline;
+    ab_request_p register_req;
+    int debug;
 
     /* registration info */
     uint32_t session_handle;
@@ -231,22 +434,87 @@ struct ab_session_t {
     uint64_t session_seq_id;
 
     /* a list of the connections on this session */
-    //ab_connection connections;
-
-    /* current request being sent, only one at a time */
-    ab_request_p current_request;
-
-    /* list of outstanding requests for this session */
+    ab_connection_p connections;
+    uint32_t last_conn_id;
+
+    /*
+     * requests ready to go out, in the order they are written.  Each
+     * pass writes as much of the queue as the socket takes in one
+     * gathered write.
+     */
+    ab_request_p send_queue;
+    ab_request_p send_queue_tail;
+
+    /* are we waiting for the socket to accept more data? */
+    int watching_write;
+
+    /*
+     * list of outstanding requests for this session.  It is kept in
+     * priority order, prio_tail has the last request of each priority.
+     */
     ab_request_p requests;
-
-    /* counter for number of messages in flight */
+    ab_request_p requests_tail;
+    ab_request_p prio_tail[AB_NUM_PRIORITIES];
+
+    /*
+     * the requests that have been sent, hashed by what the response
+     * will be matched on.  Open addressing with linear probing.
+     */
+    struct ab_dispatch_entry_t *dispatch;
+    int dispatch_size;
+    int dispatch_count;
+
+    /*
+     * deadlines of the requests, see session_timer_add_unsafe().
+     * timer_time is the start of the next tick to be handled.
+     */
+    ab_request_p timer_wheel[REQUEST_TIMER_LEVELS][REQUEST_TIMER_SLOTS];
+    int64_t timer_time;
+    int num_timers;
+
+    /*
+     * new requests are pushed here by tag threads without taking
+     * any lock.  The IO thread moves them to the list above.
+     */
+    ab_request_p volatile submit_queue;
+
+    /*
+     * counter for number of messages in flight.  Responses are matched
+     * to requests by the sender context or connection sequence number,
+     * so they do not need to come back in order.
+     */
     int num_reqs_in_flight;
-
-    /* data for receiving messages */
+    int max_reqs_in_flight;
+
+    /* adaptive in-flight window, see session_window_update_unsafe() */
+    int window;
+    int window_acks;
+    int window_limited;
+    int64_t window_cut_time;
+    int min_rtt_ms;
+    int64_t min_rtt_time;
+    int srtt_x8;	/* smoothed round trip time in 1/8 ms */
+
+    /*
+     * set when requests finish so that waiting threads get woken up.
+     * Threads waiting on the session's tags sleep on io_event.
+     */
+    int reqs_done;
+    event_p io_event;
+
+    /*
+     * data for receiving messages.  Packets are taken off the receive
+     * buffer from recv_start, recv_offset is the end of the data read
+     * so far.  resp_size is the size of the complete packet at
+     * recv_start when has_response is set.
+     */
     uint64_t resp_seq_id;
     int has_response;
+    int recv_start;
     int recv_offset;
-    uint8_t recv_data[MAX_REQ_RESP_SIZE];
+    int resp_size;
+    uint8_t *recv_data;
+    int recv_buf_size;
 
     /*int recv_size;*/
 
@@ -257,32 +525,86 @@ struct ab_session_t {
 /*#define session_buf_clear(sess,size) do { if(sess) memset(sess->buf,0,size); } while(0)*/
 
 
-struct ab_connection_t_old {
-    //ab_connection next;
-    //ab_connection prev;
+/*
+ * session states.  The IO thread takes a new session through the TCP
+ * connect and the EIP session registration without blocking.
+ */
+#define AB_SESSION_CONNECTING	(0)
+#define AB_SESSION_REGISTERING	(1)
+#define AB_SESSION_READY		(2)
+#define AB_SESSION_FAILED		(3)
+
+/* how long a session has to connect and register */
+#define AB_SESSION_SETUP_TIMEOUT_MS	(10000)
+
+/* connection states */
+#define AB_CONNECTION_NOT_OPEN	(0)
+#define AB_CONNECTION_OPENING	(1)
+#define AB_CONNECTION_OPEN		(2)
+#define AB_CONNECTION_FAILED	(3)
+
+/* states of a connection's symbol table */
+#define AB_SYMBOLS_NOT_LOADED	(0)
+#define AB_SYMBOLS_LOADING		(1)
+#define AB_SYMBOLS_LOADED		(2)
+#define AB_SYMBOLS_FAILED		(3)
+
+/* how long each page of the symbol table has to come back */
+#define AB_SYMBOLS_BROWSE_TIMEOUT_MS	(5000)
+
+/* how a tag names itself in requests */
+#define AB_INSTANCE_SYMBOLIC	(0) /* by name, always */
+#define AB_INSTANCE_UNRESOLVED	(1) /* by name until the symbol table has its instance ID */
+#define AB_INSTANCE_USED		(2) /* by Symbol Object instance ID */
 
-    char *path;
+/*
+ * a tag in the PLC's symbol table.  The table is open addressed,
+ * keyed on the name without case like the PLC does.
+ */
+struct ab_symbol_t {
+    char *name;
+    uint32_t hash;
+    uint32_t instance;
+};
+
+/*
+ * A class 3 CIP connection to one PLC.  All tags on a session that
+ * share the same route path share one connection.  The IO thread
+ * opens it with Forward Open when the first request needs it.
+ */
+
+struct ab_connection_t {
+    ab_connection_p next;
 
     ab_session_p session;
 
-    int is_connected;
+    /* protected by the session mutex */
+    int state;
+
     uint32_t targ_connection_id; /* the ID the target uses for this connection. */
     uint32_t orig_connection_id; /* the ID we use for this connection */
-    uint16_t packet;
     uint16_t conn_serial_number;
     uint16_t conn_seq_num;
+    int64_t last_used_ms;
+
+    /* try Large Forward Open first, then the standard one. */
+    int try_large;
+    int max_payload_size;
 
-    /* need to save the connection path for later */
+    /* the route to the PLC, this is what identifies the connection */
     uint8_t conn_path[MAX_CONN_PATH];
     uint8_t conn_path_size;
 
-    /* how do we talk to this device? */
-    int protocol_type;
-    int use_dhp_direct;
-    uint8_t dhp_src;
-    uint8_t dhp_dest;
-
-    ab_tag_p tags;
+    /*
+     * Symbol Object instance IDs of the PLC's tags.  Read once the
+     * connection is open if a tag wants them.  Protected by the session
+     * mutex.
+     */
+    int use_symbols;
+    int symbol_state;
+    struct ab_symbol_t *symbols;
+    int symbols_size;
+    int symbols_count;
 };
 
 
@@ -302,10 +624,18 @@ struct ab_tag_t {
     /* pointers back to session */
     ab_session_p session;
 
+    /* the CIP connection to use, NULL for unconnected messaging */
+    ab_connection_p connection;
+
     /* this contains the encoded name */
     uint8_t encoded_name[MAX_TAG_NAME];
     int encoded_name_size;
 
+    /* the name by symbol, for when the instance ID does not work. */
+    uint8_t symbolic_name[MAX_TAG_NAME];
+    int symbolic_name_size;
+    int instance_state;
+
     /* the connection IOI path */
     uint8_t conn_path[MAX_CONN_PATH];
     uint8_t conn_path_size;
@@ -332,6 +662,30 @@ struct ab_tag_t {
 
     ab_request_p *reqs;
 
+    /* can requests be packed with other tags' requests? */
+    int allow_packing;
+
+    /* requests that are not done after this long fail with PLCTAG_ERR_TIMEOUT, zero for never */
+    int timeout_ms;
+
+    /* one of the AB_PRIORITY_* values for the tag's requests */
+    int priority;
+
+    /* the metadata cache file and the tag's key in it, NULL if not cached */
+    ab_tag_cache_p metadata_cache;
+    char *metadata_cache_key;
+    int metadata_unchecked; /* type info came from the cache and no reply has confirmed it */
+    int metadata_dirty; /* the cache entry needs to be written again */
+
+    /* IO worker references while it runs callbacks or scans, protected by the session mutex */
+    int worker_refs;
+
+    /* auto sync scanning, protected by the worker mutex */
+    ab_tag_p scan_next;
+    int scan_ms;
+    int64_t scan_due;
+    int64_t next_read_time;
+
     /* flags for operations */
     int read_in_progress;
     int write_in_progress;
@@ -346,6 +700,8 @@ struct ab_tag_t {
 
 struct ab_request_t {
 	ab_request_p next; 	/* for linked list */
+	ab_request_p prev;
+	ab_request_p send_next;	/* for the session's send queue */
 
 	int req_id; 		/* which request is this for the tag? */
 	int data_size; 		/* how many bytes did we get? */
@@ -364,15 +720,57 @@ struct ab_request_t {
 	int processed;
 
 	ab_session_p session;
+	int counted;	/* included in the session's num_outstanding */
 
 	uint64_t session_seq_id;
 	uint32_t conn_id;
 	uint16_t conn_seq;
+	int64_t send_time;	/* when it was all written, for the round trip time */
+
+	/* the key the request is in the session's dispatch table under */
+	uint64_t dispatch_key;
+	int in_dispatch;
+
+	/* where the request goes in the session's list, one of AB_PRIORITY_* */
+	int priority;
+
+	/*
+	 * the IO thread fails the request with PLCTAG_ERR_TIMEOUT if it is
+	 * not done by the deadline.  timer_list is the wheel slot it is in.
+	 */
+	int timeout_ms;
+	int64_t deadline;
+	ab_request_p timer_next;
+	ab_request_p timer_prev;
+	ab_request_p *timer_list;
+
+	/* send via this connection if it is open, else unconnected */
+	ab_connection_p connection;
+
+	/* for a Forward Open request, the connection it opens */
+	ab_connection_p open_connection;
+
+	/* for a symbol table browse, the connection whose table it fills */
+	ab_connection_p browse_connection;
+
+	/* a Forward Close, nobody waits on it */
+	int close_connection;
+
+	/*
+	 * small CIP requests going to the same place can be packed together
+	 * into one Multiple Service Packet request by the IO thread.
+	 */
+	int allow_packing;
+	int resp_size_hint;			/* expected size of the CIP reply, including the reply header */
+	ab_request_p packed_in;		/* the packet request this one was packed into */
+	ab_request_p *packed_reqs;	/* for a packet request, the requests in it */
+	int num_packed_reqs;
 
 	/* used by the background thread for incrementally getting data */
 	int current_offset;
 	int request_size; /* total bytes, not just data */
-	uint8_t data[MAX_REQ_RESP_SIZE];
+	int buf_size; /* size of the data buffer, it grows to fit large responses */
+	uint8_t *data;
 };
 
 
@@ -471,6 +869,52 @@ START_PACK typedef struct {
 } END_PACK eip_forward_open_request;
 
 
+/* Large Forward Open Request, the connection params are 32-bit */
+START_PACK typedef struct {
+    /* encap header */
+    uint16_t encap_command;    /* ALWAYS 0x006f Unconnected Send*/
+    uint16_t encap_length;   /* packet size in bytes - 24 */
+    uint32_t encap_session_handle;  /* from session set up */
+    uint32_t encap_status;          /* always _sent_ as 0 */
+    uint64_t encap_sender_context;  /* used for matching the response */
+    uint32_t encap_options;         /* 0, reserved for future use */
+
+    /* Interface Handle etc. */
+    uint32_t interface_handle;      /* ALWAYS 0 */
+    uint16_t router_timeout;        /* in seconds */
+
+    /* Common Packet Format - CPF Unconnected */
+    uint16_t cpf_item_count;        /* ALWAYS 2 */
+    uint16_t cpf_nai_item_type;     /* ALWAYS 0 */
+    uint16_t cpf_nai_item_length;   /* ALWAYS 0 */
+    uint16_t cpf_udi_item_type;     /* ALWAYS 0x00B2 - Unconnected Data Item */
+    uint16_t cpf_udi_item_length;   /* REQ: fill in with length of remaining data. */
+
+    /* CM Service Request - Connection Manager */
+    uint8_t cm_service_code;        /* ALWAYS 0x5B Large Forward Open Request */
+    uint8_t cm_req_path_size;       /* ALWAYS 2, size in words of path, next field */
+    uint8_t cm_req_path[4];         /* ALWAYS 0x20,0x06,0x24,0x01 for CM, instance 1*/
+
+    /* Forward Open Params */
+    uint8_t secs_per_tick;       	/* seconds per tick */
+    uint8_t timeout_ticks;       	/* timeout = srd_secs_per_tick * src_timeout_ticks */
+    uint32_t orig_to_targ_conn_id;  /* 0, returned by target in reply. */
+    uint32_t targ_to_orig_conn_id;  /* our ID for this connection */
+    uint16_t conn_serial_number;    /* our connection serial number */
+    uint16_t orig_vendor_id;        /* our unique vendor ID */
+    uint32_t orig_serial_number;    /* our unique serial number */
+    uint8_t conn_timeout_multiplier;/* timeout = mult * RPI */
+    uint8_t reserved[3];            /* reserved, set to 0 */
+    uint32_t orig_to_targ_rpi;      /* us to target RPI - Request Packet Interval in microseconds */
+    uint32_t orig_to_targ_conn_params; /* connection type and packet size */
+    uint32_t targ_to_orig_rpi;      /* target to us RPI, in microseconds */
+    uint32_t targ_to_orig_conn_params; /* connection type and packet size */
+    uint8_t transport_class;        /* ALWAYS 0xA3, server transport, class 3, application trigger */
+    uint8_t path_size;              /* size of connection path in 16-bit words */
+    uint8_t conn_path[ZLA_SIZE];    /* connection path as for Forward Open */
+} END_PACK eip_forward_open_request_ex;
+
+
 /* Forward Open Response */
 START_PACK typedef struct {
     /* encap header */
@@ -867,6 +1311,69 @@ START_PACK typedef struct {
 
 
 
+/* CIP Connected Request, the CIP request follows directly */
+START_PACK typedef struct {
+    /* encap header */
+    uint16_t encap_command;    		/* ALWAYS 0x0070 Connected Send */
+    uint16_t encap_length;   		/* packet size in bytes - 24 */
+    uint32_t encap_session_handle;  /* from session set up */
+    uint32_t encap_status;          /* always _sent_ as 0 */
+    uint64_t encap_sender_context;	/* not used to match connected responses */
+    uint32_t encap_options;         /* 0, reserved for future use */
+
+    /* Interface Handle etc. */
+    uint32_t interface_handle;      /* ALWAYS 0 */
+    uint16_t router_timeout;        /* in seconds, zero for Connected Sends! */
+
+    /* Common Packet Format - CPF Connected */
+    uint16_t cpf_item_count;        /* ALWAYS 2 */
+    uint16_t cpf_cai_item_type;     /* ALWAYS 0x00A1 Connected Address Item */
+    uint16_t cpf_cai_item_length;   /* ALWAYS 4 */
+    uint32_t cpf_targ_conn_id;      /* the connection id from Forward Open */
+    uint16_t cpf_cdi_item_type;     /* ALWAYS 0x00B1, Connected Data Item type */
+    uint16_t cpf_cdi_item_length;   /* length in bytes of the rest of the packet */
+
+    /* Connection sequence number */
+    uint16_t cpf_conn_seq_num;      /* connection sequence ID, inc for each message */
+
+    /* CIP request, embedded packet */
+} END_PACK eip_cip_co_req;
+
+
+/* CIP Connected Response */
+START_PACK typedef struct {
+    /* encap header */
+    uint16_t encap_command;    		/* ALWAYS 0x0070 Connected Send */
+    uint16_t encap_length;   		/* packet size in bytes - 24 */
+    uint32_t encap_session_handle;  /* from session set up */
+    uint32_t encap_status;          /* always _sent_ as 0 */
+    uint64_t encap_sender_context;	/* not used to match connected responses */
+    uint32_t encap_options;         /* 0, reserved for future use */
+
+    /* Interface Handle etc. */
+    uint32_t interface_handle;      /* ALWAYS 0 */
+    uint16_t router_timeout;        /* in seconds, zero for Connected Sends! */
+
+    /* Common Packet Format - CPF Connected */
+    uint16_t cpf_item_count;        /* ALWAYS 2 */
+    uint16_t cpf_cai_item_type;     /* ALWAYS 0x00A1 Connected Address Item */
+    uint16_t cpf_cai_item_length;   /* ALWAYS 4 */
+    uint32_t cpf_orig_conn_id;      /* our connection ID, NOT the target's */
+    uint16_t cpf_cdi_item_type;     /* ALWAYS 0x00B1, Connected Data Item type */
+    uint16_t cpf_cdi_item_length;   /* length in bytes of the rest of the packet */
+
+    /* connection sequence number from request */
+    uint16_t cpf_conn_seq_num;
+
+    /* CIP reply, embedded packet */
+    uint8_t reply_service;
+    uint8_t reserved;
+    uint8_t status;
+    uint8_t num_status_words;
+} END_PACK eip_cip_co_resp;
+
+
+
 /* CIP "native" Unconnected Request */
 START_PACK typedef struct {
     /* encap header */
@@ -399,3 +399,852 @@ int cip_encode_tag_name(ab_tag_p tag,const char *name)
 
 
 
+/*
+ * cip_encode_instance_name()
+ *
+ * Swap the symbolic segment at the start of the tag's encoded name
+ * for the Symbol Object class and instance.  Element and member
+ * segments after it stay as they are.  The symbolic form is kept in
+ * the tag for when the PLC does not know the instance.
+ */
+
+int cip_encode_instance_name(ab_tag_p tag, uint32_t instance)
+{
+    uint8_t buf[MAX_TAG_NAME];
+    uint8_t *dp = buf + 1;
+    int sym_size = 2 + tag->encoded_name[2] + (tag->encoded_name[2] & 0x01);
+    int rest_size = tag->encoded_name_size - 1 - sym_size;
+
+    *dp = 0x20; dp++;                  /* class */
+    *dp = AB_CIP_SYMBOL_CLASS; dp++;   /* Symbol Object */
+
+    if(instance > 0xFFFF) {
+        *dp = 0x26; dp++;  /* 4-byte instance */
+        *dp = 0; dp++;     /* padding */
+        *dp = instance & 0xFF; dp++;
+        *dp = (instance >> 8) & 0xFF; dp++;
+        *dp = (instance >> 16) & 0xFF; dp++;
+        *dp = (instance >> 24) & 0xFF; dp++;
+    } else if(instance > 0xFF) {
+        *dp = 0x25; dp++;  /* 2-byte instance */
+        *dp = 0; dp++;     /* padding */
+        *dp = instance & 0xFF; dp++;
+        *dp = (instance >> 8) & 0xFF; dp++;
+    } else {
+        *dp = 0x24; dp++;  /* 1-byte instance */
+        *dp = instance; dp++;
+    }
+
+    if((dp - buf) + rest_size > MAX_TAG_NAME) {
+        return PLCTAG_ERR_TOO_LONG;
+    }
+
+    mem_copy(dp, tag->encoded_name + 1 + sym_size, rest_size);
+    dp += rest_size;
+
+    buf[0] = ((dp - buf) - 1)/2;
+
+    mem_copy(tag->symbolic_name, tag->encoded_name, tag->encoded_name_size);
+    tag->symbolic_name_size = tag->encoded_name_size;
+
+    mem_copy(tag->encoded_name, buf, dp - buf);
+    tag->encoded_name_size = dp - buf;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+/*
+ * cip_request_route()
+ *
+ * Find the routing path at the end of an Unconnected Send request.
+ * It follows the embedded packet, padded to a 16-bit boundary.
+ */
+
+static uint8_t *cip_request_route(ab_request_p req, int *route_size)
+{
+    eip_cip_uc_req *cip = (eip_cip_uc_req *)(req->data);
+    int embed_size = le2h16(cip->uc_cmd_length);
+    uint8_t *route = req->data + sizeof(eip_cip_uc_req) + embed_size + (embed_size & 0x01);
+
+    *route_size = req->request_size - (route - req->data);
+
+    return route;
+}
+
+
+
+/*
+ * cip_max_packet_size()
+ *
+ * How big can an Unconnected Send style packet, request or reply, be
+ * when sent via the passed connection?  Unconnected messages and
+ * connections that are not open yet are held to the standard size.
+ *
+ * For an open connection, this is the Unconnected Send reply header
+ * plus the connection's payload less the connection sequence number.
+ *
+ * You must hold the session mutex before calling this!
+ */
+
+int cip_max_packet_size(ab_connection_p conn)
+{
+    if(!conn || conn->state != AB_CONNECTION_OPEN) {
+        return MAX_EIP_PACKET_SIZE;
+    }
+
+    return (sizeof(eip_cip_uc_resp) - 4) + (conn->max_payload_size - 2);
+}
+
+
+
+/*
+ * cip_pack_requests()
+ *
+ * Look for other requests queued on the session that go to the same
+ * place as the passed one and combine as many as will fit, request
+ * and reply, into a single Multiple Service Packet request.
+ *
+ * If fewer than two requests can be packed, *pkt is set to NULL and
+ * nothing is changed.  Otherwise the packed requests are marked as
+ * sent and *pkt is the new request to send in their place.  It is up
+ * to the caller to put it into the session's request list.
+ *
+ * This must be called with the session mutex held.
+ */
+
+int cip_pack_requests(ab_session_p session, ab_request_p first, ab_request_p *pkt)
+{
+    ab_request_p members[MAX_PACKED_REQS];
+    int num_members = 0;
+    ab_request_p req;
+    eip_cip_uc_req *cip;
+    uint8_t *route;
+    int route_size;
+    int req_size;
+    int resp_size;
+    int max_packet;
+    uint8_t *data;
+    uint8_t *embed_start;
+    uint8_t *offsets;
+    int i;
+    int rc;
+
+    *pkt = NULL;
+
+    route = cip_request_route(first, &route_size);
+
+    /* an open connection may allow bigger packets. */
+    max_packet = cip_max_packet_size(first->connection);
+
+    /*
+     * fixed overhead for the request: the Unconnected Send wrapper, the
+     * Multiple Service Packet service and path, the count and the route.
+     */
+    req_size = sizeof(eip_cip_uc_req) + 6 + 2 + 1 + route_size;
+
+    /* fixed overhead for the reply: the wrapper, the reply header and count. */
+    resp_size = sizeof(eip_cip_uc_resp) + 2;
+
+    for(req = first; req && num_members < MAX_PACKED_REQS; req = req->next) {
+        int req_embed_size;
+        uint8_t *req_route;
+        int req_route_size;
+
+        if(!req->send_request || req->send_in_progress || req->abort_request || !req->allow_packing || req->packed_in) {
+            continue;
+        }
+
+        /* the packet goes out on the first request's connection. */
+        if(req->connection != first->connection) {
+            continue;
+        }
+
+        req_route = cip_request_route(req, &req_route_size);
+
+        if(req_route_size != route_size || mem_cmp(req_route, route, route_size)) {
+            continue;
+        }
+
+        req_embed_size = le2h16(((eip_cip_uc_req *)(req->data))->uc_cmd_length);
+
+        /* its reply is unpacked into its own buffer, so it must fit there. */
+        if((int)sizeof(eip_cip_uc_resp) + req->resp_size_hint > req->buf_size) {
+            if(req == first) {
+                return PLCTAG_STATUS_OK;
+            }
+
+            continue;
+        }
+
+        /* each one takes an offset as well as its own data. */
+        if(req_size + 2 + req_embed_size > max_packet || resp_size + 2 + req->resp_size_hint > max_packet) {
+            /* the first one will be sent on its own */
+            if(req == first) {
+                return PLCTAG_STATUS_OK;
+            }
+
+            continue;
+        }
+
+        req_size += 2 + req_embed_size;
+        resp_size += 2 + req->resp_size_hint;
+
+        members[num_members] = req;
+        num_members++;
+    }
+
+    if(num_members < 2) {
+        return PLCTAG_STATUS_OK;
+    }
+
+    rc = request_create(&req, max_packet);
+
+    if(rc != PLCTAG_STATUS_OK) {
+        return rc;
+    }
+
+    req->packed_reqs = (ab_request_p *)mem_alloc(num_members * sizeof(ab_request_p));
+
+    if(!req->packed_reqs) {
+        request_destroy(&req);
+        return PLCTAG_ERR_NO_MEM;
+    }
+
+    req->debug = first->debug;
+    req->session = session;
+    req->connection = first->connection;
+
+    cip = (eip_cip_uc_req *)(req->data);
+
+    /* copy the Unconnected Send wrapper from the first request */
+    mem_copy(req->data, first->data, sizeof(eip_cip_uc_req));
+
+    data = req->data + sizeof(eip_cip_uc_req);
+    embed_start = data;
+
+    /* Multiple Service Packet to the Message Router */
+    *data = AB_EIP_CMD_CIP_MULTI; data++;
+    *data = 2; data++;      /* path size in words */
+    *data = 0x20; data++;   /* class */
+    *data = 0x02; data++;   /* Message Router */
+    *data = 0x24; data++;   /* instance */
+    *data = 0x01; data++;   /* instance 1 */
+
+    /* the offsets are from the start of the count */
+    offsets = data;
+
+    *((uint16_t *)data) = h2le16(num_members);
+    data += 2 + (2 * num_members);
+
+    for(i = 0; i < num_members; i++) {
+        ab_request_p member = members[i];
+        int embed_size = le2h16(((eip_cip_uc_req *)(member->data))->uc_cmd_length);
+
+        *((uint16_t *)(offsets + 2 + (2 * i))) = h2le16(data - offsets);
+
+        mem_copy(data, member->data + sizeof(eip_cip_uc_req), embed_size);
+        data += embed_size;
+
+        /* this is being sent as part of the packet now */
+        member->send_request = 0;
+        member->packed_in = req;
+        req->packed_reqs[i] = member;
+    }
+
+    req->num_packed_reqs = num_members;
+
+    cip->uc_cmd_length = h2le16(data - embed_start);
+
+    /* the route must start on a 16-bit boundary */
+    if((data - embed_start) & 0x01) {
+        *data = 0;
+        data++;
+    }
+
+    mem_copy(data, route, route_size);
+    data += route_size;
+
+    cip->cpf_udi_item_length = h2le16(data - (uint8_t*)(&(cip->cm_service_code)));
+
+    req->request_size = data - req->data;
+    req->send_request = 1;
+
+    pdebug(req->debug,"Packed %d requests into one packet of %d bytes.", num_members, req->request_size);
+
+    *pkt = req;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cip_unpack_response()
+ *
+ * Split the reply to a Multiple Service Packet request into a normal
+ * Unconnected Send reply for each of the requests that were packed
+ * into it.  The tag code does not know that the requests were packed.
+ *
+ * This must be called with the session mutex held.
+ */
+
+int cip_unpack_response(ab_request_p pkt)
+{
+    eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(pkt->data);
+    int header_size = (uint8_t *)(&(resp->reply_service)) - pkt->data;
+    uint8_t *data;
+    uint8_t *data_end;
+    int count;
+    int i;
+    int rc = PLCTAG_STATUS_OK;
+
+    data = pkt->data + sizeof(eip_cip_uc_resp) + (resp->num_status_words * 2);
+    data_end = pkt->data + le2h16(resp->encap_length) + sizeof(eip_encap_t);
+
+    if(le2h16(resp->encap_status) != AB_EIP_OK) {
+        pdebug(pkt->debug,"EIP command failed, response code: %d",le2h16(resp->encap_status));
+        rc = PLCTAG_ERR_REMOTE_ERR;
+    } else if(resp->reply_service != (AB_EIP_CMD_CIP_MULTI | AB_EIP_CMD_CIP_OK)
+              || (resp->status != AB_CIP_STATUS_OK && resp->status != AB_CIP_STATUS_EMBEDDED_ERR)) {
+        pdebug(pkt->debug,"Multiple Service Packet failed, service %x status %x!",resp->reply_service,resp->status);
+        rc = PLCTAG_ERR_REMOTE_ERR;
+    } else if(data + 2 > data_end || (count = le2h16(*((uint16_t *)data))) != pkt->num_packed_reqs || data + 2 + (2 * count) > data_end) {
+        pdebug(pkt->debug,"Malformed Multiple Service Packet reply!");
+        rc = PLCTAG_ERR_BAD_DATA;
+    }
+
+    for(i = 0; i < pkt->num_packed_reqs; i++) {
+        ab_request_p member = pkt->packed_reqs[i];
+        eip_cip_uc_resp *member_resp;
+        uint8_t *reply = NULL;
+        uint8_t *reply_end = NULL;
+        int member_rc = rc;
+
+        /* was this one aborted? */
+        if(!member) {
+            continue;
+        }
+
+        member->packed_in = NULL;
+        pkt->packed_reqs[i] = NULL;
+
+        if(member_rc == PLCTAG_STATUS_OK) {
+            reply = data + le2h16(((uint16_t *)data)[1 + i]);
+            reply_end = (i + 1 < count) ? data + le2h16(((uint16_t *)data)[2 + i]) : data_end;
+
+            if(reply < data || reply >= reply_end || reply_end > data_end) {
+                member_rc = PLCTAG_ERR_BAD_DATA;
+            }
+        }
+
+        /* the reply may be bigger than the member's buffer. */
+        if(member_rc == PLCTAG_STATUS_OK && header_size + (reply_end - reply) > member->buf_size) {
+            int buf_size = header_size + (reply_end - reply);
+            uint8_t *buf = request_buf_alloc(&buf_size);
+
+            if(buf) {
+                request_buf_free(member->data, member->buf_size);
+                member->data = buf;
+                member->buf_size = buf_size;
+            } else {
+                pdebug(pkt->debug,"Unable to grow request buffer for packed reply!");
+                member_rc = PLCTAG_ERR_NO_MEM;
+            }
+        }
+
+        if(member_rc == PLCTAG_STATUS_OK) {
+            /* build a normal reply with the same header as the packet's */
+            member_resp = (eip_cip_uc_resp *)(member->data);
+
+            mem_copy(member->data, pkt->data, header_size);
+            mem_copy(member->data + header_size, reply, reply_end - reply);
+
+            member_resp->cpf_udi_item_length = h2le16(reply_end - reply);
+            member_resp->encap_length = h2le16(header_size + (reply_end - reply) - sizeof(eip_encap_t));
+
+            member->request_size = header_size + (reply_end - reply);
+        } else {
+            member->status = member_rc;
+        }
+
+        member->resp_received = 1;
+        member->send_request = 0;
+    }
+
+    return rc;
+}
+
+
+
+/*
+ * cip_build_forward_open()
+ *
+ * Fill in the passed request with a Forward Open for a class 3
+ * connection along the connection's path.  If the connection is to
+ * try for large packets, this is a Large Forward Open with 32-bit
+ * connection parameters.  The reply carries the ID the target wants
+ * us to use when we send to it.
+ */
+
+int cip_build_forward_open(ab_connection_p conn, ab_request_p req)
+{
+    eip_forward_open_request *fo = (eip_forward_open_request *)(req->data);
+    eip_forward_open_request_ex *fo_ex = (eip_forward_open_request_ex *)(req->data);
+    uint8_t *data;
+
+    /*
+     * the two requests are the same up to the connection parameters, fill
+     * in the common part with the standard struct.
+     */
+
+    /* encap fields */
+    fo->encap_command = h2le16(AB_EIP_READ_RR_DATA);
+
+    /* router timeout */
+    fo->router_timeout = h2le16(1);
+
+    /* Common Packet Format fields for unconnected send. */
+    fo->cpf_item_count      = h2le16(2);
+    fo->cpf_nai_item_type   = h2le16(AB_EIP_ITEM_NAI);
+    fo->cpf_nai_item_length = h2le16(0);
+    fo->cpf_udi_item_type   = h2le16(AB_EIP_ITEM_UDI);
+
+    /* Connection Manager */
+    fo->cm_service_code = (conn->try_large ? AB_EIP_CMD_FORWARD_OPEN_EX : AB_EIP_CMD_FORWARD_OPEN);
+    fo->cm_req_path_size = 2;
+    fo->cm_req_path[0] = 0x20;  /* class */
+    fo->cm_req_path[1] = 0x06;  /* Connection Manager */
+    fo->cm_req_path[2] = 0x24;  /* instance */
+    fo->cm_req_path[3] = 0x01;  /* instance 1 */
+
+    fo->secs_per_tick = AB_EIP_SECS_PER_TICK;
+    fo->timeout_ticks = AB_EIP_TIMEOUT_TICKS;
+
+    /* the target picks the O->T ID, we pick the T->O ID */
+    fo->orig_to_targ_conn_id = h2le32(0);
+    fo->targ_to_orig_conn_id = h2le32(conn->orig_connection_id);
+    fo->conn_serial_number = h2le16(conn->conn_serial_number);
+    fo->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);
+    fo->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);
+    fo->conn_timeout_multiplier = AB_EIP_CONN_TIMEOUT_MULTIPLIER;
+    fo->orig_to_targ_rpi = h2le32(AB_EIP_CONN_RPI);
+
+    if(conn->try_large) {
+        fo_ex->orig_to_targ_conn_params = h2le32(AB_EIP_LGX_PARAM_EX);
+        fo_ex->targ_to_orig_rpi = h2le32(AB_EIP_CONN_RPI);
+        fo_ex->targ_to_orig_conn_params = h2le32(AB_EIP_LGX_PARAM_EX);
+        fo_ex->transport_class = AB_EIP_TRANSPORT_CLASS_T3;
+
+        /* the path is already padded to 16-bit words */
+        fo_ex->path_size = conn->conn_path_size/2;
+        data = (uint8_t *)(&(fo_ex->conn_path[0]));
+    } else {
+        fo->orig_to_targ_conn_params = h2le16(AB_EIP_LGX_PARAM);
+        fo->targ_to_orig_rpi = h2le32(AB_EIP_CONN_RPI);
+        fo->targ_to_orig_conn_params = h2le16(AB_EIP_LGX_PARAM);
+        fo->transport_class = AB_EIP_TRANSPORT_CLASS_T3;
+
+        fo->path_size = conn->conn_path_size/2;
+        data = (uint8_t *)(&(fo->conn_path[0]));
+    }
+
+    mem_copy(data, conn->conn_path, conn->conn_path_size);
+    data += conn->conn_path_size;
+
+    fo->cpf_udi_item_length = h2le16(data - (uint8_t*)(&(fo->cm_service_code)));
+
+    req->request_size = data - req->data;
+    req->send_request = 1;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cip_check_forward_open_response()
+ *
+ * Check the reply to a Forward Open and get the ID that we must use
+ * when sending on the new connection.
+ */
+
+int cip_check_forward_open_response(ab_request_p req, uint32_t *targ_connection_id)
+{
+    eip_forward_open_response *fo_resp = (eip_forward_open_response *)(req->data);
+
+    if(req->status != PLCTAG_STATUS_OK) {
+        return req->status;
+    }
+
+    if(req->request_size < (int)sizeof(eip_forward_open_response)) {
+        pdebug(req->debug,"Forward Open reply too short!");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    if(le2h16(fo_resp->encap_status) != AB_EIP_OK) {
+        pdebug(req->debug,"Forward Open command failed, response code: %d",le2h16(fo_resp->encap_status));
+        return PLCTAG_ERR_REMOTE_ERR;
+    }
+
+    if((fo_resp->resp_service_code != (AB_EIP_CMD_FORWARD_OPEN | AB_EIP_CMD_CIP_OK)
+        && fo_resp->resp_service_code != (AB_EIP_CMD_FORWARD_OPEN_EX | AB_EIP_CMD_CIP_OK))
+       || fo_resp->general_status != AB_CIP_STATUS_OK) {
+        pdebug(req->debug,"Forward Open failed, service %x status %x!",fo_resp->resp_service_code,fo_resp->general_status);
+        return PLCTAG_ERR_REMOTE_ERR;
+    }
+
+    *targ_connection_id = le2h32(fo_resp->orig_to_targ_conn_id);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cip_build_forward_close()
+ *
+ * Fill in the passed request with a Forward Close for the connection.
+ * The target finds the connection by our serial numbers, so this must
+ * be built before the connection is given new IDs.
+ */
+
+int cip_build_forward_close(ab_connection_p conn, ab_request_p req)
+{
+    eip_forward_close_req *fc = (eip_forward_close_req *)(req->data);
+    uint8_t *data;
+
+    /* encap fields */
+    fc->encap_command = h2le16(AB_EIP_READ_RR_DATA);
+
+    /* router timeout */
+    fc->router_timeout = h2le16(1);
+
+    /* Common Packet Format fields for unconnected send. */
+    fc->cpf_item_count      = h2le16(2);
+    fc->cpf_nai_item_type   = h2le16(AB_EIP_ITEM_NAI);
+    fc->cpf_nai_item_length = h2le16(0);
+    fc->cpf_udi_item_type   = h2le16(AB_EIP_ITEM_UDI);
+
+    /* Connection Manager */
+    fc->cm_service_code = AB_EIP_CMD_FORWARD_CLOSE;
+    fc->cm_req_path_size = 2;
+    fc->cm_req_path[0] = 0x20;  /* class */
+    fc->cm_req_path[1] = 0x06;  /* Connection Manager */
+    fc->cm_req_path[2] = 0x24;  /* instance */
+    fc->cm_req_path[3] = 0x01;  /* instance 1 */
+
+    fc->secs_per_tick = AB_EIP_SECS_PER_TICK;
+    fc->timeout_ticks = AB_EIP_TIMEOUT_TICKS;
+
+    /* the same triad as the Forward Open */
+    fc->conn_serial_number = h2le16(conn->conn_serial_number);
+    fc->orig_vendor_id = h2le16(AB_EIP_VENDOR_ID);
+    fc->orig_serial_number = h2le32(AB_EIP_VENDOR_SN);
+
+    /* the path is already padded to 16-bit words */
+    fc->path_size = conn->conn_path_size/2;
+    fc->reserved = 0;
+
+    data = (uint8_t *)(&(fc->conn_path[0]));
+    mem_copy(data, conn->conn_path, conn->conn_path_size);
+    data += conn->conn_path_size;
+
+    fc->cpf_udi_item_length = h2le16(data - (uint8_t*)(&(fc->cm_service_code)));
+
+    req->request_size = data - req->data;
+    req->send_request = 1;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cip_check_forward_close_response()
+ *
+ * Check the reply to a Forward Close.  There is nothing to do if it
+ * failed, the target drops the connection when it times out.
+ */
+
+int cip_check_forward_close_response(ab_request_p req)
+{
+    eip_forward_close_resp *fc_resp = (eip_forward_close_resp *)(req->data);
+
+    if(req->status != PLCTAG_STATUS_OK) {
+        return req->status;
+    }
+
+    if(req->request_size < (int)sizeof(eip_forward_close_resp)) {
+        pdebug(req->debug,"Forward Close reply too short!");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    if(le2h16(fc_resp->encap_status) != AB_EIP_OK) {
+        pdebug(req->debug,"Forward Close command failed, response code: %d",le2h16(fc_resp->encap_status));
+        return PLCTAG_ERR_REMOTE_ERR;
+    }
+
+    if(fc_resp->resp_service_code != (AB_EIP_CMD_FORWARD_CLOSE | AB_EIP_CMD_CIP_OK)
+       || fc_resp->general_status != AB_CIP_STATUS_OK) {
+        pdebug(req->debug,"Forward Close failed, service %x status %x!",fc_resp->resp_service_code,fc_resp->general_status);
+        return PLCTAG_ERR_REMOTE_ERR;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cip_build_symbol_browse()
+ *
+ * Build a Get Instance Attribute List request for the names and types
+ * of the Symbol Object instances from start_instance on.  It is built
+ * as an Unconnected Send along the connection's path and converted
+ * when it is sent on the connection.
+ */
+
+int cip_build_symbol_browse(ab_connection_p conn, ab_request_p req, uint32_t start_instance)
+{
+    eip_cip_uc_req *cip = (eip_cip_uc_req *)(req->data);
+    uint8_t *data = req->data + sizeof(eip_cip_uc_req);
+    uint8_t *embed_start, *embed_end;
+    uint8_t *path_size;
+
+    embed_start = data;
+
+    *data = AB_EIP_CMD_CIP_LIST_INSTANCES; data++;
+
+    path_size = data; data++;
+
+    *data = 0x20; data++;                  /* class */
+    *data = AB_CIP_SYMBOL_CLASS; data++;   /* Symbol Object */
+
+    if(start_instance > 0xFFFF) {
+        *data = 0x26; data++;  /* 4-byte instance */
+        *data = 0; data++;
+        *((uint32_t *)data) = h2le32(start_instance); data += sizeof(uint32_t);
+    } else {
+        *data = 0x25; data++;  /* 2-byte instance */
+        *data = 0; data++;
+        *((uint16_t *)data) = h2le16((uint16_t)start_instance); data += sizeof(uint16_t);
+    }
+
+    *path_size = (data - (path_size + 1))/2;
+
+    /* the attributes we want for each instance */
+    *((uint16_t *)data) = h2le16(2); data += sizeof(uint16_t);
+    *((uint16_t *)data) = h2le16(AB_CIP_SYMBOL_ATTR_NAME); data += sizeof(uint16_t);
+    *((uint16_t *)data) = h2le16(AB_CIP_SYMBOL_ATTR_TYPE); data += sizeof(uint16_t);
+
+    embed_end = data;
+
+    /* the route, the embedded packet is always an even size here */
+    *data = conn->conn_path_size/2; data++;
+    *data = 0; data++;
+    mem_copy(data, conn->conn_path, conn->conn_path_size);
+    data += conn->conn_path_size;
+
+    cip->encap_command = h2le16(AB_EIP_READ_RR_DATA);
+    cip->router_timeout = h2le16(1);
+
+    cip->cpf_item_count      = h2le16(2);
+    cip->cpf_nai_item_type   = h2le16(AB_EIP_ITEM_NAI);
+    cip->cpf_nai_item_length = h2le16(0);
+    cip->cpf_udi_item_type   = h2le16(AB_EIP_ITEM_UDI);
+    cip->cpf_udi_item_length = h2le16(data - (uint8_t*)(&(cip->cm_service_code)));
+
+    cip->cm_service_code = AB_EIP_CMD_UNCONNECTED_SEND;
+    cip->cm_req_path_size = 2;
+    cip->cm_req_path[0] = 0x20;  /* class */
+    cip->cm_req_path[1] = 0x06;  /* Connection Manager */
+    cip->cm_req_path[2] = 0x24;  /* instance */
+    cip->cm_req_path[3] = 0x01;  /* instance 1 */
+
+    cip->secs_per_tick = AB_EIP_SECS_PER_TICK;
+    cip->timeout_ticks = AB_EIP_TIMEOUT_TICKS;
+
+    cip->uc_cmd_length = h2le16(embed_end - embed_start);
+
+    req->request_size = data - req->data;
+    req->send_request = 1;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cip_check_symbol_browse_response()
+ *
+ * Add the symbols in a Get Instance Attribute List reply to the
+ * connection's table.  *more is set if the PLC had more than fit
+ * in the reply, and *next_instance is where to carry on from.
+ *
+ * You must hold the session mutex before calling this!
+ */
+
+int cip_check_symbol_browse_response(ab_request_p req, ab_connection_p conn, uint32_t *next_instance, int *more)
+{
+    eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(req->data);
+    uint8_t *data;
+    uint8_t *data_end;
+    int count = 0;
+    int rc;
+
+    *more = 0;
+
+    if(req->status != PLCTAG_STATUS_OK) {
+        return req->status;
+    }
+
+    if(req->request_size < (int)sizeof(eip_cip_uc_resp)) {
+        pdebug(req->debug,"Symbol browse reply too short!");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    if(le2h16(resp->encap_status) != AB_EIP_OK) {
+        pdebug(req->debug,"Symbol browse command failed, response code: %d",le2h16(resp->encap_status));
+        return PLCTAG_ERR_REMOTE_ERR;
+    }
+
+    if(resp->reply_service != (AB_EIP_CMD_CIP_LIST_INSTANCES | AB_EIP_CMD_CIP_OK)
+       || (resp->status != AB_CIP_STATUS_OK && resp->status != AB_CIP_STATUS_FRAG)) {
+        pdebug(req->debug,"Symbol browse failed, service %x status %x!",resp->reply_service,resp->status);
+        return PLCTAG_ERR_REMOTE_ERR;
+    }
+
+    data = req->data + sizeof(eip_cip_uc_resp) + resp->num_status_words * 2;
+    data_end = req->data + le2h16(resp->encap_length) + sizeof(eip_encap_t);
+
+    /* each entry is the instance, the name with its length and the type. */
+    while(data + 6 <= data_end) {
+        uint32_t instance = le2h32(*((uint32_t *)data));
+        int name_len = le2h16(*((uint16_t *)(data + 4)));
+        uint8_t *name = data + 6;
+        uint16_t type;
+
+        if(name + name_len + 2 > data_end) {
+            pdebug(req->debug,"Symbol browse entry runs past the end of the reply!");
+            return PLCTAG_ERR_BAD_DATA;
+        }
+
+        type = le2h16(*((uint16_t *)(name + name_len)));
+
+        if(!(type & AB_CIP_SYMBOL_TYPE_SYSTEM)) {
+            rc = connection_add_symbol_unsafe(conn, (const char *)name, name_len, instance);
+
+            if(rc != PLCTAG_STATUS_OK) {
+                return rc;
+            }
+        }
+
+        *next_instance = instance + 1;
+
+        data = name + name_len + 2;
+        count++;
+    }
+
+    /* asking again from the same place would get the same reply. */
+    if(resp->status == AB_CIP_STATUS_FRAG && !count) {
+        pdebug(req->debug,"Symbol browse reply has no room for any symbols!");
+        return PLCTAG_ERR_TOO_LONG;
+    }
+
+    *more = (resp->status == AB_CIP_STATUS_FRAG);
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cip_convert_to_connected()
+ *
+ * Turn an Unconnected Send request into a connected one on the passed
+ * connection.  The embedded CIP request is moved down over the Unconnected
+ * Send wrapper and the route is dropped because the connection already
+ * goes to the PLC.  The request is matched to its reply by the connection
+ * ID and sequence number.
+ */
+
+int cip_convert_to_connected(ab_connection_p conn, ab_request_p req)
+{
+    eip_cip_uc_req *uc = (eip_cip_uc_req *)(req->data);
+    eip_cip_co_req *co = (eip_cip_co_req *)(req->data);
+    int embed_size = le2h16(uc->uc_cmd_length);
+    uint8_t *src = req->data + sizeof(eip_cip_uc_req);
+    uint8_t *dest = req->data + sizeof(eip_cip_co_req);
+    int i;
+
+    /* the header shrinks, so copying forward is safe. */
+    for(i = 0; i < embed_size; i++) {
+        dest[i] = src[i];
+    }
+
+    conn->conn_seq_num++;
+
+    co->encap_command = h2le16(AB_EIP_CONNECTED_SEND);
+    co->interface_handle = h2le32(0);
+    co->router_timeout = h2le16(0);
+    co->cpf_item_count = h2le16(2);
+    co->cpf_cai_item_type = h2le16(AB_EIP_ITEM_CAI);
+    co->cpf_cai_item_length = h2le16(4);
+    co->cpf_targ_conn_id = h2le32(conn->targ_connection_id);
+    co->cpf_cdi_item_type = h2le16(AB_EIP_ITEM_CDI);
+    co->cpf_cdi_item_length = h2le16(embed_size + 2);
+    co->cpf_conn_seq_num = h2le16(conn->conn_seq_num);
+
+    req->conn_id = conn->orig_connection_id;
+    req->conn_seq = conn->conn_seq_num;
+    req->request_size = sizeof(eip_cip_co_req) + embed_size;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * cip_convert_from_connected()
+ *
+ * Rewrite a connected reply into the layout of an Unconnected Send
+ * reply so that the code checking replies does not need to care how
+ * the request was sent.
+ */
+
+int cip_convert_from_connected(ab_request_p req)
+{
+    eip_cip_co_resp *co = (eip_cip_co_resp *)(req->data);
+    eip_cip_uc_resp *uc = (eip_cip_uc_resp *)(req->data);
+    int co_header_size = (uint8_t *)(&(co->reply_service)) - req->data;
+    int uc_header_size = (uint8_t *)(&(uc->reply_service)) - req->data;
+    int reply_size = req->request_size - co_header_size;
+    int i;
+
+    if(reply_size < 0) {
+        pdebug(req->debug,"Connected reply too short!");
+        return PLCTAG_ERR_BAD_DATA;
+    }
+
+    /* the header shrinks, so copying forward is safe. */
+    for(i = 0; i < reply_size; i++) {
+        req->data[uc_header_size + i] = req->data[co_header_size + i];
+    }
+
+    uc->encap_command = h2le16(AB_EIP_READ_RR_DATA);
+    uc->encap_length = h2le16(uc_header_size + reply_size - sizeof(eip_encap_t));
+    uc->cpf_item_count = h2le16(2);
+    uc->cpf_nai_item_type = h2le16(AB_EIP_ITEM_NAI);
+    uc->cpf_nai_item_length = h2le16(0);
+    uc->cpf_udi_item_type = h2le16(AB_EIP_ITEM_UDI);
+    uc->cpf_udi_item_length = h2le16(reply_size);
+
+    req->request_size = uc_header_size + reply_size;
+
+    return PLCTAG_STATUS_OK;
+}
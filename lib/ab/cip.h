@@ -34,6 +34,18 @@
 int cip_encode_path(ab_tag_p tag, const char *path);
 char *cip_decode_status(int status);
 int cip_encode_tag_name(ab_tag_p tag,const char *name);
+int cip_max_packet_size(ab_connection_p conn);
+int cip_pack_requests(ab_session_p session, ab_request_p first, ab_request_p *pkt);
+int cip_unpack_response(ab_request_p pkt);
+int cip_build_forward_open(ab_connection_p conn, ab_request_p req);
+int cip_check_forward_open_response(ab_request_p req, uint32_t *targ_connection_id);
+int cip_build_forward_close(ab_connection_p conn, ab_request_p req);
+int cip_check_forward_close_response(ab_request_p req);
+int cip_encode_instance_name(ab_tag_p tag, uint32_t instance);
+int cip_build_symbol_browse(ab_connection_p conn, ab_request_p req, uint32_t start_instance);
+int cip_check_symbol_browse_response(ab_request_p req, ab_connection_p conn, uint32_t *next_instance, int *more);
+int cip_convert_to_connected(ab_connection_p conn, ab_request_p req);
+int cip_convert_from_connected(ab_request_p req);
 
 
 
@@ -46,6 +46,7 @@ extern "C"
 #include <ab/cip.h>
 #include <ab/ab.h>
 #include <ab/ab_defs.h>
+#include <ab/tag_cache.h>
 #include <util/attr.h>
 
 
@@ -55,13 +56,46 @@ extern "C"
  * Shared global data
  */
 
-/* session/tag handling */
-volatile ab_session_p sessions = NULL;
+/*
+ * session/tag handling.  Sessions are kept in a hash table keyed by
+ * gateway host and port.  The table doubles when it gets full.
+ */
+static ab_session_p *session_table = NULL;
+static int session_table_size = 0;
+static int num_sessions = 0;
 volatile mutex_p io_thread_mutex = NULL;
 volatile lock_t tag_mutex_lock = LOCK_INIT; /* used for protecting access to set up the above mutex */
 
-/* request/response handling thread */
-volatile thread_p io_handler_thread = NULL;
+/*
+ * recycled requests and request buffers.  The counters are indexed by
+ * pool.  Hits are allocations the pool saved.
+ */
+#define REQUEST_POOL_REQS	(PLCTAG_POOL_REQUESTS)
+#define REQUEST_POOL_SMALL	(PLCTAG_POOL_SMALL_BUFS)
+#define REQUEST_POOL_LARGE	(PLCTAG_POOL_LARGE_BUFS)
+#define REQUEST_POOL_COUNT	(PLCTAG_POOL_COUNT)
+
+static volatile mutex_p request_pool_mutex = NULL;
+static ab_request_p request_pool = NULL;
+static uint8_t *request_buf_pool[2] = {NULL, NULL};
+static int request_pool_free[REQUEST_POOL_COUNT] = {0};
+static uint64_t request_pool_hits[REQUEST_POOL_COUNT] = {0};
+static uint64_t request_pool_misses[REQUEST_POOL_COUNT] = {0};
+
+
+/*
+ * request/response handling threads.  Sessions are spread across
+ * these unless they ask for a dedicated thread.  Protected by
+ * io_thread_mutex.
+ */
+ab_io_worker_p io_workers[MAX_IO_THREADS] = {NULL};
+
+/*
+ * dedicated IO threads that have no sessions left.  They are joined
+ * by io_worker_reap() once io_thread_mutex is released because they
+ * may be waiting for it.  Protected by io_thread_mutex.
+ */
+static ab_io_worker_p stopped_workers = NULL;
 
 
 
@@ -87,6 +121,11 @@ int ab_tag_abort(ab_tag_p tag)
 	tag->read_in_progress = 0;
 	tag->write_in_progress = 0;
 
+	/* let the IO thread clean up the requests now */
+	if(tag->session && tag->session->worker) {
+		poller_wake(tag->session->worker->poller);
+	}
+
 	return PLCTAG_STATUS_OK;
 }
 
@@ -94,6 +133,38 @@ int ab_tag_abort(ab_tag_p tag)
 
 
 
+/*
+ * ab_tag_start
+ *
+ * Called by the generic layer once the tag is completely set up.
+ * Auto sync scans start here because the first scan uses the tag's
+ * API mutex and status.  The session's IO worker owns the scan
+ * schedule.
+ */
+
+int ab_tag_start(ab_tag_p tag)
+{
+	int debug = tag->debug;
+
+	if(tag->auto_sync_read_ms <= 0 && tag->auto_sync_write_ms <= 0) {
+		return PLCTAG_STATUS_OK;
+	}
+
+	if(!tag->session || !tag->session->worker) {
+		pdebug(debug,"Tag has no IO worker to scan it!");
+		return PLCTAG_ERR_CREATE;
+	}
+
+	if(io_worker_add_scan(tag->session->worker, tag) != PLCTAG_STATUS_OK) {
+		pdebug(debug,"Unable to schedule tag scans!");
+		return PLCTAG_ERR_CREATE;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
 /*
  * ab_tag_destroy
  * 
@@ -115,13 +186,43 @@ int ab_tag_destroy(ab_tag_p tag)
     if(!tag)
         return rc;
 
+	/* stop background scans. */
+	if(tag->scan_ms > 0 && tag->session && tag->session->worker) {
+		io_worker_remove_scan(tag->session->worker, tag);
+	}
+
 	/* 
-	 * stop any current actions. Note that we
-	 * want to use the thread-safe version here.  We
-	 * do lock a mutex later, but a different one.
+	 * stop any current actions, including an auto sync read or
+	 * write still in flight. Note that we want to use the
+	 * thread-safe version here.
 	 */
 	plc_tag_abort((plc_tag)tag);
 
+	/*
+	 * the IO thread picks up tags with a finished operation under the
+	 * session mutex, so clear the operation there too.  Then wait for
+	 * it to finish any callback or scan it already has the tag for.
+	 * A scan that was running may have started another operation, so
+	 * that is aborted as well.  Once the tag has no references with
+	 * nothing pending, the IO thread will not pick it up again.
+	 */
+	while(tag->session) {
+		int refs = 0;
+
+		critical_block(tag->session->mutex) {
+			tag->pending_event = 0;
+			tag->auto_op = 0;
+			refs = tag->worker_refs;
+		}
+
+		if(!refs) {
+			break;
+		}
+
+		sleep_ms(1);
+
+		plc_tag_abort((plc_tag)tag);
+	}
 
 	/* this needs to be synchronized.  We are going to remove the tag completely. */
 	critical_block(io_thread_mutex) {	
@@ -141,8 +242,11 @@ int ab_tag_destroy(ab_tag_p tag)
 
 			/* null out the pointer just in case. */
 			tag->session = NULL;
+			tag->io_event = NULL;
 		}
 
+		tag_cache_close_unsafe(tag);
+
 		if(tag->reqs) {
 			mem_free(tag->reqs);
 			tag->reqs = NULL;
@@ -163,9 +267,16 @@ int ab_tag_destroy(ab_tag_p tag)
 			tag->data = NULL;
 		}
 
+		if(tag->api_mut) {
+			mutex_destroy(&tag->api_mut);
+		}
+
 		/* release memory */
 		mem_free(tag);
 	}
+
+	/* stop the session's IO thread if it had one to itself. */
+	io_worker_reap();
 	
 	pdebug(debug,"done");
 
@@ -256,1097 +367,4072 @@ int check_tag_name(ab_tag_p tag, const char *name)
 
 
 
-int send_eip_request(ab_request_p req)
-{
-	int rc;
-
-	/*pdebug(debug,"Starting.");*/
-
-	/* if we have not already started, then start the send */
-	if(!req->send_in_progress) {
-		eip_encap_t *encap;
-		int payload_size = req->request_size - sizeof(eip_encap_t);
-
-		/* set up the session sequence ID for this transaction */
-		req->session->session_seq_id++;
-		req->session_seq_id = req->session->session_seq_id;
+/*
+ * the dispatch keys of connected requests have the top bit set so that
+ * they are never the same as a sender context.
+ */
+#define DISPATCH_CONNECTED_KEY(conn_id, conn_seq) \
+	(((uint64_t)1 << 63) | ((uint64_t)(conn_id) << 16) | (uint64_t)(conn_seq))
 
-		/* set up the rest of the request */
-		req->current_offset = 0; /* nothing written yet */
+static int dispatch_slot(uint64_t key, int size)
+{
+	return (int)((uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (uint32_t)(size - 1));
+}
 
-		encap = (eip_encap_t*)(req->data);
 
-		/* fill in the header fields. */
-		encap->encap_length              = h2le16(payload_size);
-		encap->encap_session_handle      = req->session->session_handle;
-		encap->encap_status              = h2le32(0);
-		encap->encap_sender_context 	 = req->session_seq_id; /* link up the request seq ID and the packet seq ID */
-		encap->encap_options             = h2le32(0);
 
-		/* display the data */
-		pdebug_dump_bytes(req->debug, req->data,req->request_size);
+/*
+ * session_dispatch_find_unsafe
+ *
+ * Find the sent request whose response has the passed key.  Returns
+ * the slot or -1 if no request is waiting for it.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+static int session_dispatch_find_unsafe(ab_session_p session, uint64_t key)
+{
+	int mask = session->dispatch_size - 1;
+	int i;
 
-		req->send_in_progress = 1;
+	if(!session->dispatch_count) {
+		return -1;
 	}
 
-	/* send the packet */
-	rc = socket_write(req->session->sock,req->data + req->current_offset,req->request_size - req->current_offset);
-
-	if(rc >= 0) {
-		req->current_offset += rc;
-
-		/* are we done? */
-		if(req->current_offset >= req->request_size) {
-			req->send_request = 0;
-			req->send_in_progress = 0;
-			req->current_offset = 0;
-
-			/* set this request up for a receive action */
-			req->recv_in_progress = 1;
+	for(i = dispatch_slot(key, session->dispatch_size); session->dispatch[i].req; i = (i + 1) & mask) {
+		if(session->dispatch[i].key == key) {
+			return i;
 		}
-
-		rc = PLCTAG_STATUS_OK;
-	} else {
-		/* oops, error of some sort. */
-		req->status = rc;
-		req->send_request = 0;
-		req->send_in_progress = 0;
-		req->recv_in_progress = 0;
 	}
 
-	return rc;
+	return -1;
 }
 
 
 
 /*
- * recv_eip_response
+ * session_dispatch_remove_unsafe
  *
- * Look at the passed session and read any data we can
- * to fill in a packet.  If we already have a full packet,
- * punt.
+ * Take the request out of the dispatch table if it is there.  The
+ * entries after it in the probe sequence are moved back to fill the
+ * hole so that lookups never need tombstones.
+ *
+ * You must hold the session's mutex before calling this!
  */
-int recv_eip_response(ab_session_p session)
+static void session_dispatch_remove_unsafe(ab_session_p session, ab_request_p req)
 {
-	int data_needed = 0;
-	int rc = PLCTAG_STATUS_OK;
+	int mask = session->dispatch_size - 1;
+	int hole;
+	int i;
 
-	/*
-	 * Determine the amount of data to get.  At a minimum, we
-	 * need to get an encap header.  This will determine
-	 * whether we need to get more data or not.
-	 */
-	if(session->recv_offset < sizeof(eip_encap_t)) {
-		data_needed = sizeof(eip_encap_t);
-	} else {
-		data_needed = sizeof(eip_encap_t) + ((eip_encap_t*)(session->recv_data))->encap_length;
+	if(!req->in_dispatch) {
+		return;
 	}
 
-	if(session->recv_offset < data_needed) {
-		/* read everything we can */
-		do {
-			rc = socket_read(session->sock, session->recv_data + session->recv_offset, data_needed - session->recv_offset);
-
-			if(rc < 0) {
-				if(rc != PLCTAG_ERR_NO_DATA) {
-					/* error! */
-					/*pdebug(debug,"Error reading socket! rc=%d",rc);*/
-					return rc;
-				}
-			} else {
-				session->recv_offset += rc;
+	req->in_dispatch = 0;
 
-				/* recalculate the amount of data needed if we have just completed the read of an encap header */
-				if(session->recv_offset >= sizeof(eip_encap_t)) {
-					data_needed = sizeof(eip_encap_t) + ((eip_encap_t*)(session->recv_data))->encap_length;
-				}
-			}
-		} while(rc > 0 && session->recv_offset < data_needed);
+	/* keys can repeat when connection sequence numbers wrap, so look for the request itself. */
+	for(hole = dispatch_slot(req->dispatch_key, session->dispatch_size); session->dispatch[hole].req != req; hole = (hole + 1) & mask) {
+		if(!session->dispatch[hole].req) {
+			return;
+		}
 	}
 
+	for(i = (hole + 1) & mask; session->dispatch[i].req; i = (i + 1) & mask) {
+		int home = dispatch_slot(session->dispatch[i].key, session->dispatch_size);
 
-	/* did we get all the data? */
-	if(session->recv_offset >= data_needed) {
-		session->resp_seq_id = ((eip_encap_t*)(session->recv_data))->encap_sender_context;
-		session->has_response = 1;
-
-		/*
-		if(session->resp_seq_id == 0) {
-			pdebug(debug,"Got zero response ID");
+		/* move the entry back if the hole is between its home slot and where it is. */
+		if(((i - home) & mask) >= ((i - hole) & mask)) {
+			session->dispatch[hole] = session->dispatch[i];
+			hole = i;
 		}
-		*/
 	}
 
-	return rc;
+	session->dispatch[hole].req = NULL;
+	session->dispatch_count--;
 }
 
 
 
+/*
+ * session_dispatch_add_unsafe
+ *
+ * Put a request that is about to be sent into the dispatch table.  The
+ * table doubles when it gets half full.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+static int session_dispatch_add_unsafe(ab_session_p session, ab_request_p req)
+{
+	int i;
 
+	/* a resent request gets a new key. */
+	session_dispatch_remove_unsafe(session, req);
 
+	if((session->dispatch_count + 1) * 2 > session->dispatch_size) {
+		int new_size = (session->dispatch_size ? session->dispatch_size * 2 : DISPATCH_TABLE_MIN_SIZE);
+		struct ab_dispatch_entry_t *new_table = (struct ab_dispatch_entry_t *)mem_alloc(new_size * (int)sizeof(struct ab_dispatch_entry_t));
 
+		if(new_table) {
+			for(i = 0; i < session->dispatch_size; i++) {
+				if(session->dispatch[i].req) {
+					int j = dispatch_slot(session->dispatch[i].key, new_size);
 
+					while(new_table[j].req) {
+						j = (j + 1) & (new_size - 1);
+					}
 
+					new_table[j] = session->dispatch[i];
+				}
+			}
 
+			if(session->dispatch) {
+				mem_free(session->dispatch);
+			}
 
-/*
- * check_mutex
- *
- * check to see if the global mutex is set up.  If not, do an atomic
- * lock and set it up.
- */
-int check_mutex(int debug)
-{
-	int rc = PLCTAG_STATUS_OK;
+			session->dispatch = new_table;
+			session->dispatch_size = new_size;
+		} else if(session->dispatch_count + 1 >= session->dispatch_size) {
+			/* there must always be an empty slot to end the probes. */
+			pdebug(req->debug,"Unable to grow dispatch table!");
+			return PLCTAG_ERR_NO_MEM;
+		}
+	}
 
-	/* loop until we get the lock flag */
-	while(!lock_acquire((lock_t *)&tag_mutex_lock)) {
-		sleep_ms(1);
+	if(((eip_encap_t *)(req->data))->encap_command == AB_EIP_CONNECTED_SEND) {
+		req->dispatch_key = DISPATCH_CONNECTED_KEY(req->conn_id, req->conn_seq);
+	} else {
+		req->dispatch_key = req->session_seq_id;
 	}
 
-	/* first see if the mutex is there. */
-	if(!io_thread_mutex) {
-		rc = mutex_create((mutex_p *)&io_thread_mutex);
-		if(rc != PLCTAG_STATUS_OK) {
-			pdebug(debug,"Unable to create global tag mutex!");
-		}
+	for(i = dispatch_slot(req->dispatch_key, session->dispatch_size); session->dispatch[i].req; i = (i + 1) & (session->dispatch_size - 1)) {
+		/* nothing to do, find the first empty slot. */
 	}
 
-	/* we hold the lock, so clear it.*/
-	lock_release((lock_t *)&tag_mutex_lock);
+	session->dispatch[i].key = req->dispatch_key;
+	session->dispatch[i].req = req;
+	session->dispatch_count++;
+	req->in_dispatch = 1;
 
-	return rc;
+	return PLCTAG_STATUS_OK;
 }
 
 
+
 /*
- * session_get_new_seq_id_unsafe
+ * session_timer_remove_unsafe
  *
- * A wrapper to get a new session sequence ID.  Not thread safe.
+ * Take the request off the session's timer wheel if it is on it.
  *
- * Note that this is dangerous to use in threaded applications
- * because 32-bit processors will not implement a 64-bit
- * integer as an atomic entity.
+ * You must hold the session's mutex before calling this!
  */
-
-uint64_t session_get_new_seq_id_unsafe(ab_session_p sess)
+static void session_timer_remove_unsafe(ab_session_p session, ab_request_p req)
 {
-	return sess->session_seq_id++;
-}
-
-
-
-/*
- * session_get_new_seq_id
- *
- * A thread-safe function to get a new session sequence ID.
- */
+	if(!req->timer_list) {
+		return;
+	}
 
-uint64_t session_get_new_seq_id(ab_session_p sess)
-{
-	uint16_t res;
+	if(req->timer_prev) {
+		req->timer_prev->timer_next = req->timer_next;
+	} else {
+		*(req->timer_list) = req->timer_next;
+	}
 
-	critical_block(io_thread_mutex) {
-		res = (uint16_t)session_get_new_seq_id_unsafe(sess);
+	if(req->timer_next) {
+		req->timer_next->timer_prev = req->timer_prev;
 	}
 
-	return res;
+	req->timer_next = NULL;
+	req->timer_prev = NULL;
+	req->timer_list = NULL;
+	session->num_timers--;
 }
 
 
 
-
 /*
- * request_create
+ * session_timer_add_unsafe
  *
- * This does not do much for now other than allocate memory.  In the future
- * it may be desired to keep a pool of request buffers instead.  This shim
- * is here so that such a change can be done without major code changes
- * elsewhere.
+ * Put the request on the timer wheel for its deadline.  A deadline
+ * less than one turn of the first level away goes in the first level,
+ * one less than a turn of the second level away in the second and so
+ * on.  The slots of the upper levels are moved down a level each time
+ * the level below them finishes a turn.
+ *
+ * You must hold the session's mutex before calling this!
  */
-int request_create(ab_request_p *req)
+static void session_timer_add_unsafe(ab_session_p session, ab_request_p req)
 {
-	int rc = PLCTAG_STATUS_OK;
-	ab_request_p res;
+	int64_t now_tick;
+	int64_t due_tick;
+	int64_t max_ticks = (int64_t)1 << (REQUEST_TIMER_BITS * REQUEST_TIMER_LEVELS);
+	ab_request_p *list;
+	int level;
 
-	res = (ab_request_p)mem_alloc(sizeof(struct ab_request_t));
+	session_timer_remove_unsafe(session, req);
 
-	if(!res) {
-		*req = NULL;
-		rc = PLCTAG_ERR_NO_MEM;
-	} else {
-		*req = res;
+	if(!req->deadline) {
+		return;
 	}
 
-	return rc;
-}
+	/* an empty wheel does not keep up with the time. */
+	if(!session->num_timers) {
+		int64_t now = time_ms();
 
+		session->timer_time = now - (now % REQUEST_TIMER_TICK_MS);
+	}
 
-/*
- * request_add_unsafe
- *
- * You must hold the mutex before calling this!
- */
-int request_add_unsafe(ab_session_p sess, ab_request_p req)
-{
-	int rc = PLCTAG_STATUS_OK;
-	ab_request_p cur,prev;
+	now_tick = session->timer_time / REQUEST_TIMER_TICK_MS;
+	due_tick = req->deadline / REQUEST_TIMER_TICK_MS;
 
-	/* make sure the request points to the session */
-	req->session = sess;
+	if(due_tick < now_tick) {
+		due_tick = now_tick;
+	}
 
-	/* we add the request to the end of the list. */
-	cur = sess->requests;
-	prev = NULL;
+	/* past the end of the wheel, it goes in the last slot and moves down from there. */
+	if(due_tick - now_tick >= max_ticks) {
+		due_tick = now_tick + max_ticks - 1;
+	}
 
-	while(cur) {
-		prev = cur;
-		cur = cur->next;
+	for(level = 0; level < REQUEST_TIMER_LEVELS - 1; level++) {
+		if(due_tick - now_tick < ((int64_t)1 << (REQUEST_TIMER_BITS * (level + 1)))) {
+			break;
+		}
 	}
 
-	if(!prev) {
-		sess->requests = req;
-	} else {
-		prev->next = req;
+	list = &(session->timer_wheel[level][(due_tick >> (REQUEST_TIMER_BITS * level)) & (REQUEST_TIMER_SLOTS - 1)]);
+
+	req->timer_prev = NULL;
+	req->timer_next = *list;
+
+	if(*list) {
+		(*list)->timer_prev = req;
 	}
 
-	return rc;
+	*list = req;
+	req->timer_list = list;
+	session->num_timers++;
 }
 
 
 
-
 /*
- * request_add
+ * session_window_cut_unsafe
  *
- * This is a thread-safe version of the above routine.
+ * The PLC is falling behind, halve the in-flight window.  Only the
+ * first sign of trouble in each round trip counts, the rest are from
+ * requests that were already out.
+ *
+ * You must hold the session's mutex before calling this!
  */
-int request_add(ab_session_p sess, ab_request_p req)
+static void session_window_cut_unsafe(ab_session_p session)
 {
-	int rc = PLCTAG_STATUS_OK;
+	int64_t now = time_ms();
 
-	critical_block(io_thread_mutex) {
-		rc = request_add_unsafe(sess,req);
+	if(now < session->window_cut_time) {
+		return;
 	}
 
-	return rc;
+	session->window = (session->window > 1 ? session->window / 2 : 1);
+	session->window_acks = 0;
+	session->window_limited = 0;
+	session->window_cut_time = now + (session->srtt_x8 / 8) + 1;
+
+	pdebug(session->debug,"Cut in-flight window to %d.",session->window);
 }
 
 
 
 /*
- * request_remove_unsafe
+ * session_window_update_unsafe
  *
- * You must hold the mutex before calling this!
+ * Adjust the in-flight window for a response to a request.  The round
+ * trip time is compared to the lowest one seen lately.  While it stays
+ * flat and requests are waiting, the window grows by one per window of
+ * responses.  When it goes up or the PLC says it is out of resources,
+ * the window is cut.
+ *
+ * You must hold the session's mutex before calling this!
  */
-int request_remove_unsafe(ab_session_p sess, ab_request_p req)
+static void session_window_update_unsafe(ab_session_p session, ab_request_p req)
 {
-	int rc = PLCTAG_STATUS_OK;
-	ab_request_p cur,prev;
+	eip_cip_uc_resp *resp = (eip_cip_uc_resp *)(req->data);
+	int64_t now = time_ms();
+	int rtt = (int)(now - req->send_time);
+	int congested = 0;
+
+	if(session->min_rtt_ms < 0 || rtt < session->min_rtt_ms || now - session->min_rtt_time > WINDOW_MIN_RTT_RESET_MS) {
+		session->min_rtt_ms = rtt;
+		session->min_rtt_time = now;
+	}
+
+	if(!session->srtt_x8) {
+		session->srtt_x8 = rtt * 8;
+	} else {
+		session->srtt_x8 += rtt - (session->srtt_x8 / 8);
+	}
 
-	/* find the request and remove it from the list. */
-	cur = sess->requests;
-	prev = NULL;
+	if(session->srtt_x8 / 8 > (2 * session->min_rtt_ms) + WINDOW_RTT_SLACK_MS) {
+		congested = 1;
+	}
 
-	while(cur && cur != req) {
-		prev = cur;
-		cur = cur->next;
+	/* the target or the route is short of buffers. */
+	if(le2h32(resp->encap_status) == AB_EIP_ERR_NO_MEMORY) {
+		congested = 1;
 	}
 
-	if(cur == req) {
-		if(!prev) {
-			sess->requests = cur->next;
-		} else {
-			prev->next = cur->next;
-		}
-	} /* else not found */
+	if(le2h16(resp->encap_command) == AB_EIP_READ_RR_DATA && req->request_size >= (int)sizeof(eip_cip_uc_resp)
+	   && resp->status == AB_CIP_STATUS_NO_RESOURCE) {
+		congested = 1;
+	}
 
-	req->next = NULL;
+	if(congested) {
+		session_window_cut_unsafe(session);
+		return;
+	}
 
-	return rc;
-}
+	/* only grow the window if it is what holds requests back. */
+	if(session->window_limited && session->window < session->max_reqs_in_flight) {
+		session->window_acks++;
 
+		if(session->window_acks >= session->window) {
+			session->window++;
+			session->window_acks = 0;
+			session->window_limited = 0;
 
+			pdebug(session->debug,"Grew in-flight window to %d.",session->window);
+		}
+	}
+}
 
 
 
 /*
- * request_remove
+ * request_expire_unsafe
  *
- * This is a thread-safe version of the above routine.
+ * The request was not done by its deadline.  Stop waiting for the
+ * response and fail it with PLCTAG_ERR_TIMEOUT.  A request that is
+ * partly written stays on the send queue until it is all out, its
+ * response is thrown away.
+ *
+ * You must hold the session's mutex before calling this!
  */
-int request_remove(ab_session_p sess, ab_request_p req)
+static void request_expire_unsafe(ab_session_p session, ab_request_p req)
 {
-	int rc = PLCTAG_STATUS_OK;
+	int i;
 
-	critical_block(io_thread_mutex) {
-		rc = request_remove_unsafe(sess,req);
+	session_timer_remove_unsafe(session, req);
+
+	if(req->resp_received || req->abort_request) {
+		return;
 	}
 
-	return rc;
-}
+	pdebug(req->debug,"Request timed out.");
 
+	session_dispatch_remove_unsafe(session, req);
 
+	/* a lost response is the PLC being overloaded as far as we can tell. */
+	if(req->recv_in_progress) {
+		req->recv_in_progress = 0;
+		session->num_reqs_in_flight--;
+		session_window_cut_unsafe(session);
+	}
 
+	/* take it out of the packet it was sent in. */
+	if(req->packed_in) {
+		for(i = 0; i < req->packed_in->num_packed_reqs; i++) {
+			if(req->packed_in->packed_reqs[i] == req) {
+				req->packed_in->packed_reqs[i] = NULL;
+			}
+		}
 
+		req->packed_in = NULL;
+	}
 
-/*
- * request_destroy
- *
- * The request must be removed from any lists before this!
- */
-int request_destroy(ab_request_p *req)
-{
-	if(req && *req) {
-		mem_free(*req);
-		*req = NULL;
+	/* the requests in a packet time out with it. */
+	if(req->packed_reqs) {
+		for(i = 0; i < req->num_packed_reqs; i++) {
+			ab_request_p member = req->packed_reqs[i];
+
+			if(member) {
+				member->packed_in = NULL;
+				req->packed_reqs[i] = NULL;
+				request_expire_unsafe(session, member);
+			}
+		}
+
+		req->abort_request = 1;
 	}
 
-	return PLCTAG_STATUS_OK;
-}
+	/* the requests waiting on a lost Forward Open try again with a new one. */
+	if(req->open_connection) {
+		if(req->open_connection->state == AB_CONNECTION_OPENING) {
+			req->open_connection->state = AB_CONNECTION_NOT_OPEN;
+		}
 
+		req->abort_request = 1;
+	}
 
+	/* a PLC that does not answer a browse does not get asked again. */
+	if(req->browse_connection) {
+		req->browse_connection->symbol_state = AB_SYMBOLS_FAILED;
+		req->abort_request = 1;
+	}
 
+	/* the PLC times the connection out itself. */
+	if(req->close_connection) {
+		req->abort_request = 1;
+	}
 
+	req->status = PLCTAG_ERR_TIMEOUT;
+	req->send_request = 0;
+	req->resp_received = 1;
+	session->reqs_done = 1;
+}
 
 
 
-int find_or_create_session(ab_tag_p tag, attr attribs)
+/*
+ * session_timer_run_unsafe
+ *
+ * Turn the timer wheel up to the current time and fail the requests
+ * whose deadlines have passed.  A tick is only handled once all of it
+ * has passed.  Each tick costs the same no matter how many requests
+ * are on the wheel.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+static void session_timer_run_unsafe(ab_session_p session)
 {
-	int debug = tag->debug;
-    const char *session_gw = attr_get_str(attribs,"gateway","");
-    int session_gw_port = attr_get_int(attribs,"gateway_port",AB_EIP_DEFAULT_PORT);
-    ab_session_p session;
-    int shared_session = attr_get_int(attribs,"share_session",1); /* share the session by default. */
+	int64_t now = time_ms();
 
-    /* if we are to share sessions, then look for an existing one. */
-    if(shared_session) {
-    	session = find_session_by_host_unsafe(tag, session_gw);
-    } else {
-    	/* no sharing, create a new one */
-    	session = AB_SESSION_NULL;
-    }
+	if(!session->num_timers) {
+		session->timer_time = now - (now % REQUEST_TIMER_TICK_MS);
+		return;
+	}
 
-    if(session == AB_SESSION_NULL) {
-        session = ab_session_create(tag, session_gw, session_gw_port);
-    } else {
-        pdebug(debug,"find_or_create_session() reusing existing session.");
-    }
+	while(session->num_timers && session->timer_time + REQUEST_TIMER_TICK_MS <= now) {
+		int64_t tick = session->timer_time / REQUEST_TIMER_TICK_MS;
+		ab_request_p *list;
+		ab_request_p req;
+		int level;
 
-    if(session == AB_SESSION_NULL) {
-        pdebug(debug,"unable to create or find a session!");
+		/* find the levels that finish a turn at this tick. */
+		for(level = 1; level < REQUEST_TIMER_LEVELS; level++) {
+			if(tick & (((int64_t)1 << (REQUEST_TIMER_BITS * level)) - 1)) {
+				break;
+			}
+		}
 
-    	return PLCTAG_ERR_BAD_GATEWAY;
-    }
+		/* move their next slots down, the top one first. */
+		while(--level > 0) {
+			list = &(session->timer_wheel[level][(tick >> (REQUEST_TIMER_BITS * level)) & (REQUEST_TIMER_SLOTS - 1)]);
 
-    tag->session = session;
+			while((req = *list)) {
+				session_timer_add_unsafe(session, req);
+			}
+		}
 
-    return PLCTAG_STATUS_OK;
-}
+		/* everything left in the slot for this tick is due. */
+		list = &(session->timer_wheel[0][tick & (REQUEST_TIMER_SLOTS - 1)]);
 
+		while((req = *list)) {
+			if(req->deadline > now) {
+				/* a long timeout that was put in the last slot. */
+				session_timer_add_unsafe(session, req);
+			} else {
+				request_expire_unsafe(session, req);
+			}
+		}
 
+		session->timer_time += REQUEST_TIMER_TICK_MS;
+	}
 
+	/* all the deadlines are gone, so skip the rest of the ticks. */
+	if(!session->num_timers) {
+		session->timer_time = now - (now % REQUEST_TIMER_TICK_MS);
+	}
+}
 
 
 
+/*
+ * request_set_encap_unsafe
+ *
+ * Fill in the EIP header of the request with a new session sequence
+ * ID.  The reply is matched to the request by that ID.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+static void request_set_encap_unsafe(ab_session_p session, ab_request_p req)
+{
+	eip_encap_t *encap = (eip_encap_t*)(req->data);
+	int payload_size = req->request_size - sizeof(eip_encap_t);
+
+	/* set up the session sequence ID for this transaction */
+	session->session_seq_id++;
+	req->session_seq_id = session->session_seq_id;
+
+	encap->encap_length              = h2le16(payload_size);
+	encap->encap_session_handle      = session->session_handle;
+	encap->encap_status              = h2le32(0);
+	encap->encap_sender_context 	 = req->session_seq_id; /* link up the request seq ID and the packet seq ID */
+	encap->encap_options             = h2le32(0);
+}
 
 
 
-int add_session_unsafe(ab_tag_p tag,  ab_session_p n)
+/*
+ * request_start_send_unsafe
+ *
+ * Fill in the EIP header and put the request on the end of the
+ * session's send queue.  The queue is written out by
+ * session_send_requests_unsafe().
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int request_start_send_unsafe(ab_session_p session, ab_request_p req)
 {
-    if(!n)
-        return PLCTAG_ERR_NULL_PTR;
+	int rc;
 
-    n->prev = NULL;
-	n->next = sessions;
+	/* fill in the header fields. */
+	request_set_encap_unsafe(session, req);
 
-    if(sessions) {
-        sessions->prev = n;
-    }
+	/* the response is looked up by the sequence ID or connection sequence. */
+	rc = session_dispatch_add_unsafe(session, req);
 
-    sessions = n;
+	if(rc != PLCTAG_STATUS_OK) {
+		return rc;
+	}
 
-    return PLCTAG_STATUS_OK;
-}
+	/* set up the rest of the request */
+	req->current_offset = 0; /* nothing written yet */
 
+	/* display the data */
+	pdebug_dump_bytes(req->debug, req->data,req->request_size);
 
-int add_session(ab_tag_p tag,  ab_session_p s)
-{
-	int rc;
+	req->send_in_progress = 1;
 
-	pdebug(tag->debug,"Locking mutex");
-	critical_block(io_thread_mutex) {
-		rc = add_session_unsafe(tag, s);
+	/* packets must go out whole and in order, so queue it behind the others. */
+	req->send_next = NULL;
+
+	if(session->send_queue_tail) {
+		session->send_queue_tail->send_next = req;
+	} else {
+		session->send_queue = req;
 	}
 
-	return rc;
-}
+	session->send_queue_tail = req;
 
+	return PLCTAG_STATUS_OK;
+}
 
 
 
-int remove_session_unsafe(ab_tag_p tag, ab_session_p n)
+/*
+ * session_send_requests_unsafe
+ *
+ * Write as much of the send queue as the socket will take.  All the
+ * queued requests are gathered into one write, or a few if there are
+ * more than SOCKET_MAX_WRITE_BUFS of them.  A request that is only
+ * partly written stays at the head of the queue for the next pass.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int session_send_requests_unsafe(ab_session_p session)
 {
-	ab_session_p tmp;
+	uint8_t *bufs[SOCKET_MAX_WRITE_BUFS];
+	int sizes[SOCKET_MAX_WRITE_BUFS];
+	ab_request_p req;
+	int num_bufs;
+	int total;
+	int corked = 0;
+	int64_t now = time_ms();
+	int rc = PLCTAG_STATUS_OK;
 
-    if(!n || !sessions)
-    	return 0;
+	while(session->send_queue) {
+		/* gather the unwritten part of each queued request. */
+		num_bufs = 0;
+		total = 0;
 
-    tmp = sessions;
+		for(req = session->send_queue; req && num_bufs < SOCKET_MAX_WRITE_BUFS; req = req->send_next) {
+			bufs[num_bufs] = req->data + req->current_offset;
+			sizes[num_bufs] = req->request_size - req->current_offset;
+			total += sizes[num_bufs];
+			num_bufs++;
+		}
 
-    while(tmp && tmp != n)
-    	tmp = tmp->next;
+		/* it takes more than one write, hold back the partial segments between them. */
+		if(req && !corked) {
+			socket_cork(session->sock, 1);
+			corked = 1;
+		}
 
-    if(!tmp || tmp != n) {
-    	return PLCTAG_ERR_NOT_FOUND;
-    }
+		rc = socket_write_many(session->sock, bufs, sizes, num_bufs);
 
-    if(n->next) {
-    	n->next->prev = n->prev;
-    }
+		if(rc == PLCTAG_ERR_NO_DATA) {
+			/* the socket buffer is full, try again when it drains. */
+			rc = PLCTAG_STATUS_OK;
+			break;
+		} else if(rc < 0) {
+			/* oops, error of some sort. The caller fails the session. */
+			pdebug(session->send_queue->debug,"Error writing to socket! rc=%d",rc);
+			break;
+		}
 
-    if(n->prev) {
-    	n->prev->next = n->next;
-    } else {
-    	sessions = n->next;
-    }
+		pdebug(session->send_queue->debug,"wrote %d of %d bytes from %d requests",rc,total,num_bufs);
 
-    n->next = NULL;
-    n->prev = NULL;
+		/* take the requests that were completely written off the queue. */
+		while(rc > 0) {
+			int left;
 
-    return PLCTAG_STATUS_OK;
-}
+			req = session->send_queue;
+			left = req->request_size - req->current_offset;
 
+			if(rc < left) {
+				req->current_offset += rc;
+				break;
+			}
 
+			rc -= left;
 
+			session->send_queue = req->send_next;
 
+			if(!session->send_queue) {
+				session->send_queue_tail = NULL;
+			}
 
+			req->send_next = NULL;
+			req->send_request = 0;
+			req->send_in_progress = 0;
+			req->current_offset = 0;
 
+			if(req->resp_received) {
+				/* it timed out while it was being written, nobody wants the reply. */
+				session->num_reqs_in_flight--;
+			} else {
+				/* set this request up for a receive action */
+				req->recv_in_progress = 1;
+				req->send_time = now;
+			}
+		}
 
-int remove_session(ab_tag_p tag,  ab_session_p s)
-{
-	int rc;
+		rc = PLCTAG_STATUS_OK;
 
-	pdebug(tag->debug,"Locking mutex");
-	critical_block(io_thread_mutex) {
-		rc = remove_session_unsafe(tag, s);
+		/* a short write means the socket buffer is full. */
+		if(session->send_queue && session->send_queue->current_offset > 0) {
+			break;
+		}
+	}
+
+	if(corked) {
+		socket_cork(session->sock, 0);
 	}
-	pdebug(tag->debug,"Mutex released");
 
 	return rc;
 }
 
 
 
-
-
-ab_session_p find_session_by_host_unsafe(ab_tag_p tag, const char  *t)
+/*
+ * recv_eip_response
+ *
+ * Read whatever the socket has into the session's receive buffer
+ * with one call.  Several pipelined responses can come in together.
+ * The buffer is used like a ring: complete packets are taken off the
+ * front by session_check_incoming_data() and a partial packet left at
+ * the end is moved to the front before the next read.  The buffer
+ * only grows when a packet header shows a packet that does not fit.
+ */
+int recv_eip_response(ab_session_p session)
 {
-	ab_session_p tmp;
-	int count = 0;
-
-	tmp = sessions;
+	int rc = PLCTAG_STATUS_OK;
 
-	while(tmp && str_cmp_i(tmp->host,t)) {
-		tmp=tmp->next;
-		count++;
+	/* make room at the end. */
+	if(session->recv_start > 0) {
+		mem_move(session->recv_data, session->recv_data + session->recv_start, session->recv_offset - session->recv_start);
+		session->recv_offset -= session->recv_start;
+		session->recv_start = 0;
 	}
 
-	pdebug(tag->debug,"found %d sessions",count);
+	if(session->recv_offset < session->recv_buf_size) {
+		rc = socket_read(session->sock, session->recv_data + session->recv_offset, session->recv_buf_size - session->recv_offset);
 
-    if(!tmp) {
-    	return (ab_session_p)NULL;
-    }
+		if(rc < 0) {
+			/* NO_DATA is passed back too, the caller checks it. */
+			return rc;
+		} else if(rc == 0) {
+			/* the other end closed the connection. */
+			return PLCTAG_ERR_READ;
+		}
+
+		session->recv_offset += rc;
+	}
 
-    return tmp;
+	return session_check_frame(session);
 }
 
 
-/* not threadsafe */
-int session_add_tag_unsafe(ab_tag_p tag, ab_session_p session)
+
+/*
+ * session_check_frame
+ *
+ * See if there is a complete packet at the front of the receive
+ * buffer.  If there is, has_response is set.  If the packet is bigger
+ * than the buffer, the buffer is grown so that the rest can be read.
+ */
+int session_check_frame(ab_session_p session)
 {
-	tag->next = session->tags;
-	session->tags = tag;
+	eip_encap_t *encap = (eip_encap_t *)(session->recv_data + session->recv_start);
+	int avail = session->recv_offset - session->recv_start;
+	int frame_size;
+
+	if(avail < (int)sizeof(eip_encap_t)) {
+		return PLCTAG_STATUS_OK;
+	}
+
+	frame_size = (int)sizeof(eip_encap_t) + le2h16(encap->encap_length);
+
+	if(frame_size > MAX_LARGE_REQ_RESP_SIZE) {
+		/*pdebug(debug,"Packet of %d bytes is too large!",frame_size);*/
+		return PLCTAG_ERR_TOO_LONG;
+	}
+
+	/* the data read so far is moved to the front before the next read. */
+	if(frame_size > session->recv_buf_size) {
+		return session_grow_recv_buf(session, frame_size);
+	}
+
+	if(avail >= frame_size) {
+		session->resp_seq_id = encap->encap_sender_context;
+		session->resp_size = frame_size;
+		session->has_response = 1;
+	}
 
 	return PLCTAG_STATUS_OK;
 }
 
 
-/* not threadsafe */
-int session_remove_tag_unsafe(ab_tag_p tag, ab_session_p session)
+
+
+
+
+
+
+
+
+/*
+ * session_grow_recv_buf
+ *
+ * Make sure that the session's receive buffer can hold a packet
+ * of the passed size.  Large Forward Open connections send packets
+ * bigger than the default buffer.
+ */
+int session_grow_recv_buf(ab_session_p session, int size)
 {
-	ab_tag_p tmp, prev;
-	int count = 0;
-	int debug = tag->debug;
+	uint8_t *new_buf;
 
-	tmp = session->tags;
-	prev = NULL;
+	if(size <= session->recv_buf_size) {
+		return PLCTAG_STATUS_OK;
+	}
 
-	while(tmp && tmp != tag) {
-		prev = tmp;
-		tmp = tmp->next;
-		count++;
+	if(size > MAX_LARGE_REQ_RESP_SIZE) {
+		/*pdebug(debug,"Packet of %d bytes is too large!",size);*/
+		return PLCTAG_ERR_TOO_LONG;
 	}
 
-	pdebug(debug,"found %d tags",count);
+	new_buf = request_buf_alloc(&size);
 
-	if(tmp) {
-		if(!prev) {
-			session->tags = tmp->next;
-		} else {
-			prev->next = tmp->next;
-		}
+	if(!new_buf) {
+		return PLCTAG_ERR_NO_MEM;
 	}
 
+	mem_copy(new_buf, session->recv_data, session->recv_offset);
+	request_buf_free(session->recv_data, session->recv_buf_size);
+
+	session->recv_data = new_buf;
+	session->recv_buf_size = size;
+
 	return PLCTAG_STATUS_OK;
 }
 
 
 
-ab_session_p ab_session_create(ab_tag_p tag, const char *host, int gw_port)
-{
-    ab_session_p session = AB_SESSION_NULL;
-    int debug = tag->debug;
 
-    pdebug(debug,"Starting");
 
-    session = (ab_session_p)mem_alloc(sizeof(struct ab_session_t));
 
-    if(!session) {
-        pdebug(debug,"alloc failed errno: %d",errno);
+/*
+ * check_mutex
+ *
+ * check to see if the global mutex is set up.  If not, do an atomic
+ * lock and set it up.
+ */
+int check_mutex(int debug)
+{
+	int rc = PLCTAG_STATUS_OK;
 
-        return AB_SESSION_NULL;
-    }
+	/* loop until we get the lock flag */
+	while(!lock_acquire((lock_t *)&tag_mutex_lock)) {
+		sleep_ms(1);
+	}
 
-    str_copy(session->host,host,MAX_SESSION_HOST);
+	/* first see if the mutex is there. */
+	if(!io_thread_mutex) {
+		rc = mutex_create((mutex_p *)&io_thread_mutex);
+		if(rc != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Unable to create global tag mutex!");
+		}
+	}
 
-    /* we must connect to the gateway and register */
-    if(!ab_session_connect(tag, session,host)) {
-        mem_free(session);
-        pdebug(debug,"session connect failed!");
-        return AB_SESSION_NULL;
-    }
+	/* the request pool is used as soon as there are tags. */
+	if(rc == PLCTAG_STATUS_OK && !request_pool_mutex) {
+		rc = mutex_create((mutex_p *)&request_pool_mutex);
+		if(rc != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Unable to create request pool mutex!");
+		}
+	}
 
-    if(!ab_session_register(tag, session)) {
-        ab_session_destroy_unsafe(tag, session);
-        pdebug(debug,"session registration failed!");
-        return AB_SESSION_NULL;
-    }
+	/* we hold the lock, so clear it.*/
+	lock_release((lock_t *)&tag_mutex_lock);
 
-    /*
-     * We assume that we are running in a threaded environment,
-     * so every session will have a different address.
-     *
-     * FIXME - is this needed?
-     */
-    session->session_seq_id = 0;
+	return rc;
+}
 
-    /* this is called while the mutex is held */
-    add_session_unsafe(tag, session);
 
-    pdebug(debug,"Done.");
+/*
+ * session_get_new_seq_id_unsafe
+ *
+ * A wrapper to get a new session sequence ID.  Not thread safe.
+ *
+ * Note that this is dangerous to use in threaded applications
+ * because 32-bit processors will not implement a 64-bit
+ * integer as an atomic entity.
+ */
 
-    return session;
+uint64_t session_get_new_seq_id_unsafe(ab_session_p sess)
+{
+	return sess->session_seq_id++;
 }
 
 
 
-
-
 /*
- * ab_session_connect()
+ * session_get_new_seq_id
  *
- * Connect to the host/port passed via TCP.  Set all the relevant fields in
- * the passed session object.
+ * A thread-safe function to get a new session sequence ID.
  */
 
-int ab_session_connect(ab_tag_p tag, ab_session_p session, const char *host)
+uint64_t session_get_new_seq_id(ab_session_p sess)
 {
-	int rc;
-	int debug = tag->debug;
+	uint16_t res;
 
-    pdebug(debug,"Starting.");
+	critical_block(sess->mutex) {
+		res = (uint16_t)session_get_new_seq_id_unsafe(sess);
+	}
 
-    /* Open a socket for communication with the gateway. */
-    rc = socket_create(&(session->sock));
+	return res;
+}
 
-    if(rc) {
-    	pdebug(debug,"Unable to create socket for session!");
-    	return 0;
-    }
 
-    rc = socket_connect_tcp(session->sock, host, AB_EIP_DEFAULT_PORT);
 
-    if(rc != PLCTAG_STATUS_OK) {
-    	pdebug(debug,"Unable to connect socket for session!");
-    	return 0;
-    }
 
-    /* everything is OK.  We have a TCP stream open to a gateway. */
-    session->is_connected = 1;
+/*
+ * request_create
+ *
+ * This does not do much for now other than allocate memory.  In the future
+ * it may be desired to keep a pool of request buffers instead.  This shim
+ * is here so that such a change can be done without major code changes
+ * elsewhere.
+ *
+ * The data buffer holds at least buf_size bytes.
+ */
+int request_create(ab_request_p *req, int buf_size)
+{
+	int rc = PLCTAG_STATUS_OK;
+	ab_request_p res = NULL;
+
+	/* reuse a request if there is one. */
+	critical_block(request_pool_mutex) {
+		if(request_pool) {
+			res = request_pool;
+			request_pool = res->next;
+			request_pool_free[REQUEST_POOL_REQS]--;
+			request_pool_hits[REQUEST_POOL_REQS]++;
+		} else {
+			request_pool_misses[REQUEST_POOL_REQS]++;
+		}
+	}
+
+	if(res) {
+		mem_set(res, 0, sizeof(struct ab_request_t));
+	} else {
+		res = (ab_request_p)mem_alloc(sizeof(struct ab_request_t));
+	}
+
+	if(res) {
+		res->data = request_buf_alloc(&buf_size);
+
+		if(!res->data) {
+			mem_free(res);
+			res = NULL;
+		} else {
+			res->buf_size = buf_size;
+		}
+	}
+
+	if(!res) {
+		*req = NULL;
+		rc = PLCTAG_ERR_NO_MEM;
+	} else {
+		*req = res;
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * session_link_request_unsafe
+ *
+ * Put the request on the session's request list right after pos, or
+ * at the head of the list if pos is NULL.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+void session_link_request_unsafe(ab_session_p sess, ab_request_p pos, ab_request_p req)
+{
+	req->prev = pos;
+
+	if(pos) {
+		req->next = pos->next;
+		pos->next = req;
+	} else {
+		req->next = sess->requests;
+		sess->requests = req;
+	}
+
+	if(req->next) {
+		req->next->prev = req;
+	} else {
+		sess->requests_tail = req;
+	}
+
+	/* the callers keep the list in priority order. */
+	if(!sess->prio_tail[req->priority] || sess->prio_tail[req->priority] == pos) {
+		sess->prio_tail[req->priority] = req;
+	}
+}
+
+
+
+/*
+ * session_unlink_request_unsafe
+ *
+ * Take the request off the session's request list.  Requests that are
+ * not on the list are left alone.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+void session_unlink_request_unsafe(ab_session_p sess, ab_request_p req)
+{
+	/* only the first request has no previous request. */
+	if(!req->prev && sess->requests != req) {
+		return;
+	}
+
+	if(req->next) {
+		req->next->prev = req->prev;
+	} else {
+		sess->requests_tail = req->prev;
+	}
+
+	if(req->prev) {
+		req->prev->next = req->next;
+	} else {
+		sess->requests = req->next;
+	}
+
+	if(sess->prio_tail[req->priority] == req) {
+		sess->prio_tail[req->priority] = ((req->prev && req->prev->priority == req->priority) ? req->prev : NULL);
+	}
+
+	req->next = NULL;
+	req->prev = NULL;
+
+	session_dispatch_remove_unsafe(sess, req);
+	session_timer_remove_unsafe(sess, req);
+
+	if(req->counted) {
+		atomic_int_add(&(sess->num_outstanding), -1);
+		req->counted = 0;
+	}
+}
+
+
+
+/*
+ * session_queue_request_unsafe
+ *
+ * Put a new request in its place in the request list.  Requests are
+ * sent in list order, so the list is sorted by priority and within a
+ * priority by deadline, earliest first.  Requests without a deadline
+ * go after those with one.  Requests with the same priority and
+ * deadline stay in the order they were queued, which keeps the
+ * fragments of a tag in order.
+ *
+ * Only requests still waiting to be sent are passed over, so the usual
+ * case of a deadline no earlier than the last one is O(1).
+ *
+ * You must hold the session's mutex before calling this!
+ */
+static void session_queue_request_unsafe(ab_session_p sess, ab_request_p req)
+{
+	ab_request_p pos = sess->prio_tail[req->priority];
+	int prio;
+
+	if(!pos) {
+		/* the first of its priority goes after the higher priority requests. */
+		for(prio = req->priority - 1; prio >= 0 && !pos; prio--) {
+			pos = sess->prio_tail[prio];
+		}
+	} else if(req->deadline) {
+		while(pos && pos->priority == req->priority && pos->send_request && !pos->send_in_progress
+		      && (!pos->deadline || pos->deadline > req->deadline)) {
+			pos = pos->prev;
+		}
+	}
+
+	session_link_request_unsafe(sess, pos, req);
+}
+
+
+
+/*
+ * request_add_unsafe
+ *
+ * You must hold the mutex before calling this!
+ */
+int request_add_unsafe(ab_session_p sess, ab_request_p req)
+{
+	/* make sure the request points to the session */
+	req->session = sess;
+
+	session_queue_request_unsafe(sess, req);
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+/*
+ * session_pool_pick
+ *
+ * Find the pool member with the fewest outstanding requests that can
+ * take the request.  A request for a CIP connection can only move to
+ * a member whose matching connection is at least as big as the one
+ * the request was sized for.  Failed members are skipped.  Each
+ * session's state and connections are read under that session's
+ * mutex, one session at a time.  The outstanding counts are only read,
+ * so the choice is a hint and not exact.
+ *
+ * On return, req->connection is the connection on the chosen member.
+ */
+static ab_session_p session_pool_pick(ab_session_p head, ab_request_p req)
+{
+	ab_connection_p head_conn = req->connection;
+	ab_session_p best = head;
+	ab_connection_p best_conn = head_conn;
+	int best_failed = 0;
+	int head_open = 0;
+	int head_payload = 0;
+	ab_session_p member;
+
+	critical_block(head->mutex) {
+		best_failed = (head->state == AB_SESSION_FAILED);
+
+		if(head_conn) {
+			head_open = (head_conn->state == AB_CONNECTION_OPEN);
+			head_payload = head_conn->max_payload_size;
+		}
+	}
+
+	for(member = head->pool_next; member; member = member->pool_next) {
+		ab_connection_p conn = NULL;
+		int usable = 0;
+
+		if(!best_failed && member->num_outstanding >= best->num_outstanding) {
+			continue;
+		}
+
+		/* the connection path does not change, only the state does. */
+		critical_block(member->mutex) {
+			if(member->state == AB_SESSION_FAILED) {
+				break;
+			}
+
+			if(head_conn) {
+				for(conn = member->connections; conn; conn = conn->next) {
+					if(conn->conn_path_size == head_conn->conn_path_size
+					   && !mem_cmp(conn->conn_path, head_conn->conn_path, head_conn->conn_path_size)) {
+						break;
+					}
+				}
+
+				if(!conn) {
+					break;
+				}
+
+				if(head_open && (conn->state != AB_CONNECTION_OPEN || conn->max_payload_size < head_payload)) {
+					break;
+				}
+			}
+
+			usable = 1;
+		}
+
+		if(!usable) {
+			continue;
+		}
+
+		best = member;
+		best_conn = conn;
+		best_failed = 0;
+	}
+
+	req->connection = best_conn;
+
+	return best;
+}
+
+
+
+/*
+ * request_add
+ *
+ * This is the thread-safe way to queue a request.  It does not take
+ * the session mutex.  The request is pushed onto the session's
+ * submission queue and the IO thread moves it to the request list
+ * the next time it runs.
+ */
+int request_add(ab_session_p sess, ab_request_p req)
+{
+	ab_request_p head;
+
+	/* a pooled session hands the request to its least busy member. */
+	if(sess->pool_head) {
+		sess = session_pool_pick(sess->pool_head, req);
+	}
+
+	/* make sure the request points to the session */
+	req->session = sess;
+
+	/* the count is dropped when the IO thread takes the request off the list. */
+	atomic_int_add(&(sess->num_outstanding), 1);
+	req->counted = 1;
+
+	/* the IO thread puts it on the timer wheel when it picks it up. */
+	if(req->timeout_ms > 0) {
+		req->deadline = time_ms() + req->timeout_ms;
+	}
+
+	do {
+		head = sess->submit_queue;
+		req->next = head;
+	} while(!atomic_ptr_cas((void * volatile *)&(sess->submit_queue), head, req));
+
+	/*
+	 * get the IO thread to send it.  If the queue was not empty, the
+	 * IO thread was already woken and will take this one as well.
+	 */
+	if(!head && sess->worker) {
+		poller_wake(sess->worker->poller);
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * session_take_submitted_unsafe
+ *
+ * Move the requests queued by request_add() to the end of the request
+ * list.  The queue is newest first, so it is reversed to keep the
+ * requests in the order they were added.
+ *
+ * You must hold the session mutex.
+ */
+static void session_take_submitted_unsafe(ab_session_p session)
+{
+	ab_request_p queue = (ab_request_p)atomic_ptr_exchange((void * volatile *)&(session->submit_queue), NULL);
+	ab_request_p in_order = NULL;
+
+	if(!queue) {
+		return;
+	}
+
+	while(queue) {
+		ab_request_p next = queue->next;
+
+		queue->next = in_order;
+		in_order = queue;
+		queue = next;
+	}
+
+	while(in_order) {
+		ab_request_p next = in_order->next;
+
+		session_queue_request_unsafe(session, in_order);
+
+		if(in_order->deadline) {
+			session_timer_add_unsafe(session, in_order);
+		}
+
+		in_order = next;
+	}
+}
+
+
+
+/*
+ * request_remove_unsafe
+ *
+ * You must hold the mutex before calling this!
+ */
+int request_remove_unsafe(ab_session_p sess, ab_request_p req)
+{
+	session_unlink_request_unsafe(sess, req);
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+/*
+ * request_remove
+ *
+ * This is a thread-safe version of the above routine.
+ */
+int request_remove(ab_session_p sess, ab_request_p req)
+{
+	int rc = PLCTAG_STATUS_OK;
+
+	/* in a session pool, the request may be on another member. */
+	if(req->session) {
+		sess = req->session;
+	}
+
+	critical_block(sess->mutex) {
+		rc = request_remove_unsafe(sess,req);
+	}
+
+	return rc;
+}
+
+
+
+
+
+/*
+ * request_destroy
+ *
+ * The request must be removed from any lists before this!
+ */
+int request_destroy(ab_request_p *req)
+{
+	if(req && *req) {
+		/* let go of any requests that were packed into this one */
+		if((*req)->packed_reqs) {
+			int i;
+
+			for(i = 0; i < (*req)->num_packed_reqs; i++) {
+				if((*req)->packed_reqs[i]) {
+					(*req)->packed_reqs[i]->packed_in = NULL;
+				}
+			}
+
+			mem_free((*req)->packed_reqs);
+		}
+
+		if((*req)->data) {
+			request_buf_free((*req)->data, (*req)->buf_size);
+		}
+
+		/* keep it for the next request_create() if there is room. */
+		critical_block(request_pool_mutex) {
+			if(request_pool_free[REQUEST_POOL_REQS] < REQUEST_POOL_MAX_FREE) {
+				(*req)->next = request_pool;
+				request_pool = *req;
+				request_pool_free[REQUEST_POOL_REQS]++;
+				*req = NULL;
+			}
+		}
+
+		if(*req) {
+			mem_free(*req);
+			*req = NULL;
+		}
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * request_buf_alloc
+ *
+ * Get a zeroed request buffer of at least *buf_size bytes.  Sizes are
+ * rounded up to one of the pooled sizes when they fit.  The real size
+ * is passed back in *buf_size.
+ */
+uint8_t *request_buf_alloc(int *buf_size)
+{
+	uint8_t *buf = NULL;
+	int pool = -1;
+
+	if(*buf_size <= MAX_REQ_RESP_SIZE) {
+		*buf_size = MAX_REQ_RESP_SIZE;
+		pool = REQUEST_POOL_SMALL;
+	} else if(*buf_size <= MAX_LARGE_REQ_RESP_SIZE) {
+		*buf_size = MAX_LARGE_REQ_RESP_SIZE;
+		pool = REQUEST_POOL_LARGE;
+	}
+
+	if(pool < 0) {
+		return (uint8_t *)mem_alloc(*buf_size);
+	}
+
+	critical_block(request_pool_mutex) {
+		uint8_t **head = &(request_buf_pool[pool - REQUEST_POOL_SMALL]);
+
+		if(*head) {
+			/* free buffers are linked through their first bytes. */
+			buf = *head;
+			*head = *((uint8_t **)buf);
+			request_pool_free[pool]--;
+			request_pool_hits[pool]++;
+		} else {
+			request_pool_misses[pool]++;
+		}
+	}
+
+	if(buf) {
+		/* the request builders expect zeroed buffers. */
+		mem_set(buf, 0, *buf_size);
+	} else {
+		buf = (uint8_t *)mem_alloc(*buf_size);
+	}
+
+	return buf;
+}
+
+
+
+/*
+ * request_buf_free
+ *
+ * Put a buffer back in its pool or free it if the pool is full.
+ */
+void request_buf_free(uint8_t *buf, int buf_size)
+{
+	int pool = -1;
+
+	if(buf_size == MAX_REQ_RESP_SIZE) {
+		pool = REQUEST_POOL_SMALL;
+	} else if(buf_size == MAX_LARGE_REQ_RESP_SIZE) {
+		pool = REQUEST_POOL_LARGE;
+	}
+
+	if(pool >= 0) {
+		critical_block(request_pool_mutex) {
+			if(request_pool_free[pool] < REQUEST_POOL_MAX_FREE) {
+				uint8_t **head = &(request_buf_pool[pool - REQUEST_POOL_SMALL]);
+
+				*((uint8_t **)buf) = *head;
+				*head = buf;
+				request_pool_free[pool]++;
+				buf = NULL;
+			}
+		}
+	}
+
+	if(buf) {
+		mem_free(buf);
+	}
+}
+
+
+
+/*
+ * ab_request_pool_stats
+ *
+ * Copy out the pool counters for plc_tag_get_request_pool_stats().
+ * They are all zero until the first tag is created.
+ */
+int ab_request_pool_stats(uint64_t *hits, uint64_t *misses, int *num_free)
+{
+	int i;
+
+	if(!request_pool_mutex) {
+		for(i = 0; i < REQUEST_POOL_COUNT; i++) {
+			if(hits) {
+				hits[i] = 0;
+			}
+			if(misses) {
+				misses[i] = 0;
+			}
+			if(num_free) {
+				num_free[i] = 0;
+			}
+		}
+
+		return PLCTAG_STATUS_OK;
+	}
+
+	critical_block(request_pool_mutex) {
+		for(i = 0; i < REQUEST_POOL_COUNT; i++) {
+			if(hits) {
+				hits[i] = request_pool_hits[i];
+			}
+			if(misses) {
+				misses[i] = request_pool_misses[i];
+			}
+			if(num_free) {
+				num_free[i] = request_pool_free[i];
+			}
+		}
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * request_pool_log_stats
+ *
+ * Show how well the request pool is doing.
+ */
+void request_pool_log_stats(int debug)
+{
+	critical_block(request_pool_mutex) {
+		pdebug(debug,"request pool: requests %llu hits %llu misses, small buffers %llu hits %llu misses, large buffers %llu hits %llu misses",
+		       (unsigned long long)request_pool_hits[REQUEST_POOL_REQS], (unsigned long long)request_pool_misses[REQUEST_POOL_REQS],
+		       (unsigned long long)request_pool_hits[REQUEST_POOL_SMALL], (unsigned long long)request_pool_misses[REQUEST_POOL_SMALL],
+		       (unsigned long long)request_pool_hits[REQUEST_POOL_LARGE], (unsigned long long)request_pool_misses[REQUEST_POOL_LARGE]);
+	}
+}
+
+
+
+
+
+
+
+/*
+ * session_create_unsafe
+ *
+ * Create a session and hand it to an IO thread.  Members of a session
+ * pool go on the same IO thread as the first session of the pool.
+ *
+ * You must hold the io_thread_mutex before calling this!
+ */
+static ab_session_p session_create_unsafe(ab_tag_p tag, attr attribs, ab_session_p pool_head)
+{
+	int debug = tag->debug;
+    const char *session_gw = attr_get_str(attribs,"gateway","");
+    int session_gw_port = attr_get_int(attribs,"gateway_port",AB_EIP_DEFAULT_PORT);
+    int io_threads = attr_get_int(attribs,"io_threads",DEFAULT_IO_THREADS);
+    int dedicated_io_thread = attr_get_int(attribs,"io_thread_per_session",0);
+    int max_reqs_in_flight = attr_get_int(attribs,"max_requests_in_flight",MAX_REQS_IN_FLIGHT);
+    ab_session_p session;
+
+    session = ab_session_create(tag, session_gw, session_gw_port);
+
+    if(session == AB_SESSION_NULL) {
+    	return AB_SESSION_NULL;
+    }
+
+    /* how many requests can be outstanding at once on this session? */
+    if(max_reqs_in_flight < 1) {
+        max_reqs_in_flight = 1;
+    }
+
+    if(max_reqs_in_flight > MAX_REQS_IN_FLIGHT) {
+        max_reqs_in_flight = MAX_REQS_IN_FLIGHT;
+    }
+
+    session->max_reqs_in_flight = max_reqs_in_flight;
+
+    /* the window starts small and grows while the PLC keeps up. */
+    session->window = (max_reqs_in_flight < DEFAULT_REQS_IN_FLIGHT ? max_reqs_in_flight : DEFAULT_REQS_IN_FLIGHT);
+    session->min_rtt_ms = -1;
+
+    if(pool_head) {
+    	ab_session_p *tail = &(pool_head->pool_next);
+    	int index = 1;
+
+    	while(*tail) {
+    		tail = &((*tail)->pool_next);
+    		index++;
+    	}
+
+    	*tail = session;
+    	session->pool_head = pool_head;
+
+    	/*
+    	 * the PLC tells connections apart by serial number, so keep
+    	 * those of the pool's sessions from running into each other.
+    	 */
+    	session->last_conn_id = pool_head->last_conn_id + (uint32_t)index * SESSION_POOL_CONN_ID_STEP;
+    }
+
+    /* hand the new session off to an IO thread. */
+    if(io_worker_add_session_unsafe(tag, session, io_threads, dedicated_io_thread) != PLCTAG_STATUS_OK) {
+        pdebug(debug,"unable to add session to an IO thread!");
+
+        /* pool members are cleaned up with the rest of the pool. */
+        if(!pool_head) {
+        	ab_session_destroy_unsafe(tag, session);
+        }
+
+        return AB_SESSION_NULL;
+    }
+
+    return session;
+}
+
+
+
+/*
+ * find_or_create_session
+ *
+ * With session_pool_size=N, N sessions are opened to the gateway.  The
+ * tags all belong to the first one, which is the only one that can be
+ * found.  request_add() spreads the requests over all of them.
+ *
+ * You must hold the io_thread_mutex before calling this!
+ */
+int find_or_create_session(ab_tag_p tag, attr attribs)
+{
+	int debug = tag->debug;
+    const char *session_gw = attr_get_str(attribs,"gateway","");
+    int session_gw_port = attr_get_int(attribs,"gateway_port",AB_EIP_DEFAULT_PORT);
+    ab_session_p session;
+    int shared_session = attr_get_int(attribs,"share_session",1); /* share the session by default. */
+    int pool_size = attr_get_int(attribs,"session_pool_size",1);
+    int i;
+
+    if(pool_size < 1 || pool_size > MAX_SESSION_POOL_SIZE) {
+    	pdebug(debug,"session_pool_size must be between 1 and %d!",MAX_SESSION_POOL_SIZE);
+    	return PLCTAG_ERR_BAD_PARAM;
+    }
+
+    /* if we are to share sessions, then look for an existing one. */
+    if(shared_session) {
+    	session = find_session_unsafe(tag, session_gw, session_gw_port);
+    } else {
+    	/* no sharing, create a new one */
+    	session = AB_SESSION_NULL;
+    }
+
+    if(session == AB_SESSION_NULL) {
+        session = session_create_unsafe(tag, attribs, NULL);
+
+        if(session != AB_SESSION_NULL && pool_size > 1) {
+        	session->pool_head = session;
+
+        	for(i = 1; i < pool_size; i++) {
+        		if(!session_create_unsafe(tag, attribs, session)) {
+        			pdebug(debug,"Unable to create session %d of the pool!",i);
+        			break;
+        		}
+        	}
+
+        	if(i < pool_size) {
+        		ab_session_destroy_unsafe(tag, session);
+        		session = AB_SESSION_NULL;
+        	}
+        }
+
+        /* only shared sessions can be found by other tags. */
+        if(session != AB_SESSION_NULL && shared_session) {
+        	add_session_unsafe(tag, session);
+        }
+    } else {
+        pdebug(debug,"find_or_create_session() reusing existing session.");
+    }
+
+    if(session == AB_SESSION_NULL) {
+        pdebug(debug,"unable to create or find a session!");
+
+    	return PLCTAG_ERR_BAD_GATEWAY;
+    }
+
+    tag->session = session;
+    tag->io_event = session->io_event;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+
+
+
+/*
+ * session_hash
+ *
+ * Hash the gateway host name, ignoring case like the lookup does, and
+ * the port.
+ */
+static unsigned int session_hash(const char *host, int port)
+{
+	unsigned int h = 2166136261u;
+
+	while(*host) {
+		char c = *host++;
+
+		if(c >= 'A' && c <= 'Z') {
+			c = (char)(c - 'A' + 'a');
+		}
+
+		h = (h ^ (unsigned char)c) * 16777619u;
+	}
+
+	h = (h ^ (unsigned int)port) * 16777619u;
+
+	return h;
+}
+
+
+
+/*
+ * session_table_link_unsafe
+ *
+ * Put the session at the head of its hash bucket.
+ */
+static void session_table_link_unsafe(ab_session_p n)
+{
+	ab_session_p *bucket = &session_table[n->hash & (session_table_size - 1)];
+
+	n->prev = NULL;
+	n->next = *bucket;
+
+	if(*bucket) {
+		(*bucket)->prev = n;
+	}
+
+	*bucket = n;
+}
+
+
+
+/*
+ * session_table_grow_unsafe
+ *
+ * Double the size of the session hash table and rehash the sessions.
+ */
+static int session_table_grow_unsafe(void)
+{
+	ab_session_p *old_table = session_table;
+	int old_size = session_table_size;
+	int new_size = (old_size ? old_size * 2 : SESSION_TABLE_MIN_SIZE);
+	int i;
+
+	session_table = (ab_session_p *)mem_alloc(new_size * sizeof(ab_session_p));
+
+	if(!session_table) {
+		session_table = old_table;
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	session_table_size = new_size;
+
+	for(i = 0; i < old_size; i++) {
+		while(old_table[i]) {
+			ab_session_p n = old_table[i];
+
+			old_table[i] = n->next;
+			session_table_link_unsafe(n);
+		}
+	}
+
+	if(old_table) {
+		mem_free(old_table);
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * add_session_unsafe
+ *
+ * Add the session to the hash table.
+ *
+ * You must hold the io_thread_mutex before calling this!
+ */
+int add_session_unsafe(ab_tag_p tag,  ab_session_p n)
+{
+    if(!n)
+        return PLCTAG_ERR_NULL_PTR;
+
+    if(num_sessions >= session_table_size) {
+    	int rc = session_table_grow_unsafe();
+
+    	if(rc != PLCTAG_STATUS_OK) {
+    		pdebug(tag->debug,"Unable to grow session table!");
+    		return rc;
+    	}
+    }
+
+    n->hash = session_hash(n->host, n->port);
+
+    session_table_link_unsafe(n);
+
+    num_sessions++;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+int add_session(ab_tag_p tag,  ab_session_p s)
+{
+	int rc;
+
+	pdebug(tag->debug,"Locking mutex");
+	critical_block(io_thread_mutex) {
+		rc = add_session_unsafe(tag, s);
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * remove_session_unsafe
+ *
+ * Unlink the session from its hash bucket.
+ *
+ * You must hold the io_thread_mutex before calling this!
+ */
+int remove_session_unsafe(ab_tag_p tag, ab_session_p n)
+{
+    if(!n || !session_table)
+    	return 0;
+
+    /* only the first session in a bucket has no previous session. */
+    if(!n->prev && session_table[n->hash & (session_table_size - 1)] != n) {
+    	return PLCTAG_ERR_NOT_FOUND;
+    }
+
+    if(n->next) {
+    	n->next->prev = n->prev;
+    }
+
+    if(n->prev) {
+    	n->prev->next = n->next;
+    } else {
+    	session_table[n->hash & (session_table_size - 1)] = n->next;
+    }
+
+    n->next = NULL;
+    n->prev = NULL;
+
+    num_sessions--;
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+
+int remove_session(ab_tag_p tag,  ab_session_p s)
+{
+	int rc;
+
+	pdebug(tag->debug,"Locking mutex");
+	critical_block(io_thread_mutex) {
+		rc = remove_session_unsafe(tag, s);
+	}
+	pdebug(tag->debug,"Mutex released");
+
+	return rc;
+}
+
+
+
+
+
+/*
+ * find_session_unsafe
+ *
+ * Look up the session to the gateway host and port.
+ *
+ * You must hold the io_thread_mutex before calling this!
+ */
+ab_session_p find_session_unsafe(ab_tag_p tag, const char *host, int port)
+{
+	ab_session_p tmp;
+	unsigned int hash;
+
+	if(!session_table) {
+		return AB_SESSION_NULL;
+	}
+
+	hash = session_hash(host, port);
+
+	for(tmp = session_table[hash & (session_table_size - 1)]; tmp; tmp = tmp->next) {
+		if(tmp->hash == hash && tmp->port == port && !str_cmp_i(tmp->host, host)) {
+			break;
+		}
+	}
+
+	pdebug(tag->debug,"%s session for %s:%d",(tmp ? "found" : "no"),host,port);
+
+	return tmp;
+}
+
+
+/*
+ * not threadsafe, you must hold the io_thread_mutex.  The session
+ * mutex is taken too because the IO thread walks the tag list to
+ * find callbacks to run.
+ */
+int session_add_tag_unsafe(ab_tag_p tag, ab_session_p session)
+{
+	critical_block(session->mutex) {
+		tag->prev = NULL;
+		tag->next = session->tags;
+
+		if(session->tags) {
+			session->tags->prev = tag;
+		}
+
+		session->tags = tag;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+/* not threadsafe, see above. */
+int session_remove_tag_unsafe(ab_tag_p tag, ab_session_p session)
+{
+	critical_block(session->mutex) {
+		/* only the first tag has no previous tag. */
+		if(tag->prev || session->tags == tag) {
+			if(tag->next) {
+				tag->next->prev = tag->prev;
+			}
+
+			if(tag->prev) {
+				tag->prev->next = tag->next;
+			} else {
+				session->tags = tag->next;
+			}
+		}
+
+		tag->next = NULL;
+		tag->prev = NULL;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * session_find_or_create_conn_unsafe
+ *
+ * Find or make the connection on one session for the tag's route.
+ * Returns NULL if there is no memory for a new one.
+ */
+static ab_connection_p session_find_or_create_conn_unsafe(ab_tag_p tag, ab_session_p session)
+{
+	ab_connection_p conn = AB_CONNECTION_NULL;
+	int path_size = tag->conn_path_size + tag->routing_path_size;
+	int debug = tag->debug;
+
+	critical_block(session->mutex) {
+		for(conn = session->connections; conn; conn = conn->next) {
+			if(conn->conn_path_size == path_size
+			   && !mem_cmp(conn->conn_path, tag->conn_path, tag->conn_path_size)
+			   && !mem_cmp(conn->conn_path + tag->conn_path_size, tag->routing_path, tag->routing_path_size)) {
+				break;
+			}
+		}
+
+		if(!conn) {
+			pdebug(debug,"Creating new connection.");
+
+			conn = (ab_connection_p)mem_alloc(sizeof(struct ab_connection_t));
+
+			if(!conn) {
+				break;
+			}
+
+			conn->session = session;
+			conn->state = AB_CONNECTION_NOT_OPEN;
+			conn->try_large = 1;
+
+			/* the connection goes to the message router in the PLC */
+			mem_copy(conn->conn_path, tag->conn_path, tag->conn_path_size);
+			mem_copy(conn->conn_path + tag->conn_path_size, tag->routing_path, tag->routing_path_size);
+			conn->conn_path_size = path_size;
+
+			conn->next = session->connections;
+			session->connections = conn;
+		}
+	}
+
+	return conn;
+}
+
+
+
+/*
+ * connection_find_or_create_unsafe
+ *
+ * Find the connection on the session that goes along the same route
+ * as the tag or make a new one.  The connection is not opened here,
+ * the IO thread does that when the first request needs it.
+ *
+ * You must hold the io_thread_mutex before calling this!
+ */
+int connection_find_or_create_unsafe(ab_tag_p tag, ab_session_p session)
+{
+	ab_connection_p conn = AB_CONNECTION_NULL;
+	ab_session_p member;
+	int path_size = tag->conn_path_size + tag->routing_path_size;
+	int debug = tag->debug;
+
+	if(path_size > MAX_CONN_PATH) {
+		pdebug(debug,"Connection path too long!");
+		return PLCTAG_ERR_BAD_PARAM;
+	}
+
+	/*
+	 * each member of a session pool gets its own connection along
+	 * the same route so that requests can be sent on any of them.
+	 */
+	for(member = session->pool_next; member; member = member->pool_next) {
+		if(!session_find_or_create_conn_unsafe(tag, member)) {
+			pdebug(debug,"Unable to allocate new connection!");
+			return PLCTAG_ERR_NO_MEM;
+		}
+	}
+
+	conn = session_find_or_create_conn_unsafe(tag, session);
+
+	if(!conn) {
+		pdebug(debug,"Unable to allocate new connection!");
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	tag->connection = conn;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * connection_check_unsafe
+ *
+ * See if the request's connection can be used.  Returns PLCTAG_STATUS_OK
+ * if the request can be sent on it now and PLCTAG_STATUS_PENDING if the
+ * request must wait for it to open.  If the connection needs opening,
+ * *fo is set to a new Forward Open request that the caller must send.
+ * Any error means the request should be sent unconnected.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int connection_check_unsafe(ab_session_p session, ab_request_p req, ab_request_p *fo)
+{
+	ab_connection_p conn = req->connection;
+	int rc;
+
+	*fo = NULL;
+
+	/*
+	 * the PLC drops connections that sit idle, so open a new one instead.
+	 * Close the old one first so that it does not hold one of the PLC's
+	 * few connection slots until it times out.
+	 */
+	if(conn->state == AB_CONNECTION_OPEN && time_ms() - conn->last_used_ms > AB_EIP_CONN_IDLE_REOPEN_MS) {
+		pdebug(req->debug,"Connection has been idle too long, reopening it.");
+		connection_close_unsafe(session, conn, req->debug);
+		conn->state = AB_CONNECTION_NOT_OPEN;
+	}
+
+	switch(conn->state) {
+		case AB_CONNECTION_OPEN:
+			conn->last_used_ms = time_ms();
+
+			/* read the symbol table in the background once there is a connection to read it on. */
+			if(conn->use_symbols && conn->symbol_state == AB_SYMBOLS_NOT_LOADED) {
+				connection_browse_unsafe(session, conn, 0, req->debug);
+			}
+
+			return PLCTAG_STATUS_OK;
+			break;
+
+		case AB_CONNECTION_OPENING:
+			return PLCTAG_STATUS_PENDING;
+			break;
+
+		case AB_CONNECTION_NOT_OPEN:
+			rc = request_create(fo, MAX_REQ_RESP_SIZE);
+
+			if(rc != PLCTAG_STATUS_OK) {
+				conn->state = AB_CONNECTION_FAILED;
+				return rc;
+			}
+
+			/* new IDs every time, the old connection may still exist in the PLC. */
+			conn->orig_connection_id = ++session->last_conn_id;
+			conn->conn_serial_number = (uint16_t)(conn->orig_connection_id);
+			conn->conn_seq_num = 0;
+
+			(*fo)->debug = req->debug;
+			(*fo)->session = session;
+			(*fo)->open_connection = conn;
+
+			cip_build_forward_open(conn, *fo);
+
+			pdebug(req->debug,"Opening connection %x.",conn->orig_connection_id);
+
+			conn->state = AB_CONNECTION_OPENING;
+
+			return PLCTAG_STATUS_PENDING;
+			break;
+
+		default:
+			return PLCTAG_ERR_REMOTE_ERR;
+			break;
+	}
+
+	return PLCTAG_ERR_REMOTE_ERR;
+}
+
+
+
+/*
+ * connection_handle_open_response_unsafe
+ *
+ * Process the reply to a Forward Open.  If it failed, requests that
+ * wanted the connection are sent unconnected instead.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int connection_handle_open_response_unsafe(ab_request_p fo)
+{
+	ab_connection_p conn = fo->open_connection;
+	uint32_t targ_connection_id = 0;
+	int rc;
+
+	rc = cip_check_forward_open_response(fo, &targ_connection_id);
+
+	if(rc != PLCTAG_STATUS_OK) {
+		/* older PLCs do not know Large Forward Open, try the standard one. */
+		if(conn->try_large && fo->status == PLCTAG_STATUS_OK) {
+			pdebug(fo->debug,"Large Forward Open failed, trying standard Forward Open.");
+			conn->try_large = 0;
+			conn->state = AB_CONNECTION_NOT_OPEN;
+			return rc;
+		}
+
+		pdebug(fo->debug,"Forward Open failed, using unconnected messaging.");
+		conn->state = AB_CONNECTION_FAILED;
+		return rc;
+	}
+
+	conn->max_payload_size = (conn->try_large ? MAX_CIP_LARGE_PAYLOAD_SIZE : MAX_CIP_STD_PAYLOAD_SIZE);
+
+	pdebug(fo->debug,"Connection %x open, target ID %x, payload %d bytes.",conn->orig_connection_id,targ_connection_id,conn->max_payload_size);
+
+	conn->targ_connection_id = targ_connection_id;
+	conn->last_used_ms = time_ms();
+	conn->state = AB_CONNECTION_OPEN;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * connection_close_unsafe
+ *
+ * Queue a Forward Close for the connection so that the PLC frees it
+ * now instead of when it times out.  It is sent unconnected and nobody
+ * waits for it.  The connection's state is left to the caller.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int connection_close_unsafe(ab_session_p session, ab_connection_p conn, int debug)
+{
+	ab_request_p req = NULL;
+	int rc;
+
+	rc = request_create(&req, MAX_REQ_RESP_SIZE);
+
+	if(rc != PLCTAG_STATUS_OK) {
+		pdebug(debug,"Unable to create Forward Close request! rc=%d",rc);
+		return rc;
+	}
+
+	req->debug = debug;
+	req->close_connection = 1;
+
+	cip_build_forward_close(conn, req);
+
+	pdebug(debug,"Closing connection %x.",conn->orig_connection_id);
+
+	request_add_unsafe(session, req);
+
+	req->deadline = time_ms() + AB_EIP_CONN_CLOSE_TIMEOUT_MS;
+	session_timer_add_unsafe(session, req);
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+static char symbol_lower(char c)
+{
+	if(c >= 'A' && c <= 'Z') {
+		c = (char)(c - 'A' + 'a');
+	}
+
+	return c;
+}
+
+
+
+/*
+ * symbol_hash
+ *
+ * Hash a tag name without case, the PLC does not care about it either.
+ */
+static uint32_t symbol_hash(const char *name, int name_len)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for(i = 0; i < name_len; i++) {
+		h = (h ^ (unsigned char)symbol_lower(name[i])) * 16777619u;
+	}
+
+	return h;
+}
+
+
+
+static int symbol_name_matches(struct ab_symbol_t *sym, const char *name, int name_len)
+{
+	int i;
+
+	for(i = 0; i < name_len; i++) {
+		if(!sym->name[i] || symbol_lower(sym->name[i]) != symbol_lower(name[i])) {
+			return 0;
+		}
+	}
+
+	return sym->name[name_len] == 0;
+}
+
+
+
+/*
+ * connection_find_symbol_unsafe
+ *
+ * Look up the Symbol Object instance of a tag name in the connection's
+ * symbol table.  Returns PLCTAG_ERR_NOT_FOUND if it is not there.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int connection_find_symbol_unsafe(ab_connection_p conn, const char *name, int name_len, uint32_t *instance)
+{
+	uint32_t hash = symbol_hash(name, name_len);
+	int i;
+
+	if(!conn->symbols) {
+		return PLCTAG_ERR_NOT_FOUND;
+	}
+
+	for(i = hash & (conn->symbols_size - 1); conn->symbols[i].name; i = (i + 1) & (conn->symbols_size - 1)) {
+		if(conn->symbols[i].hash == hash && symbol_name_matches(&conn->symbols[i], name, name_len)) {
+			*instance = conn->symbols[i].instance;
+			return PLCTAG_STATUS_OK;
+		}
+	}
+
+	return PLCTAG_ERR_NOT_FOUND;
+}
+
+
+
+/*
+ * connection_add_symbol_unsafe
+ *
+ * Add a tag name and its Symbol Object instance to the connection's
+ * symbol table, or update the instance if the name is there.  The
+ * table doubles when it gets half full.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int connection_add_symbol_unsafe(ab_connection_p conn, const char *name, int name_len, uint32_t instance)
+{
+	uint32_t hash = symbol_hash(name, name_len);
+	int i;
+
+	for(i = (conn->symbols ? (int)(hash & (conn->symbols_size - 1)) : 0); conn->symbols && conn->symbols[i].name; i = (i + 1) & (conn->symbols_size - 1)) {
+		if(conn->symbols[i].hash == hash && symbol_name_matches(&conn->symbols[i], name, name_len)) {
+			conn->symbols[i].instance = instance;
+			return PLCTAG_STATUS_OK;
+		}
+	}
+
+	if((conn->symbols_count + 1) * 2 > conn->symbols_size) {
+		int new_size = (conn->symbols_size ? conn->symbols_size * 2 : SYMBOL_TABLE_MIN_SIZE);
+		struct ab_symbol_t *new_table = (struct ab_symbol_t *)mem_alloc(new_size * (int)sizeof(struct ab_symbol_t));
+
+		if(!new_table) {
+			return PLCTAG_ERR_NO_MEM;
+		}
+
+		for(i = 0; i < conn->symbols_size; i++) {
+			if(conn->symbols[i].name) {
+				int j = conn->symbols[i].hash & (new_size - 1);
+
+				while(new_table[j].name) {
+					j = (j + 1) & (new_size - 1);
+				}
+
+				new_table[j] = conn->symbols[i];
+			}
+		}
+
+		if(conn->symbols) {
+			mem_free(conn->symbols);
+		}
+
+		conn->symbols = new_table;
+		conn->symbols_size = new_size;
+	}
+
+	for(i = hash & (conn->symbols_size - 1); conn->symbols[i].name; i = (i + 1) & (conn->symbols_size - 1)) {
+		/* nothing to do, find the first empty slot. */
+	}
+
+	conn->symbols[i].name = (char *)mem_alloc(name_len + 1);
+
+	if(!conn->symbols[i].name) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	mem_copy(conn->symbols[i].name, (void *)name, name_len);
+	conn->symbols[i].hash = hash;
+	conn->symbols[i].instance = instance;
+	conn->symbols_count++;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * connection_free_symbols_unsafe
+ *
+ * You must hold the session's mutex before calling this!
+ */
+static void connection_free_symbols_unsafe(ab_connection_p conn)
+{
+	int i;
+
+	if(!conn->symbols) {
+		return;
+	}
+
+	for(i = 0; i < conn->symbols_size; i++) {
+		if(conn->symbols[i].name) {
+			mem_free(conn->symbols[i].name);
+		}
+	}
+
+	mem_free(conn->symbols);
+
+	conn->symbols = NULL;
+	conn->symbols_size = 0;
+	conn->symbols_count = 0;
+}
+
+
+
+/*
+ * connection_browse_unsafe
+ *
+ * Queue a request for the next page of the PLC's symbol table.  It is
+ * a bulk request on the connection, so tag requests go ahead of it.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int connection_browse_unsafe(ab_session_p session, ab_connection_p conn, uint32_t start_instance, int debug)
+{
+	ab_request_p req = NULL;
+	int rc;
+
+	rc = request_create(&req, MAX_REQ_RESP_SIZE);
+
+	if(rc != PLCTAG_STATUS_OK) {
+		pdebug(debug,"Unable to create symbol browse request! rc=%d",rc);
+		conn->symbol_state = AB_SYMBOLS_FAILED;
+		return rc;
+	}
+
+	req->debug = debug;
+	req->connection = conn;
+	req->browse_connection = conn;
+	req->priority = AB_PRIORITY_BULK;
+
+	cip_build_symbol_browse(conn, req, start_instance);
+
+	request_add_unsafe(session, req);
+
+	req->deadline = time_ms() + AB_SYMBOLS_BROWSE_TIMEOUT_MS;
+	session_timer_add_unsafe(session, req);
+
+	conn->symbol_state = AB_SYMBOLS_LOADING;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * connection_handle_browse_response_unsafe
+ *
+ * Put the symbols from a browse reply into the table and ask for the
+ * next page if there is one.  Tags keep using names if the browse
+ * fails.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int connection_handle_browse_response_unsafe(ab_request_p req)
+{
+	ab_connection_p conn = req->browse_connection;
+	uint32_t next_instance = 0;
+	int more = 0;
+	int rc;
+
+	rc = cip_check_symbol_browse_response(req, conn, &next_instance, &more);
+
+	if(rc != PLCTAG_STATUS_OK) {
+		pdebug(req->debug,"Symbol browse failed, tags will be read by name. rc=%d",rc);
+		conn->symbol_state = AB_SYMBOLS_FAILED;
+		return rc;
+	}
+
+	if(more) {
+		return connection_browse_unsafe(req->session, conn, next_instance, req->debug);
+	}
+
+	pdebug(req->debug,"Symbol table loaded, %d symbols.",conn->symbols_count);
+
+	conn->symbol_state = AB_SYMBOLS_LOADED;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+ab_session_p ab_session_create(ab_tag_p tag, const char *host, int gw_port)
+{
+    ab_session_p session = AB_SESSION_NULL;
+    int debug = tag->debug;
+
+    pdebug(debug,"Starting");
+
+    session = (ab_session_p)mem_alloc(sizeof(struct ab_session_t));
+
+    if(!session) {
+        pdebug(debug,"alloc failed errno: %d",errno);
+
+        return AB_SESSION_NULL;
+    }
+
+    str_copy(session->host,host,MAX_SESSION_HOST);
+    session->port = gw_port;
+
+    /*
+     * this grows if we get a Large Forward Open connection.  It is a
+     * request buffer because it is traded with the requests that
+     * responses are received for.
+     */
+    session->recv_buf_size = MAX_REQ_RESP_SIZE;
+    session->recv_data = request_buf_alloc(&(session->recv_buf_size));
+
+    if(!session->recv_data) {
+        mem_free(session);
+        pdebug(debug,"unable to allocate receive buffer!");
+        return AB_SESSION_NULL;
+    }
+
+    if(mutex_create(&(session->mutex)) != PLCTAG_STATUS_OK) {
+        request_buf_free(session->recv_data, session->recv_buf_size);
+        mem_free(session);
+        pdebug(debug,"unable to create session mutex!");
+        return AB_SESSION_NULL;
+    }
+
+    if(event_create(&(session->io_event)) != PLCTAG_STATUS_OK) {
+        mutex_destroy(&(session->mutex));
+        request_buf_free(session->recv_data, session->recv_buf_size);
+        mem_free(session);
+        pdebug(debug,"unable to create session IO event!");
+        return AB_SESSION_NULL;
+    }
+
+    /*
+     * start connecting to the gateway.  The IO thread finishes the
+     * connection and registers the session, tags using the session
+     * are pending until then.
+     */
+    session->debug = debug;
+    session->state = AB_SESSION_CONNECTING;
+    session->status = PLCTAG_STATUS_PENDING;
+    session->setup_deadline = time_ms() + AB_SESSION_SETUP_TIMEOUT_MS;
+
+    if(!ab_session_connect(tag, session,host)) {
+        if(session->sock) {
+            socket_destroy(&(session->sock));
+        }
+        event_destroy(&(session->io_event));
+        mutex_destroy(&(session->mutex));
+        request_buf_free(session->recv_data, session->recv_buf_size);
+        mem_free(session);
+        pdebug(debug,"session connect failed!");
+        return AB_SESSION_NULL;
+    }
+
+    /*
+     * We assume that we are running in a threaded environment,
+     * so every session will have a different address.
+     *
+     * FIXME - is this needed?
+     */
+    session->session_seq_id = 0;
+
+    /* connection IDs only need to differ from those of earlier runs. */
+    session->last_conn_id = (uint32_t)time_ms();
+
+    pdebug(debug,"Done.");
+
+    return session;
+}
+
+
+
+
+
+/*
+ * ab_session_connect()
+ *
+ * Start connecting to the host via TCP.  This does not wait for the
+ * connection, session_setup_step_unsafe() finishes it in the IO thread.
+ */
+
+int ab_session_connect(ab_tag_p tag, ab_session_p session, const char *host)
+{
+	int rc;
+	int debug = tag->debug;
+
+    pdebug(debug,"Starting.");
+
+    /* Open a socket for communication with the gateway. */
+    rc = socket_create(&(session->sock));
+
+    if(rc) {
+    	pdebug(debug,"Unable to create socket for session!");
+    	return 0;
+    }
+
+    rc = socket_connect_tcp_start(session->sock, host, session->port);
+
+    if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
+    	pdebug(debug,"Unable to start connecting socket for session!");
+    	return 0;
+    }
+
+    pdebug(debug,"Done.");
+
+    return 1;
+}
+
+
+
+/*
+ * session_close_connections_unsafe
+ *
+ * Send a Forward Close for each open connection of a session that is
+ * going away so that the PLC frees them now.  The IO thread is done
+ * with the session, so the requests are written here and the replies
+ * are waited for a short time.  Closing the socket with data unread
+ * can reset it before the PLC has the requests.
+ *
+ * You must hold io_thread_mutex before calling this!
+ */
+static void session_close_connections_unsafe(ab_session_p session, int debug)
+{
+	int64_t deadline = time_ms() + AB_EIP_CONN_CLOSE_WAIT_MS;
+	uint64_t first_seq_id = session->session_seq_id;
+	ab_connection_p conn;
+	ab_request_p req = NULL;
+	int num_sent = 0;
+	int rc;
+
+	if(!session->is_connected || session->state != AB_SESSION_READY) {
+		return;
+	}
+
+	for(conn = session->connections; conn; conn = conn->next) {
+		int offset = 0;
+
+		if(conn->state != AB_CONNECTION_OPEN) {
+			continue;
+		}
+
+		if(!req && request_create(&req, MAX_REQ_RESP_SIZE) != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Unable to create Forward Close request!");
+			break;
+		}
+
+		cip_build_forward_close(conn, req);
+		request_set_encap_unsafe(session, req);
+
+		pdebug(debug,"Closing connection %x.",conn->orig_connection_id);
+
+		while(offset < req->request_size && time_ms() < deadline) {
+			rc = socket_write(session->sock, req->data + offset, req->request_size - offset);
+
+			if(rc > 0) {
+				offset += rc;
+			} else if(rc == PLCTAG_ERR_NO_DATA) {
+				sleep_ms(1);
+			} else {
+				break;
+			}
+		}
+
+		conn->state = AB_CONNECTION_NOT_OPEN;
+
+		/* the rest of a partly written packet cannot go out. */
+		if(offset < req->request_size) {
+			pdebug(debug,"Unable to send Forward Close!");
+			break;
+		}
+
+		num_sent++;
+	}
+
+	if(req) {
+		request_destroy(&req);
+	}
+
+	/* replies to requests that were given up on may come first. */
+	while(num_sent > 0 && time_ms() < deadline) {
+		rc = recv_eip_response(session);
+
+		if(rc == PLCTAG_ERR_NO_DATA) {
+			sleep_ms(1);
+			continue;
+		}
+
+		if(rc != PLCTAG_STATUS_OK) {
+			break;
+		}
+
+		while(session->has_response) {
+			eip_encap_t *encap = (eip_encap_t *)(session->recv_data + session->recv_start);
+
+			if(encap->encap_command == h2le16(AB_EIP_READ_RR_DATA) && encap->encap_sender_context > first_seq_id) {
+				num_sent--;
+			}
+
+			session->recv_start += session->resp_size;
+			session->has_response = 0;
+
+			if(session->recv_start >= session->recv_offset) {
+				session->recv_start = 0;
+				session->recv_offset = 0;
+			}
+
+			if(session_check_frame(session) != PLCTAG_STATUS_OK) {
+				num_sent = 0;
+				break;
+			}
+		}
+	}
+}
+
+
+
+int ab_session_destroy_unsafe(ab_tag_p tag, ab_session_p session)
+{
+	int debug = tag->debug;
+
+    pdebug(debug,"Starting.");
+
+    if(!session)
+        return 1;
+
+    /* do not destroy the session if there are
+     * connections still */
+    if(session->tags) {
+        pdebug(debug,"Attempt to destroy session while open tags exist!");
+        return 0;
+    }
+
+    /* the rest of a session pool goes with its first session. */
+    while(session->pool_next) {
+    	ab_session_p member = session->pool_next;
+
+    	session->pool_next = member->pool_next;
+    	member->pool_next = NULL;
+    	member->pool_head = NULL;
+
+    	ab_session_destroy_unsafe(tag, member);
+    }
+
+    /* after this, the IO thread will not touch the session. */
+    io_worker_remove_session_unsafe(tag, session);
+
+    /* free the PLC's connection slots before the socket goes. */
+    session_close_connections_unsafe(session, tag->debug);
+
+    if(ab_session_unregister(tag, session))
+        return 0;
+
+    /* close the socket. */
+    if(session->is_connected) {
+		socket_close(session->sock);
+		socket_destroy(&(session->sock));
+        session->is_connected = 0;
+    }
+
+    remove_session_unsafe(tag, session);
+
+    /* the tags are gone, so nobody else points to what is left of the requests. */
+    session_take_submitted_unsafe(session);
+
+    while(session->requests) {
+        ab_request_p req = session->requests;
+
+        session_unlink_request_unsafe(session, req);
+        request_destroy(&req);
+    }
+
+    request_pool_log_stats(debug);
+
+    /* the PLC closes the connections when the session goes away. */
+    while(session->connections) {
+        ab_connection_p conn = session->connections;
+
+        session->connections = conn->next;
+        connection_free_symbols_unsafe(conn);
+        mem_free(conn);
+    }
+
+    event_destroy(&(session->io_event));
+    mutex_destroy(&(session->mutex));
+
+    if(session->dispatch) {
+        mem_free(session->dispatch);
+    }
+
+    request_buf_free(session->recv_data, session->recv_buf_size);
+    mem_free(session);
+
+    pdebug(debug,"Done.");
+
+    return 1;
+}
+
+
+
+int ab_session_destroy(ab_tag_p tag, ab_session_p session)
+{
+	int rc;
+
+	critical_block(io_thread_mutex) {
+		rc = ab_session_destroy_unsafe(tag, session);
+	}
+
+	io_worker_reap();
+
+	return rc;
+}
+
+
+
+int ab_session_empty(ab_session_p session)
+{
+    return (session->tags == NULL);
+}
+
+
+
+
+
+/*
+ * ab_session_register_unsafe
+ *
+ * Queue the Register Session request.  It goes out through the normal
+ * send path ahead of any other request, and session_setup_step_unsafe()
+ * picks up the session handle from the response.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int ab_session_register_unsafe(ab_session_p session)
+{
+	int debug = session->debug;
+    eip_session_reg_req *reg;
+    ab_request_p req;
+    int rc;
+
+    pdebug(debug,"Starting.");
+
+    rc = request_create(&req, MAX_REQ_RESP_SIZE);
+
+    if(rc != PLCTAG_STATUS_OK) {
+    	pdebug(debug,"Unable to create session registration request!");
+    	return rc;
+    }
+
+    req->debug = debug;
+    req->session = session;
+    req->send_request = 1;
+    req->request_size = sizeof(eip_session_reg_req);
+
+    reg = (eip_session_reg_req *)(req->data);
+
+    /* fill in the fields of the request, the rest of the header is filled in when it is sent. */
+    reg->encap_command 			= h2le16(AB_EIP_REGISTER_SESSION);
+    reg->eip_version   			= h2le16(AB_EIP_VERSION);
+    reg->option_flags  			= 0;
+
+    /* it goes on the request list so that the response finds it. */
+    req->priority = AB_PRIORITY_HIGH;
+    session_link_request_unsafe(session, NULL, req);
+    session->register_req = req;
+
+    session->num_reqs_in_flight++;
+
+    rc = request_start_send_unsafe(session, req);
+
+    pdebug(debug,"Done.");
+
+    return rc;
+}
+
+
+
+/*
+ * session_setup_step_unsafe
+ *
+ * Move a session that is not ready yet along: wait for the TCP
+ * connection without blocking, then register the session.  Nothing
+ * here waits, so a gateway that does not answer only holds up the
+ * tags using it.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int session_setup_step_unsafe(ab_session_p session)
+{
+	int debug = session->debug;
+	int rc = PLCTAG_STATUS_OK;
+
+	if(session->state == AB_SESSION_CONNECTING) {
+		rc = socket_connect_tcp_check(session->sock);
+
+		if(rc == PLCTAG_STATUS_PENDING) {
+			rc = PLCTAG_STATUS_OK;
+		} else if(rc != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Unable to connect to gateway %s! rc=%d",session->host,rc);
+			return PLCTAG_ERR_BAD_GATEWAY;
+		} else {
+			pdebug(debug,"Connected to gateway %s.",session->host);
+
+			rc = poller_add_socket(session->worker->poller, session->sock);
+
+			if(rc != PLCTAG_STATUS_OK) {
+				pdebug(debug,"Unable to add session socket to IO poller!");
+				return rc;
+			}
+
+			/* everything is OK.  We have a TCP stream open to a gateway. */
+			session->is_connected = 1;
+			session->state = AB_SESSION_REGISTERING;
+
+			rc = ab_session_register_unsafe(session);
+
+			if(rc != PLCTAG_STATUS_OK) {
+				return rc;
+			}
+		}
+	}
+
+	if(session->state == AB_SESSION_REGISTERING && session->register_req && session->register_req->resp_received) {
+		ab_request_p req = session->register_req;
+		eip_encap_t *resp = (eip_encap_t *)(req->data);
+
+		/* the request list cleanup frees it. */
+		session->register_req = NULL;
+		req->abort_request = 1;
+
+		if(req->status != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Session registration failed! rc=%d",req->status);
+			return req->status;
+		}
+
+		pdebug(debug,"received response:");
+		pdebug_dump_bytes(debug, req->data, req->request_size);
+
+		/* check the response status */
+		if(le2h16(resp->encap_command) != AB_EIP_REGISTER_SESSION) {
+			pdebug(debug,"EIP unexpected response packet type: %d!",resp->encap_command);
+			return PLCTAG_ERR_BAD_DATA;
+		}
+
+		if(le2h32(resp->encap_status) != AB_EIP_OK) {
+			pdebug(debug,"EIP command failed, response code: %d",resp->encap_status);
+			return PLCTAG_ERR_REMOTE_ERR;
+		}
+
+		/* save the session handle, we will use it in future packets. */
+		session->session_handle = resp->encap_session_handle; /* opaque to us */
+		session->state = AB_SESSION_READY;
+		session->status = PLCTAG_STATUS_OK;
+
+		/* tags waiting on the session can go now. */
+		session->reqs_done = 1;
+
+		pdebug(debug,"Session with %s is ready.",session->host);
+	}
+
+	if(session->state != AB_SESSION_READY && time_ms() > session->setup_deadline) {
+		pdebug(debug,"Timed out setting up session with %s!",session->host);
+		return PLCTAG_ERR_TIMEOUT;
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * ab_session_status
+ *
+ * PLCTAG_STATUS_PENDING while the session is being set up, the error
+ * if it failed.
+ */
+int ab_session_status(ab_session_p session)
+{
+	int rc;
+
+	critical_block(session->mutex) {
+		rc = session->status;
+	}
+
+	return rc;
+}
+
+
+
+
+int ab_session_unregister(ab_tag_p tag, ab_session_p session)
+{
+    if(session->sock) {
+    	socket_close(session->sock);
+    	socket_destroy(&(session->sock));
+    	session->sock = NULL;
+    	session->is_connected = 0;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+
+
+
+/*
+ * io_worker_create
+ *
+ * Set up a new IO thread with its own poller.  The thread starts
+ * running immediately and waits for sessions to be added.
+ */
+int io_worker_create(ab_io_worker_p *worker, int dedicated)
+{
+	ab_io_worker_p w;
+	int rc;
+
+	w = (ab_io_worker_p)mem_alloc(sizeof(struct ab_io_worker_t));
+
+	if(!w) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	w->dedicated = dedicated;
+
+	rc = mutex_create(&(w->mutex));
+	if(rc != PLCTAG_STATUS_OK) {
+		mem_free(w);
+		return rc;
+	}
+
+	rc = poller_create(&(w->poller));
+	if(rc != PLCTAG_STATUS_OK) {
+		mutex_destroy(&(w->mutex));
+		mem_free(w);
+		return rc;
+	}
+
+	rc = thread_create(&(w->thread), request_handler_func, 32*1024, w);
+	if(rc != PLCTAG_STATUS_OK) {
+		poller_destroy(&(w->poller));
+		mutex_destroy(&(w->mutex));
+		mem_free(w);
+		return rc;
+	}
+
+	*worker = w;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * io_worker_destroy
+ *
+ * Stop the worker's thread and free it.  The worker must not have
+ * any sessions left.
+ */
+int io_worker_destroy(ab_io_worker_p *worker)
+{
+	ab_io_worker_p w;
+
+	if(!worker || !*worker) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	w = *worker;
+
+	w->terminate = 1;
+	poller_wake(w->poller);
+
+	thread_join(w->thread);
+	thread_destroy(&(w->thread));
+
+	poller_destroy(&(w->poller));
+	mutex_destroy(&(w->mutex));
+
+	if(w->callback_tags) {
+		mem_free(w->callback_tags);
+	}
+
+	if(w->due_tags) {
+		mem_free(w->due_tags);
+	}
+
+	mem_free(w);
+
+	*worker = NULL;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * io_worker_reap
+ *
+ * Join and free the dedicated IO threads that lost their last
+ * session.  Call this after io_thread_mutex is released.
+ */
+int io_worker_reap(void)
+{
+	ab_io_worker_p workers = NULL;
+
+	critical_block(io_thread_mutex) {
+		workers = stopped_workers;
+		stopped_workers = NULL;
+	}
+
+	while(workers) {
+		ab_io_worker_p w = workers;
+
+		workers = w->stopped_next;
+
+		io_worker_destroy(&w);
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * io_worker_insert_scan_unsafe
+ *
+ * Put the tag in the wheel slot for its due time.  Times in ticks the
+ * wheel has already passed would wait a whole turn, so they are moved
+ * up.
+ *
+ * You must hold the worker mutex.
+ */
+static void io_worker_insert_scan_unsafe(ab_io_worker_p worker, ab_tag_p tag)
+{
+	int slot;
+
+	if(tag->scan_due < worker->scan_time) {
+		tag->scan_due = worker->scan_time;
+	}
+
+	slot = (int)((tag->scan_due / AUTO_SYNC_TICK_MS) % AUTO_SYNC_WHEEL_SLOTS);
+
+	tag->scan_next = worker->scan_wheel[slot];
+	worker->scan_wheel[slot] = tag;
+}
+
+
+
+/*
+ * scan_spread_offset
+ *
+ * Scans of tags with the same period are spread over the period.  The
+ * n'th tag starts at the bit-reversed fraction of n, so the offsets go
+ * 0, 1/2, 1/4, 3/4, 1/8... and stay even however many tags there are.
+ */
+static int scan_spread_offset(unsigned int n, int period)
+{
+	uint32_t rev = 0;
+	int i;
+
+	for(i = 0; i < 16; i++) {
+		rev = (rev << 1) | (n & 1);
+		n >>= 1;
+	}
+
+	return (int)(((int64_t)rev * period) >> 16);
+}
+
+
+
+/*
+ * io_worker_add_scan
+ *
+ * Start scanning an auto sync tag.  The tag is read or written from
+ * the worker's thread from now on.
+ */
+int io_worker_add_scan(ab_io_worker_p worker, ab_tag_p tag)
+{
+	int64_t now = time_ms();
+	int period;
+
+	if(tag->auto_sync_read_ms > 0 && tag->auto_sync_write_ms > 0) {
+		period = (tag->auto_sync_read_ms < tag->auto_sync_write_ms ? tag->auto_sync_read_ms : tag->auto_sync_write_ms);
+	} else {
+		period = (tag->auto_sync_read_ms > 0 ? tag->auto_sync_read_ms : tag->auto_sync_write_ms);
+	}
+
+	if(period <= 0) {
+		return PLCTAG_ERR_BAD_PARAM;
+	}
+
+	critical_block(worker->mutex) {
+		if(!worker->num_scan_tags) {
+			worker->scan_time = now - (now % AUTO_SYNC_TICK_MS);
+		}
+
+		tag->scan_ms = period;
+		tag->scan_due = now + scan_spread_offset(worker->scan_seq++, period);
+		tag->next_read_time = 0;
+
+		io_worker_insert_scan_unsafe(worker, tag);
+
+		worker->num_scan_tags++;
+	}
+
+	/* make the worker start using the shorter wait. */
+	poller_wake(worker->poller);
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * io_worker_remove_scan
+ *
+ * Stop scanning a tag.  If the worker has the tag off the wheel to
+ * start a scan, it will not put it back.  The tag's worker_refs show
+ * when it is done with it.
+ */
+int io_worker_remove_scan(ab_io_worker_p worker, ab_tag_p tag)
+{
+	critical_block(worker->mutex) {
+		ab_tag_p *pp;
+
+		if(tag->scan_ms <= 0) {
+			break;
+		}
+
+		tag->scan_ms = 0;
+		worker->num_scan_tags--;
+
+		pp = &(worker->scan_wheel[(tag->scan_due / AUTO_SYNC_TICK_MS) % AUTO_SYNC_WHEEL_SLOTS]);
+
+		while(*pp && *pp != tag) {
+			pp = &((*pp)->scan_next);
+		}
+
+		if(*pp) {
+			*pp = tag->scan_next;
+			tag->scan_next = NULL;
+		}
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * io_worker_add_session_unsafe
+ *
+ * Hand a connected session to an IO thread.  Either create a thread
+ * just for this session or pick the least loaded of the first
+ * io_threads shared workers, starting them as needed.
+ *
+ * You must hold io_thread_mutex before calling this!
+ */
+int io_worker_add_session_unsafe(ab_tag_p tag, ab_session_p session, int io_threads, int dedicated)
+{
+	ab_io_worker_p worker = AB_IO_WORKER_NULL;
+	int debug = tag->debug;
+	int rc = PLCTAG_STATUS_OK;
+	int i;
+
+	if(session->pool_head && session->pool_head->worker) {
+		/* the pool's callbacks are all run from the first session, keep them together. */
+		worker = session->pool_head->worker;
+	} else if(dedicated) {
+		rc = io_worker_create(&worker, 1);
+
+		if(rc != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Unable to create dedicated IO thread!");
+			return rc;
+		}
+	} else {
+		if(io_threads < 1) {
+			io_threads = 1;
+		}
+
+		if(io_threads > MAX_IO_THREADS) {
+			io_threads = MAX_IO_THREADS;
+		}
+
+		for(i = 0; i < io_threads; i++) {
+			if(!io_workers[i]) {
+				rc = io_worker_create(&(io_workers[i]), 0);
+
+				if(rc != PLCTAG_STATUS_OK) {
+					pdebug(debug,"Unable to create IO thread %d!",i);
+					return rc;
+				}
+			}
+
+			if(!worker || io_workers[i]->num_sessions < worker->num_sessions) {
+				worker = io_workers[i];
+			}
+		}
+	}
+
+	/* the socket goes into the poller once it is connected. */
+	critical_block(worker->mutex) {
+		session->worker = worker;
+		session->worker_next = worker->sessions;
+		worker->sessions = session;
+		worker->num_sessions++;
+	}
+
+	/* get the connection going. */
+	poller_wake(worker->poller);
+
+	return rc;
+}
+
+
+
+/*
+ * io_worker_remove_session_unsafe
+ *
+ * Take the session away from its IO thread.  Once this returns, the
+ * thread is not using the session.  Dedicated threads are told to
+ * stop and must be joined with io_worker_reap().
+ *
+ * You must hold io_thread_mutex before calling this!
+ */
+int io_worker_remove_session_unsafe(ab_tag_p tag, ab_session_p session)
+{
+	ab_io_worker_p worker = session->worker;
+
+	if(!worker) {
+		return PLCTAG_STATUS_OK;
+	}
+
+	critical_block(worker->mutex) {
+		ab_session_p *walker = &(worker->sessions);
+
+		while(*walker && *walker != session) {
+			walker = &((*walker)->worker_next);
+		}
+
+		if(*walker) {
+			*walker = session->worker_next;
+			worker->num_sessions--;
+		}
+
+		if(session->is_connected) {
+			poller_remove_socket(worker->poller, session->sock);
+		}
+	}
+
+	session->worker = AB_IO_WORKER_NULL;
+	session->worker_next = NULL;
+
+	/* the thread is joined later, it may be waiting for io_thread_mutex. */
+	if(worker->dedicated && !worker->num_sessions) {
+		pdebug(tag->debug,"Stopping dedicated IO thread.");
+
+		worker->terminate = 1;
+		poller_wake(worker->poller);
+
+		worker->stopped_next = stopped_workers;
+		stopped_workers = worker;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+int session_check_incoming_data(ab_session_p session)
+{
+	int rc = PLCTAG_STATUS_OK;
+
+	/*
+	 * We get woken up once per batch of socket activity, so
+	 * process every complete packet that we can read now.
+	 */
+	while(1) {
+		/*
+		 * if there is no current received sequence ID, then
+		 * see if we can get some data.
+		 */
+		if(!session->has_response) {
+			rc = recv_eip_response(session);
+
+			/* NO_DATA just means that there was nothing to read yet. */
+			if(rc == PLCTAG_ERR_NO_DATA || rc >= 0) {
+				rc = PLCTAG_STATUS_OK;
+			}
+
+			if(rc != PLCTAG_STATUS_OK) {
+				/* error! The caller will tear down the session. */
+				return rc;
+			}
+		}
+
+		/* wait for the rest of the packet. */
+		if(!session->has_response) {
+			break;
+		}
+
+		/* the packet is parsed where it sits in the receive buffer. */
+		uint8_t *frame = session->recv_data + session->recv_start;
+
+		/*
+		 * find the request for which there is a response pending.
+		 *
+		 * FIXME - it appears that PCCC/DH+ requests do not have the cpf_conn_seq_num
+		 * field.  Use the PCCC sequence in those cases??  How do we tell?
+		 */
+		ab_request_p tmp = NULL;
+		eip_encap_t *encap = (eip_encap_t *)frame;
+		uint64_t key;
+		int slot;
+
+		if(encap->encap_command == AB_EIP_CONNECTED_SEND) {
+			eip_cip_resp_old *resp = (eip_cip_resp_old *)frame;
+
+			key = DISPATCH_CONNECTED_KEY(resp->cpf_orig_conn_id, resp->cpf_conn_seq_num);
+		} else {
+			/* the only place we use this is during a Forward Open/Close. */
+			key = encap->encap_sender_context;
+		}
+
+		slot = session_dispatch_find_unsafe(session, key);
+
+		if(slot >= 0) {
+			tmp = session->dispatch[slot].req;
+			session_dispatch_remove_unsafe(session, tmp);
+			session_timer_remove_unsafe(session, tmp);
+		}
+
+		if(tmp) {
+			uint8_t *resp_data;
+			int resp_buf_size;
+
+			pdebug(tmp->debug,"got full packet of size %d",session->resp_size);
+			pdebug_dump_bytes(tmp->debug, frame, session->resp_size);
+
+			if(session->recv_start == 0 && session->recv_offset == session->resp_size
+			   && tmp->buf_size >= session->recv_buf_size) {
+				/*
+				 * the request was sent, so its buffer is free.  When the
+				 * packet is all that is in the receive buffer, trade buffers
+				 * rather than copying the packet.  Both are request buffers
+				 * so either can be grown or freed.  A smaller request
+				 * buffer is not taken, so a grown receive buffer stays
+				 * grown.
+				 */
+				resp_data = session->recv_data;
+				resp_buf_size = session->recv_buf_size;
+
+				session->recv_data = tmp->data;
+				session->recv_buf_size = tmp->buf_size;
+
+				tmp->data = resp_data;
+				tmp->buf_size = resp_buf_size;
+			} else {
+				/* more packets follow or the buffers differ, copy this one out. */
+				if(tmp->buf_size < session->resp_size) {
+					resp_buf_size = session->resp_size;
+					resp_data = request_buf_alloc(&resp_buf_size);
+
+					if(resp_data) {
+						request_buf_free(tmp->data, tmp->buf_size);
+						tmp->data = resp_data;
+						tmp->buf_size = resp_buf_size;
+					}
+				}
+
+				if(tmp->buf_size >= session->resp_size) {
+					mem_copy(tmp->data, frame, session->resp_size);
+				} else {
+					pdebug(tmp->debug,"Unable to grow request buffer!");
+					tmp->status = PLCTAG_ERR_NO_MEM;
+				}
+			}
+
+			tmp->resp_received = 1;
+			tmp->send_in_progress = 0;
+			tmp->send_request = 0;
+			tmp->request_size = session->resp_size;
+			session->reqs_done = 1;
+
+			/* make connected replies look like unconnected ones. */
+			if(((eip_encap_t *)(tmp->data))->encap_command == AB_EIP_CONNECTED_SEND) {
+				int conv_rc = cip_convert_from_connected(tmp);
+
+				if(conv_rc != PLCTAG_STATUS_OK) {
+					tmp->status = conv_rc;
+				}
+			}
+
+			/* we got a response, so decrement the number of messages in flight counter */
+			if(tmp->recv_in_progress) {
+				tmp->recv_in_progress = 0;
+				session->num_reqs_in_flight--;
+
+				/* see how the PLC is keeping up.  Setting up takes longer, so it does not count. */
+				if(!tmp->open_connection && !tmp->close_connection && tmp != session->register_req) {
+					session_window_update_unsafe(session, tmp);
+				}
+			}
+
+			/* a Forward Open opens its connection, nobody waits on it. */
+			if(tmp->open_connection) {
+				connection_handle_open_response_unsafe(tmp);
+				tmp->abort_request = 1;
+			}
+
+			/* nor on a symbol table browse. */
+			if(tmp->browse_connection) {
+				connection_handle_browse_response_unsafe(tmp);
+				tmp->abort_request = 1;
+			}
+
+			/* nor on a Forward Close. */
+			if(tmp->close_connection) {
+				cip_check_forward_close_response(tmp);
+				tmp->abort_request = 1;
+			}
+
+			/* hand out the replies to packed requests, we are done with the packet. */
+			if(tmp->packed_reqs) {
+				int i;
+
+				for(i = 0; i < tmp->num_packed_reqs; i++) {
+					if(tmp->packed_reqs[i]) {
+						session_timer_remove_unsafe(session, tmp->packed_reqs[i]);
+					}
+				}
+
+				cip_unpack_response(tmp);
+				tmp->abort_request = 1;
+			}
+		} /*else {
+			pdebug(debug,"Response for unknown request.");
+		}*/
+
+		/*
+		 * if we did not find a request, it may have already been aborted, so
+		 * just clean up.
+		 */
+
+		/* take the packet off the buffer, nothing depends on it being zeroed. */
+		session->recv_start += session->resp_size;
+
+		if(session->recv_start >= session->recv_offset) {
+			session->recv_start = 0;
+			session->recv_offset = 0;
+		}
+
+		session->resp_seq_id = 0;
+		session->resp_size = 0;
+		session->has_response = 0;
+
+		/* there may be another whole packet already read. */
+		rc = session_check_frame(session);
+
+		if(rc != PLCTAG_STATUS_OK) {
+			return rc;
+		}
+	}
+
+	return rc;
+}
+
+
+
+int request_check_outgoing_data(ab_session_p session, ab_request_p req)
+{
+	int rc = PLCTAG_STATUS_OK;
+	int max_in_flight;
+
+	/*
+	 * Check to see if we can send something.
+	 */
+
+	max_in_flight = session->window;
+
+	/* keep a slot free for the other priorities. */
+	if(req->priority == AB_PRIORITY_BULK && max_in_flight > 1) {
+		max_in_flight--;
+	}
+
+	/* the window only grows if it is what is holding requests back. */
+	if(req->send_request && !req->send_in_progress && session->num_reqs_in_flight >= max_in_flight) {
+		session->window_limited = 1;
+	}
+
+	if(req->send_request && !req->send_in_progress && session->num_reqs_in_flight < max_in_flight) {
+		/* requests that use a connection have to wait until it is open. */
+		if(req->connection) {
+			ab_request_p fo = NULL;
 
-    pdebug(debug,"Done.");
+			rc = connection_check_unsafe(session, req, &fo);
 
-    return 1;
-}
+			if(rc == PLCTAG_STATUS_PENDING) {
+				if(!fo) {
+					return PLCTAG_STATUS_OK;
+				}
 
+				/* send the Forward Open ahead of the request, it has the same deadline. */
+				fo->priority = req->priority;
+				session_link_request_unsafe(session, req, fo);
 
+				fo->deadline = req->deadline;
+				session_timer_add_unsafe(session, fo);
 
-int ab_session_destroy_unsafe(ab_tag_p tag, ab_session_p session)
-{
-	int debug = tag->debug;
+				req = fo;
+			} else if(rc != PLCTAG_STATUS_OK) {
+				pdebug(req->debug,"Unable to use connection, sending unconnected. rc=%d",rc);
+				req->connection = NULL;
+			}
 
-    pdebug(debug,"Starting.");
+			rc = PLCTAG_STATUS_OK;
+		}
 
-    if(!session)
-        return 1;
+		/*
+		 * this request is outstanding and not queued yet.  See if it
+		 * can be combined with others going to the same place.
+		 */
+		if(req->allow_packing) {
+			ab_request_p pkt = NULL;
+
+			rc = cip_pack_requests(session, req, &pkt);
+
+			if(rc != PLCTAG_STATUS_OK) {
+				pdebug(req->debug,"Unable to pack requests! rc=%d",rc);
+				rc = PLCTAG_STATUS_OK;
+			} else if(pkt) {
+				int i;
+
+				/* send the packet in the request's place in the list. */
+				pkt->priority = req->priority;
+				session_link_request_unsafe(session, req, pkt);
+
+				/* it is given up on when all the requests in it have been. */
+				for(i = 0; i < pkt->num_packed_reqs; i++) {
+					if(!pkt->packed_reqs[i]->deadline) {
+						pkt->deadline = 0;
+						break;
+					}
 
-    /* do not destroy the session if there are
-     * connections still */
-    if(session->tags) {
-        pdebug(debug,"Attempt to destroy session while open tags exist!");
-        return 0;
-    }
+					if(pkt->packed_reqs[i]->deadline > pkt->deadline) {
+						pkt->deadline = pkt->packed_reqs[i]->deadline;
+					}
+				}
 
-    if(ab_session_unregister(tag, session))
-        return 0;
+				session_timer_add_unsafe(session, pkt);
 
-    /* close the socket. */
-    if(session->is_connected) {
-		socket_close(session->sock);
-		socket_destroy(&(session->sock));
-        session->is_connected = 0;
-    }
+				req = pkt;
+			}
+		}
 
-    remove_session_unsafe(tag, session);
+		/* send it on the connection if it has one. */
+		if(req->connection) {
+			cip_convert_to_connected(req->connection, req);
+		}
 
-    mem_free(session);
+		/* it counts against the in flight limit until its response comes back. */
+		session->num_reqs_in_flight++;
 
-    pdebug(debug,"Done.");
+		rc = request_start_send_unsafe(session, req);
+	}
 
-    return 1;
+	return rc;
 }
 
 
 
-int ab_session_destroy(ab_tag_p tag, ab_session_p session)
+/*
+ * ab_session_fail_unsafe
+ *
+ * The session's socket had an error or was closed by the other end.
+ * Stop listening to it and fail all the requests queued on it so that
+ * the tags see the error.  The session itself is cleaned up when the
+ * last tag using it is destroyed.
+ *
+ * You must hold the mutex before calling this!
+ */
+int ab_session_fail_unsafe(ab_session_p session, int status)
 {
-	int rc;
+	ab_request_p req;
+	ab_connection_p conn;
 
-	critical_block(io_thread_mutex) {
-		rc = ab_session_destroy_unsafe(tag, session);
+	if(session->is_connected) {
+		poller_remove_socket(session->worker->poller, session->sock);
+		session->is_connected = 0;
 	}
 
-	return rc;
-}
-
+	session->state = AB_SESSION_FAILED;
+	session->status = status;
+	session->send_queue = NULL;
+	session->send_queue_tail = NULL;
+	session->num_reqs_in_flight = 0;
+	session->recv_start = 0;
+	session->recv_offset = 0;
+	session->resp_size = 0;
+	session->has_response = 0;
+	session->watching_write = 0;
+
+	for(req = session->requests; req; req = req->next) {
+		if(!req->resp_received) {
+			req->status = status;
+			req->send_request = 0;
+			req->send_in_progress = 0;
+			req->recv_in_progress = 0;
+			req->resp_received = 1;
+			session->reqs_done = 1;
+		}
 
+		req->send_next = NULL;
 
-int ab_session_empty(ab_session_p session)
-{
-    return (session->tags == NULL);
-}
+		session_timer_remove_unsafe(session, req);
 
+		/*
+		 * nobody is waiting on a packet, Forward Open or Forward Close
+		 * request, the requests waiting on them have failed above.
+		 */
+		if(req->packed_reqs || req->open_connection || req->close_connection || req == session->register_req) {
+			req->abort_request = 1;
+		}
 
+		/* a browse cut short starts over on the next connection. */
+		if(req->browse_connection) {
+			if(req->browse_connection->symbol_state == AB_SYMBOLS_LOADING) {
+				req->browse_connection->symbol_state = AB_SYMBOLS_NOT_LOADED;
+			}
 
+			req->abort_request = 1;
+		}
+	}
 
+	session->register_req = NULL;
 
-int ab_session_register(ab_tag_p tag, ab_session_p session)
-{
-	int debug = tag->debug;
-    eip_session_reg_req *req;
-    eip_encap_t *resp;
-    int rc;
-    int data_size = 0;
-    uint64_t timeout_time;
+	/* no responses are coming now. */
+	for(req = session->requests; req; req = req->next) {
+		req->in_dispatch = 0;
+	}
 
-    pdebug(debug,"Starting.");
+	if(session->dispatch) {
+		mem_set(session->dispatch, 0, session->dispatch_size * (int)sizeof(struct ab_dispatch_entry_t));
+	}
 
-    /*
-     * clear the session data.
-     *
-     * We use the receiving buffer because we do not have a request and nothing can
-     * be coming in (we hope) on the socket yet.
-     */
-    mem_set(session->recv_data, 0, sizeof(eip_session_reg_req));
+	session->dispatch_count = 0;
 
-    req = (eip_session_reg_req *)(session->recv_data);
+	/* the connections went away with the socket. */
+	for(conn = session->connections; conn; conn = conn->next) {
+		conn->state = AB_CONNECTION_NOT_OPEN;
+	}
 
-    /* fill in the fields of the request */
-    req->encap_command 			= h2le16(AB_EIP_REGISTER_SESSION);
-    req->encap_length           = h2le16(sizeof(eip_session_reg_req) - sizeof(eip_encap_t));
-	req->encap_session_handle   = session->session_handle;
-	req->encap_status           = h2le32(0);
-	req->encap_sender_context   = (uint64_t)0;
-	req->encap_options          = h2le32(0);
+	return PLCTAG_STATUS_OK;
+}
 
-    req->eip_version   			= h2le16(AB_EIP_VERSION);
-    req->option_flags  			= 0;
 
-    /*
-     * socket ops here are _ASYNCHRONOUS_!
-     *
-     * This is done this way because we do not have everything
-     * set up for a request to be handled by the thread.  I think.
-     */
 
-    /* send registration to the gateway */
-    data_size = sizeof(eip_session_reg_req);
-    session->recv_offset = 0;
-    timeout_time = time_ms() + 5000; /* MAGIC */
+/*
+ * session_process_io_unsafe
+ *
+ * Read any responses that have come in, clean up aborted requests
+ * and send whatever we can.
+ *
+ * You must hold the session's mutex before calling this!
+ */
+int session_process_io_unsafe(ab_session_p session)
+{
+	ab_request_p cur_req;
+	int rc = PLCTAG_STATUS_OK;
+	int debug = 1;
 
-    pdebug(debug,"sending data:");
-    pdebug_dump_bytes(debug,session->recv_data, data_size);
+	/* pick up requests queued since the last pass. */
+	session_take_submitted_unsafe(session);
 
-    while(timeout_time > time_ms() && session->recv_offset < data_size) {
-    	rc = socket_write(session->sock, session->recv_data + session->recv_offset, data_size - session->recv_offset);
+	/* check for incoming data. */
+	if(session->is_connected) {
+		rc = session_check_incoming_data(session);
 
-    	if(rc < 0) {
-			pdebug(debug,"Unable to send session registration packet! rc=%d",rc);
-		    session->recv_offset = 0;
-			return rc;
+		if(rc != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Error when checking for incoming session data! %d",rc);
+			ab_session_fail_unsafe(session, rc);
 		}
+	}
 
-    	session->recv_offset += rc;
+	/* connect and register new sessions. */
+	if(session->state == AB_SESSION_CONNECTING || session->state == AB_SESSION_REGISTERING) {
+		rc = session_setup_step_unsafe(session);
 
-    	/* don't hog the CPU */
-    	if(session->recv_offset < data_size) {
-    		sleep_ms(1);
-    	}
-    }
+		if(rc != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Error setting up session! %d",rc);
+			ab_session_fail_unsafe(session, rc);
+		}
+	}
 
-    if(session->recv_offset != data_size) {
-        session->recv_offset = 0;;
-    	return PLCTAG_ERR_TIMEOUT;
-    }
+	/* fail the requests that have run out of time. */
+	session_timer_run_unsafe(session);
 
-    /* get the response from the gateway */
+	/* loop over the requests in the session */
+	cur_req = session->requests;
 
-    /* ready the input buffer */
-    session->recv_offset = 0;
-    mem_set(session->recv_data, 0, MAX_REQ_RESP_SIZE);
+	while(cur_req) {
+		/* check for abort before anything else. */
+		if(cur_req->abort_request) {
+			ab_request_p tmp;
 
-    timeout_time = time_ms() + 5000; /* MAGIC */
-    while(timeout_time > time_ms()) {
-    	if(session->recv_offset < sizeof(eip_encap_t)) {
-    		data_size = sizeof(eip_encap_t);
-    	} else {
-    		data_size = sizeof(eip_encap_t) + ((eip_encap_t*)(session->recv_data))->encap_length;
-    	}
+			/*
+			 * is this in the process of being sent?
+			 * if so, abort the abort because otherwise we would send
+			 * a partial packet and cause all kinds of problems.
+			 * FIXME
+			 */
+			if(!cur_req->send_in_progress) {
+				/* the response will be thrown away when it comes. */
+				if(cur_req->recv_in_progress) {
+					session->num_reqs_in_flight--;
+				}
 
-    	if(session->recv_offset < data_size) {
-    		rc = socket_read(session->sock, session->recv_data + session->recv_offset, data_size - session->recv_offset);
+				/* take it out of the packet it was sent in. */
+				if(cur_req->packed_in) {
+					int i;
 
-    		if(rc < 0) {
-    			if(rc != PLCTAG_ERR_NO_DATA) {
-					/* error! */
-					pdebug(debug,"Error reading socket! rc=%d",rc);
-					return rc;
-    			}
-    		} else {
-    			session->recv_offset += rc;
-
-    			/* recalculate the amount of data needed if we have just completed the read of an encap header */
-    			if(session->recv_offset >= sizeof(eip_encap_t)) {
-    				data_size = sizeof(eip_encap_t) + ((eip_encap_t*)(session->recv_data))->encap_length;
-    			}
-    		}
-    	}
+					for(i = 0; i < cur_req->packed_in->num_packed_reqs; i++) {
+						if(cur_req->packed_in->packed_reqs[i] == cur_req) {
+							cur_req->packed_in->packed_reqs[i] = NULL;
+						}
+					}
+				}
 
-    	/* did we get all the data? */
-    	if(session->recv_offset == data_size) {
-    		break;
-    	} else {
-    		/* do not hog the CPU */
-    		sleep_ms(1);
-    	}
-    }
+				tmp = cur_req;
+				cur_req = cur_req->next;
 
+				session_unlink_request_unsafe(session, tmp);
 
-    if(session->recv_offset != data_size) {
-        session->recv_offset = 0;
-    	return PLCTAG_ERR_TIMEOUT;
-    }
+				/* free the the request */
+				request_destroy(&tmp);
+
+				continue;
+			}
+		}
 
-    /* set the offset back to zero for the next packet */
-    session->recv_offset = 0;
+		if(session->state == AB_SESSION_READY) {
+			rc = request_check_outgoing_data(session, cur_req);
 
+			if(rc != PLCTAG_STATUS_OK) {
+				pdebug(debug,"Error when sending session data! %d",rc);
+				ab_session_fail_unsafe(session, rc);
+			}
+		} else if(session->state == AB_SESSION_FAILED && !cur_req->resp_received) {
+			/* nowhere to send this. */
+			cur_req->status = PLCTAG_ERR_BAD_GATEWAY;
+			cur_req->send_request = 0;
+			cur_req->resp_received = 1;
+			session->reqs_done = 1;
+		}
 
-    pdebug(debug,"received response:");
-    pdebug_dump_bytes(debug,session->recv_data, data_size);
+		/* move to the next request */
+		cur_req = cur_req->next;
+	}
 
+	/* write out everything queued above in as few calls as possible. */
+	if(session->is_connected && session->send_queue) {
+		rc = session_send_requests_unsafe(session);
 
-    /* encap header is at the start of the buffer */
-    resp = (eip_encap_t *)(session->recv_data);
+		if(rc != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Error when sending session data! %d",rc);
+			ab_session_fail_unsafe(session, rc);
+		}
+	}
 
-    /* check the response status */
-    if(le2h16(resp->encap_command) != AB_EIP_REGISTER_SESSION) {
-        pdebug(debug,"EIP unexpected response packet type: %d!",resp->encap_command);
-        return PLCTAG_ERR_BAD_DATA;
-    }
+	/* only wait for the socket to drain if we have data left to send. */
+	if(session->is_connected && session->watching_write != (session->send_queue != NULL)) {
+		session->watching_write = (session->send_queue != NULL);
+		poller_watch_write(session->worker->poller, session->sock, session->watching_write);
+	}
 
-    if(le2h16(resp->encap_status) != AB_EIP_OK) {
-        pdebug(debug,"EIP command failed, response code: %d",resp->encap_status);
-        return PLCTAG_ERR_REMOTE_ERR;
-    }
+	return rc;
+}
 
-    /* after all that, save the session handle, we will
-     * use it in future packets.
-     */
-    session->session_handle = resp->encap_session_handle; /* opaque to us */
 
-    pdebug(debug,"Done.");
 
-    return 1;
-}
+/*
+ * tag_list_append
+ *
+ * Add a tag to one of the worker's growable tag lists.
+ */
+static int tag_list_append(ab_tag_p **list, int *num, int *max, ab_tag_p tag)
+{
+	if(*num >= *max) {
+		int new_max = (*max ? *max * 2 : 16);
+		ab_tag_p *new_list = (ab_tag_p *)mem_alloc(new_max * sizeof(ab_tag_p));
 
+		if(!new_list) {
+			return PLCTAG_ERR_NO_MEM;
+		}
 
+		if(*list) {
+			mem_copy(new_list, *list, *num * sizeof(ab_tag_p));
+			mem_free(*list);
+		}
 
+		*list = new_list;
+		*max = new_max;
+	}
 
-int ab_session_unregister(ab_tag_p tag, ab_session_p session)
-{
-    if(session->sock) {
-    	socket_close(session->sock);
-    	socket_destroy(&(session->sock));
-    	session->sock = NULL;
-    	session->is_connected = 0;
-    }
+	(*list)[(*num)++] = tag;
 
-    return PLCTAG_STATUS_OK;
+	return PLCTAG_STATUS_OK;
 }
 
 
 
+/*
+ * worker_collect_callbacks_unsafe
+ *
+ * Find the tags on the session that have a callback or a scan and an
+ * operation outstanding.  Each one gets a reference so that it is not destroyed
+ * before the worker runs the callback.
+ *
+ * You must hold the session mutex.
+ */
+static void worker_collect_callbacks_unsafe(ab_io_worker_p worker, ab_session_p session)
+{
+	ab_tag_p tag;
+	int debug = 1;
 
+	for(tag = session->tags; tag; tag = tag->next) {
+		/* scans are finished here too, nobody else is waiting on them. */
+		if(!(tag->notify || tag->auto_op) || !tag->pending_event) {
+			continue;
+		}
 
+		if(tag_list_append(&worker->callback_tags, &worker->num_callback_tags, &worker->max_callback_tags, tag) != PLCTAG_STATUS_OK) {
+			/* the application will still see the result when it checks the tag. */
+			pdebug(debug,"Unable to allocate callback list!");
+			return;
+		}
 
+		tag->worker_refs++;
+	}
+}
 
 
 
-int session_check_incoming_data(ab_session_p session)
+/*
+ * worker_run_callbacks
+ *
+ * Check the status of the collected tags.  The generic tag code calls
+ * the callback when it sees that the operation finished.  Nothing may
+ * be locked here.
+ */
+static void worker_run_callbacks(ab_io_worker_p worker)
 {
-	int rc = PLCTAG_STATUS_OK;
+	int i;
 
-	/*
-	 * if there is no current received sequence ID, then
-	 * see if we can get some data.
-	 */
-	if(!session->has_response) {
-		rc = recv_eip_response(session);
+	for(i = 0; i < worker->num_callback_tags; i++) {
+		ab_tag_p tag = worker->callback_tags[i];
 
-		/* NO_DATA just means that there was nothing to read yet. */
-		if(rc == PLCTAG_ERR_NO_DATA || rc >= 0) {
-			rc = PLCTAG_STATUS_OK;
-		}
+		plc_tag_status((plc_tag)tag);
 
-		if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
-			/* error! */
-			/* FIXME */
+		critical_block(tag->session->mutex) {
+			tag->worker_refs--;
 		}
 	}
 
-	/*
-	 * we may have read in enough data above to finish off a
-	 * response packet. If so, process it.
-	 */
-	if(session->has_response){
-		/* we got a response, so decrement the number of messages in flight counter */
-		/*session->num_reqs_in_flight--;
-		pdebug(debug,"num_reqs_in_flight=%d",session->num_reqs_in_flight);*/
+	worker->num_callback_tags = 0;
+}
 
-		/* find the request for which there is a response pending. */
-		ab_request_p tmp = session->requests;
 
-		while(tmp) {
-			eip_encap_t *encap = (eip_encap_t *)(session->recv_data);
 
-			/*
-			 * if this is a connected send response, we can look at the
-			 * connection sequence ID and connection ID to see if this
-			 * response is for the request.
-			 *
-			 * FIXME - it appears that PCCC/DH+ requests do not have the cpf_conn_seq_num
-			 * field.  Use the PCCC sequence in those cases??  How do we tell?
-			 */
-			if(encap->encap_command == AB_EIP_CONNECTED_SEND) {
-				eip_cip_resp_old *resp = (eip_cip_resp_old *)(session->recv_data);
+/*
+ * worker_collect_scans_unsafe
+ *
+ * Turn the scan wheel up to the current time and take off the tags
+ * that are due.  A tick is only handled once all of it has passed so
+ * that every tag in its slot that is due this turn is found.
+ *
+ * You must hold the worker mutex.
+ */
+static void worker_collect_scans_unsafe(ab_io_worker_p worker)
+{
+	int64_t now = time_ms();
+	int ticks = 0;
+	int debug = 1;
 
-				if(resp->cpf_orig_conn_id == tmp->conn_id && resp->cpf_conn_seq_num == tmp->conn_seq) {
-					break;
-				}
-			} else {
-				/*
-				 * the only place we use this is during a Forward Open/Close.
-				 * Check the status on it too.
-				 */
-				if(encap->encap_sender_context != 0 && encap->encap_sender_context == tmp->session_seq_id) {
-					break;
-				}
+	if(!worker->num_scan_tags) {
+		return;
+	}
+
+	while(worker->scan_time + AUTO_SYNC_TICK_MS <= now) {
+		ab_tag_p *pp = &(worker->scan_wheel[(worker->scan_time / AUTO_SYNC_TICK_MS) % AUTO_SYNC_WHEEL_SLOTS]);
+
+		while(*pp) {
+			ab_tag_p tag = *pp;
+
+			if(tag->scan_due > now) {
+				pp = &(tag->scan_next);
+				continue;
 			}
-			tmp = tmp->next;
-		}
 
-		if(tmp) {
-			pdebug(tmp->debug,"got full packet of size %d",session->recv_offset);
-			pdebug_dump_bytes(tmp->debug, session->recv_data,session->recv_offset);
+			if(tag_list_append(&worker->due_tags, &worker->num_due_tags, &worker->max_due_tags, tag) != PLCTAG_STATUS_OK) {
+				pdebug(debug,"Unable to allocate scan list!");
+				pp = &(tag->scan_next);
+				continue;
+			}
 
-			/* copy the data from the session's buffer */
-			mem_copy(tmp->data, session->recv_data, session->recv_offset);
+			/* off the wheel until the scan is started. */
+			*pp = tag->scan_next;
+			tag->scan_next = NULL;
 
-			tmp->resp_received = 1;
-			tmp->send_in_progress = 0;
-			tmp->send_request = 0;
-			tmp->request_size = session->recv_offset;
-		} /*else {
-			pdebug(debug,"Response for unknown request.");
-		}*/
+			critical_block(tag->session->mutex) {
+				tag->worker_refs++;
+			}
+		}
 
-		/*
-		 * if we did not find a request, it may have already been aborted, so
-		 * just clean up.
-		 */
+		worker->scan_time += AUTO_SYNC_TICK_MS;
 
-		/* reset the session's buffer */
-		mem_set(session->recv_data, 0, MAX_REQ_RESP_SIZE);
-		session->recv_offset = 0;
-		session->resp_seq_id = 0;
-		session->has_response = 0;
+		/* after a long stall, every slot has been looked at once. */
+		if(++ticks >= AUTO_SYNC_WHEEL_SLOTS) {
+			worker->scan_time = now - (now % AUTO_SYNC_TICK_MS);
+			break;
+		}
 	}
-
-	return rc;
 }
 
 
 
-int request_check_outgoing_data(ab_session_p session, ab_request_p req)
+/*
+ * worker_run_scans
+ *
+ * Start the scans taken off the wheel and put the tags back on for
+ * their next one.  A scan that is late does not cause a burst to catch
+ * up, the tag just goes on from now.
+ */
+static void worker_run_scans(ab_io_worker_p worker)
 {
-	int rc = PLCTAG_STATUS_OK;
+	int64_t now = time_ms();
+	int i;
 
-	/*
-	 * Check to see if we can send something.
-	 */
+	for(i = 0; i < worker->num_due_tags; i++) {
+		ab_tag_p tag = worker->due_tags[i];
+		int do_read = (tag->auto_sync_read_ms > 0 && tag->next_read_time <= now);
 
-	if(!session->current_request && req->send_request /*&& session->num_reqs_in_flight < MAX_REQS_IN_FLIGHT*/) {
-		/* nothing being sent and this request is outstanding */
-		session->current_request = req;
+		tag_auto_sync((plc_tag)tag, do_read);
 
-		/*session->num_reqs_in_flight++;
-		pdebug(debug,"num_reqs_in_flight=%d",session->num_reqs_in_flight);*/
-	}
+		critical_block(worker->mutex) {
+			/* stay on the tag's schedule even when the worker is a bit late. */
+			if(do_read) {
+				tag->next_read_time = tag->scan_due + tag->auto_sync_read_ms;
+			}
 
-	/* if we are already sending this request, check its status */
-	if(session->current_request == req) {
-		/* is the request done? */
-		if(req->send_request) {
-			/* not done, try sending more */
-			send_eip_request(req);
-			/* FIXME - handle return code! */
-		} else {
-			/*
-			 * done in some manner, remove it from the session to let
-			 * another request get sent.
-			 */
-			session->current_request = NULL;
+			/* the tag may be going away. */
+			if(tag->scan_ms > 0) {
+				tag->scan_due += tag->scan_ms;
+
+				if(tag->scan_due <= now) {
+					tag->scan_due = now + tag->scan_ms;
+				}
+
+				io_worker_insert_scan_unsafe(worker, tag);
+			}
+		}
+
+		critical_block(tag->session->mutex) {
+			tag->worker_refs--;
 		}
 	}
 
-	return rc;
+	worker->num_due_tags = 0;
 }
 
 
+
 #ifdef WIN32
-DWORD __stdcall request_handler_func(LPVOID not_used)
+DWORD __stdcall request_handler_func(LPVOID arg)
 #else
-void *request_handler_func(void *not_used)
+void *request_handler_func(void *arg)
 #endif
 {
-	int rc;
+	ab_io_worker_p worker = (ab_io_worker_p)arg;
 	ab_session_p cur_sess;
+	int sess_done;
+	int rc;
 	int debug = 1;
 
-	while(1) {
-		/* we need the mutex */
-		if(io_thread_mutex == NULL) {
-			pdebug(debug,"tag_mutex is NULL!");
-			break;
+	while(!worker->terminate) {
+		/*
+		 * sleep until a socket is ready, a new request is queued or
+		 * a tag is aborted.  The timeout is just a safety net.
+		 */
+		rc = poller_wait(worker->poller, ((worker->num_scan_tags || worker->num_connecting || worker->num_timed) ? AUTO_SYNC_TICK_MS : IO_THREAD_IDLE_WAIT_MS));
+
+		if(rc < 0) {
+			pdebug(debug,"Error waiting for IO events! rc=%d",rc);
+			sleep_ms(1);
 		}
 
-		//pdebug(debug,"Locking mutex");
+		/*
+		 * loop over this thread's sessions.  Each session has its own
+		 * lock so that tags on other sessions are not held up.
+		 */
+		critical_block(worker->mutex) {
+			worker->num_connecting = 0;
+			worker->num_timed = 0;
 
-		critical_block(io_thread_mutex) {
-			/*
-			 * loop over the sessions.  For each session, see if we can read some
-			 * data.  If we can, read it in and try to update a request.  If the
-			 * session has outstanding requests that need to be sent, try to send
-			 * them.
-			 */
+			for(cur_sess = worker->sessions; cur_sess; cur_sess = cur_sess->worker_next) {
+				mutex_lock(cur_sess->mutex);
+				session_process_io_unsafe(cur_sess);
 
-			cur_sess = sessions;
+				/* TCP connects in progress are not in the poller, so check them each tick. */
+				if(cur_sess->state == AB_SESSION_CONNECTING) {
+					worker->num_connecting++;
+				}
 
-			while(cur_sess) {
-				ab_request_p cur_req;
-				ab_request_p prev_req;
+				/* the same for request deadlines. */
+				if(cur_sess->num_timers) {
+					worker->num_timed++;
+				}
 
-				/* check for incoming data. */
-				rc = session_check_incoming_data(cur_sess);
+				sess_done = cur_sess->reqs_done;
+				cur_sess->reqs_done = 0;
 
-				if(rc != PLCTAG_STATUS_OK) {
-					pdebug(debug,"Error when checking for incoming session data! %d",rc);
-					/* FIXME - do something useful with this error */
-				}
+				mutex_unlock(cur_sess->mutex);
 
-				/* loop over the requests in the session */
-				cur_req = cur_sess->requests;
-				prev_req = NULL;
-
-				while(cur_req) {
-					/* check for abort before anything else. */
-					if(cur_req->abort_request) {
-						ab_request_p tmp;
-
-						/*
-						 * is this in the process of being sent?
-						 * if so, abort the abort because otherwise we would send
-						 * a partial packet and cause all kinds of problems.
-						 * FIXME
-						 */
-						if(cur_sess->current_request != cur_req) {
-							if(prev_req) {
-								prev_req->next = cur_req->next;
-							} else {
-								/* cur is head of list */
-								cur_sess->requests = cur_req->next;
-							}
-
-							tmp = cur_req;
-							cur_req = cur_req->next;
-
-							/* free the the request */
-							request_destroy(&tmp);
-
-							continue;
-						}
-					}
+				/*
+				 * tags waiting on finished requests may have callbacks to run
+				 * or threads waiting on them.  The tags of a session pool are
+				 * on its first session.
+				 */
+				if(sess_done) {
+					ab_session_p tag_sess = (cur_sess->pool_head ? cur_sess->pool_head : cur_sess);
 
-					rc = request_check_outgoing_data(cur_sess, cur_req);
+					critical_block(tag_sess->mutex) {
+						worker_collect_callbacks_unsafe(worker, tag_sess);
+					}
 
-					/* move to the next request */
-					prev_req = cur_req;
-					cur_req = cur_req->next;
+					event_signal(tag_sess->io_event);
 				}
-
-				/*  move to the next session */
-				cur_sess = cur_sess->next;
 			}
+
+			worker_collect_scans_unsafe(worker);
 		} /* end synchronized block */
 
-		/* give up the CPU */
-		sleep_ms(1);
+		/* this is done without any locks held so that callbacks can use the tags. */
+		worker_run_callbacks(worker);
+		worker_run_scans(worker);
 	}
 
 	thread_stop();
 
+#ifdef WIN32
+	return 0;
+#else
 	return NULL;
+#endif
 }
 
 
@@ -41,34 +41,41 @@ extern "C"
 
 
 extern volatile mutex_p io_thread_mutex;
-extern volatile thread_p io_handler_thread;
+extern ab_io_worker_p io_workers[MAX_IO_THREADS];
 
 /* generic */
 int ab_tag_abort(ab_tag_p tag);
 int ab_tag_destroy(ab_tag_p p_tag);
+int ab_tag_start(ab_tag_p tag);
 
 int check_cpu(ab_tag_p tag, attr attribs);
 int check_tag_name(ab_tag_p tag, const char *name);
-int send_eip_request(ab_request_p req);
 int recv_eip_response(ab_session_p session);
+int session_check_frame(ab_session_p session);
+int session_grow_recv_buf(ab_session_p session, int size);
 int check_mutex(int debug);
 
 uint64_t session_get_new_seq_id_unsafe(ab_session_p sess);
 uint64_t session_get_new_seq_id(ab_session_p sess);
 
-int request_create(ab_request_p *req);
+int request_create(ab_request_p *req, int buf_size);
+void session_link_request_unsafe(ab_session_p sess, ab_request_p pos, ab_request_p req);
+void session_unlink_request_unsafe(ab_session_p sess, ab_request_p req);
 int request_add_unsafe(ab_session_p sess, ab_request_p req);
 int request_add(ab_session_p sess, ab_request_p req);
 int request_remove_unsafe(ab_session_p sess, ab_request_p req);
 int request_remove(ab_session_p sess, ab_request_p req);
 int request_destroy(ab_request_p *req);
+void request_pool_log_stats(int debug);
+uint8_t *request_buf_alloc(int *buf_size);
+void request_buf_free(uint8_t *buf, int buf_size);
 
 int find_or_create_session(ab_tag_p tag, attr attribs);
 int add_session_unsafe(ab_tag_p tag,  ab_session_p n);
 int add_session(ab_tag_p tag,  ab_session_p s);
 int remove_session_unsafe(ab_tag_p tag, ab_session_p n);
 int remove_session(ab_tag_p tag,  ab_session_p s);
-ab_session_p find_session_by_host_unsafe(ab_tag_p tag, const char  *t);
+ab_session_p find_session_unsafe(ab_tag_p tag, const char *host, int port);
 int session_add_tag_unsafe(ab_tag_p tag, ab_session_p session);
 int session_remove_tag_unsafe(ab_tag_p tag, ab_session_p session);
 ab_session_p ab_session_create(ab_tag_p tag, const char *host, int gw_port);
@@ -76,17 +83,40 @@ int ab_session_connect(ab_tag_p tag, ab_session_p session, const char *host);
 int ab_session_destroy_unsafe(ab_tag_p tag, ab_session_p session);
 int ab_session_destroy(ab_tag_p tag, ab_session_p session);
 int ab_session_empty(ab_session_p session);
-int ab_session_register(ab_tag_p tag, ab_session_p session);
+int ab_session_register_unsafe(ab_session_p session);
+int session_setup_step_unsafe(ab_session_p session);
+int ab_session_status(ab_session_p session);
 int ab_session_unregister(ab_tag_p tag, ab_session_p session);
+int ab_session_fail_unsafe(ab_session_p session, int status);
+
+int connection_find_or_create_unsafe(ab_tag_p tag, ab_session_p session);
+int connection_check_unsafe(ab_session_p session, ab_request_p req, ab_request_p *fo);
+int connection_handle_open_response_unsafe(ab_request_p fo);
+int connection_close_unsafe(ab_session_p session, ab_connection_p conn, int debug);
+int connection_find_symbol_unsafe(ab_connection_p conn, const char *name, int name_len, uint32_t *instance);
+int connection_add_symbol_unsafe(ab_connection_p conn, const char *name, int name_len, uint32_t instance);
+int connection_browse_unsafe(ab_session_p session, ab_connection_p conn, uint32_t start_instance, int debug);
+int connection_handle_browse_response_unsafe(ab_request_p req);
+
+int io_worker_create(ab_io_worker_p *worker, int dedicated);
+int io_worker_destroy(ab_io_worker_p *worker);
+int io_worker_reap(void);
+int io_worker_add_session_unsafe(ab_tag_p tag, ab_session_p session, int io_threads, int dedicated);
+int io_worker_remove_session_unsafe(ab_tag_p tag, ab_session_p session);
+int io_worker_add_scan(ab_io_worker_p worker, ab_tag_p tag);
+int io_worker_remove_scan(ab_io_worker_p worker, ab_tag_p tag);
 
 
 int session_check_incoming_data(ab_session_p session);
 int request_check_outgoing_data(ab_session_p session, ab_request_p req);
+int request_start_send_unsafe(ab_session_p session, ab_request_p req);
+int session_send_requests_unsafe(ab_session_p session);
+int session_process_io_unsafe(ab_session_p session);
 
 #ifdef WIN32
-DWORD __stdcall request_handler_func(LPVOID not_used);
+DWORD __stdcall request_handler_func(LPVOID arg);
 #else
-void *request_handler_func(void *not_used);
+void *request_handler_func(void *arg);
 #endif
 
 #ifdef __cplusplus
@@ -54,6 +54,7 @@ extern "C"
 #include <ab/ab_defs.h>
 #include <ab/common.h>
 #include <ab/cip.h>
+#include <ab/tag_cache.h>
 #include <util/attr.h>
 
 
@@ -65,6 +66,9 @@ int build_read_request(ab_tag_p tag, int slot, int byte_offset);
 int build_write_request(ab_tag_p tag, int slot, int byte_offset);
 static int check_read_status(ab_tag_p tag);
 static int check_write_status(ab_tag_p tag);
+static void check_type_info(ab_tag_p tag, uint8_t *type_info, int type_info_size);
+static void check_instance_id(ab_tag_p tag);
+static void use_symbolic_name(ab_tag_p tag);
 int calculate_write_sizes(ab_tag_p tag);
 
 /*************************************************************************
@@ -97,20 +101,12 @@ int eip_cip_tag_status(ab_tag_p tag)
 	}
 
 	/*
-	 * if the session we are using is not yet connected,
-	 * then return PENDING and let the tag that started
-	 * the connection finish it.
-	 *
-	 * FIXME - if the tag that started the connection
-	 * fails to connect or is aborted/destroyed, then the
-	 * connection will never be created.
+	 * the IO thread sets up new sessions in the background.  The
+	 * tag is pending until the session is ready and gets the
+	 * error if it could not be set up.
 	 */
 	if(tag->session) {
-		if(!tag->session->is_connected) {
-			tag->status = PLCTAG_STATUS_PENDING;
-		} else {
-			tag->status = PLCTAG_STATUS_OK;
-		}
+		tag->status = ab_session_status(tag->session);
 	}
 
 	return tag->status;
@@ -138,43 +134,64 @@ int eip_cip_tag_read_start(ab_tag_p tag)
     int debug = tag->debug;
 
     pdebug(debug,"Starting");
-	
+
+	/* switch to the instance ID once the symbol table has it. */
+	check_instance_id(tag);
+
 	/* is this the first read? */
 	if(tag->first_read) {
 		/*
-		 * On a new tag, the first time we read, we go through and
-		 * request the maximum possible (up to the size of the tag)
-		 * each time.  We record what we actually get back in the
-		 * tag->read_req_sizes array.  The next time we read, we
-		 * use that array to make the new requests.
+		 * On a new tag, the first request asks for the whole tag.  The
+		 * PLC sends back as much as fits in one packet, which tells us
+		 * the fragment size.  The rest of the tag is then asked for in
+		 * fragments of that size all at once.  The sizes are kept in
+		 * tag->read_req_sizes for later reads.  If a fragment comes
+		 * back a different size, check_read_status() drops the ones
+		 * after it and we plan the rest again from there.
 		 */
 
-		rc = allocate_read_request_slot(tag);
-
-		if(rc != PLCTAG_STATUS_OK) {
-			tag->status = rc;
-			return rc;
-		}
-
-	    /*
-	     * The PLC may not send back as much data as we would like.
-	     * So, we attempt to determine what the size will be by
-	     * single-stepping through the requests the first time.
-	     * This will be slow, but subsequent reads will be pipelined.
-	     */
-
 		/* determine the byte offset this time. */
 		byte_offset = 0;
 
-		/* scan and add the byte offsets */
+		/* scan and add the byte offsets of the requests that are done */
 		for(i=0; i < tag->num_read_requests && tag->reqs[i]; i++) {
 			byte_offset += tag->read_req_sizes[i];
 		}
 
+		/* a first read that failed part way starts again from what was done. */
+		tag->num_read_requests = i;
+
 		pdebug(debug,"First read tag->num_read_requests=%d, byte_offset=%d.",tag->num_read_requests,byte_offset);
 
-		/* i is the index of the first new request */
-		rc = build_read_request(tag, i, byte_offset);
+		if(i == 0) {
+			/* nothing known yet, find out how much comes back in one go. */
+			rc = allocate_read_request_slot(tag);
+
+			if(rc == PLCTAG_STATUS_OK) {
+				tag->read_req_sizes[0] = 0;
+				rc = build_read_request(tag, 0, 0);
+			}
+		} else {
+			/* the last reply is the best guess of the fragment size. */
+			int frag_size = tag->read_req_sizes[i-1];
+
+			while(rc == PLCTAG_STATUS_OK && byte_offset < tag->size) {
+				int req_size = (tag->size - byte_offset < frag_size ? tag->size - byte_offset : frag_size);
+
+				rc = allocate_read_request_slot(tag);
+
+				if(rc != PLCTAG_STATUS_OK) {
+					break;
+				}
+
+				tag->read_req_sizes[i] = req_size;
+
+				rc = build_read_request(tag, i, byte_offset);
+
+				byte_offset += req_size;
+				i++;
+			}
+		}
 
 		if(rc != PLCTAG_STATUS_OK) {
 			tag->status = rc;
@@ -230,6 +247,9 @@ int eip_cip_tag_write_start(ab_tag_p tag)
 
     pdebug(debug,"Starting");
 
+    /* switch to the instance ID once the symbol table has it. */
+    check_instance_id(tag);
+
     /*
      * if the tag has not been read yet, read it.
      *
@@ -400,6 +420,164 @@ int allocate_write_request_slot(ab_tag_p tag)
 
 
 
+/*
+ * eip_cip_tag_restore
+ *
+ * Set the tag up from its metadata cache entry, if it has one.  The
+ * fragments are planned from the cached size so that the first read
+ * asks for all of them at once, and a write can go out without
+ * reading the tag first.  Otherwise the first read finds out as usual.
+ */
+int eip_cip_tag_restore(ab_tag_p tag)
+{
+	int frag_size = 0;
+	int byte_offset = 0;
+	int rc;
+	int debug = tag->debug;
+
+	if(tag_cache_lookup(tag, &frag_size) != PLCTAG_STATUS_OK) {
+		pdebug(debug,"No cached metadata for the tag.");
+		return PLCTAG_STATUS_OK;
+	}
+
+	pdebug(debug,"Restoring cached metadata, fragment size %d.",frag_size);
+
+	while(byte_offset < tag->size) {
+		int req_size = (tag->size - byte_offset < frag_size ? tag->size - byte_offset : frag_size);
+
+		rc = allocate_read_request_slot(tag);
+
+		if(rc != PLCTAG_STATUS_OK) {
+			/* leave the tag as if there was no entry. */
+			tag->num_read_requests = 0;
+			tag->encoded_type_info_size = 0;
+			return rc;
+		}
+
+		tag->read_req_sizes[tag->num_read_requests - 1] = req_size;
+
+		byte_offset += req_size;
+	}
+
+	/* the replies check the plan and the type. */
+	tag->first_read = 0;
+	tag->metadata_unchecked = 1;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * check_type_info
+ *
+ * Keep the type info from the first reply.  Type info restored from
+ * the metadata cache is checked against the first reply instead, and
+ * replaced if the PLC says something else.
+ */
+static void check_type_info(ab_tag_p tag, uint8_t *type_info, int type_info_size)
+{
+	int debug = tag->debug;
+
+	if(tag->metadata_unchecked) {
+		tag->metadata_unchecked = 0;
+
+		if(tag->encoded_type_info_size == type_info_size && mem_cmp(tag->encoded_type_info, type_info, type_info_size) == 0) {
+			return;
+		}
+
+		pdebug(debug,"Cached type info does not match the PLC's.");
+
+		/* the write requests depend on the type info size. */
+		tag->encoded_type_info_size = 0;
+		tag->num_write_requests = 0;
+		tag->metadata_dirty = 1;
+	}
+
+	if(tag->encoded_type_info_size == 0) {
+		tag->encoded_type_info_size = type_info_size;
+		mem_copy(tag->encoded_type_info,type_info,tag->encoded_type_info_size);
+	}
+}
+
+
+
+/*
+ * check_instance_id
+ *
+ * A tag waiting on its connection's symbol table looks itself up once
+ * the table is loaded.  If the PLC has an instance ID for the tag's
+ * base name, requests use that instead of the name from then on.  If
+ * there is no table or no instance, the tag stays with its name.
+ */
+static void check_instance_id(ab_tag_p tag)
+{
+	ab_connection_p conn = tag->connection;
+	uint32_t instance = 0;
+	int state = AB_SYMBOLS_NOT_LOADED;
+	int rc = PLCTAG_ERR_NOT_FOUND;
+	int debug = tag->debug;
+
+	if(tag->instance_state != AB_INSTANCE_UNRESOLVED) {
+		return;
+	}
+
+	/* only a name that starts with a symbolic segment can be looked up. */
+	if(!conn || tag->encoded_name_size < 3 || tag->encoded_name[1] != 0x91) {
+		tag->instance_state = AB_INSTANCE_SYMBOLIC;
+		return;
+	}
+
+	critical_block(tag->session->mutex) {
+		state = (conn->state == AB_CONNECTION_FAILED ? AB_SYMBOLS_FAILED : conn->symbol_state);
+
+		if(state == AB_SYMBOLS_LOADED) {
+			rc = connection_find_symbol_unsafe(conn, (const char *)(tag->encoded_name + 3), tag->encoded_name[2], &instance);
+		}
+	}
+
+	if(state == AB_SYMBOLS_NOT_LOADED || state == AB_SYMBOLS_LOADING) {
+		return;
+	}
+
+	if(rc == PLCTAG_STATUS_OK) {
+		rc = cip_encode_instance_name(tag, instance);
+	}
+
+	if(rc != PLCTAG_STATUS_OK) {
+		pdebug(debug,"No instance ID for the tag, using its name.");
+		tag->instance_state = AB_INSTANCE_SYMBOLIC;
+		return;
+	}
+
+	pdebug(debug,"Using Symbol Object instance %u for the tag.",(unsigned int)instance);
+
+	/* the write requests depend on the name size. */
+	tag->num_write_requests = 0;
+	tag->instance_state = AB_INSTANCE_USED;
+}
+
+
+
+/*
+ * use_symbolic_name
+ *
+ * Go back to the tag's name for good when the PLC does not know its
+ * instance ID, for instance after a download moved the tags around.
+ */
+static void use_symbolic_name(ab_tag_p tag)
+{
+	pdebug(tag->debug,"PLC does not know the tag's instance ID, using its name.");
+
+	mem_copy(tag->encoded_name, tag->symbolic_name, tag->symbolic_name_size);
+	tag->encoded_name_size = tag->symbolic_name_size;
+
+	tag->num_write_requests = 0;
+	tag->instance_state = AB_INSTANCE_SYMBOLIC;
+}
+
+
+
 int build_read_request(ab_tag_p tag, int slot, int byte_offset)
 {
     eip_cip_uc_req *cip;
@@ -412,7 +590,7 @@ int build_read_request(ab_tag_p tag, int slot, int byte_offset)
     pdebug(debug,"Starting.");
 
 	/* get a request buffer */
-	rc = request_create(&req);
+	rc = request_create(&req, MAX_REQ_RESP_SIZE);
 
 	if(rc != PLCTAG_STATUS_OK) {
 		pdebug(debug,"Unable to get new request.  rc=%d",rc);
@@ -507,9 +685,28 @@ int build_read_request(ab_tag_p tag, int slot, int byte_offset)
 	/* set the size of the request */
 	req->request_size = data - (req->data);
 
+	/*
+	 * the reply has the reply header, the type info and the data.  Until
+	 * the first read is done, we do not know how much we will get back.
+	 */
+	req->allow_packing = tag->allow_packing;
+
+	if(tag->first_read) {
+		req->resp_size_hint = 4 + MAX_TAG_TYPE_INFO + (tag->read_req_sizes[slot] ? tag->read_req_sizes[slot] : tag->size - byte_offset);
+	} else {
+		req->resp_size_hint = 4 + tag->encoded_type_info_size + tag->read_req_sizes[slot];
+	}
+
+	/* the IO thread sends it on the tag's connection once that is open. */
+	req->connection = tag->connection;
+
 	/* mark it as ready to send */
 	req->send_request = 1;
 
+	/* the IO thread sends it by priority and fails it if it is not done in time. */
+	req->timeout_ms = tag->timeout_ms;
+	req->priority = tag->priority;
+
 	/* add the request to the session's list. */
 	rc = request_add(tag->session, req);
 
@@ -541,8 +738,9 @@ int build_write_request(ab_tag_p tag, int slot, int byte_offset)
 
     pdebug(debug,"Starting.");
 
-	/* get a request buffer */
-	rc = request_create(&req);
+	/* get a request buffer big enough for the data */
+	rc = request_create(&req, sizeof(eip_cip_uc_req) + 1 + tag->encoded_name_size + tag->encoded_type_info_size
+	                          + 2 + 4 + tag->write_req_sizes[slot] + 1 + 2 + tag->conn_path_size);
 
 	if(rc != PLCTAG_STATUS_OK) {
 		pdebug(debug,"Unable to get new request.  rc=%d",rc);
@@ -663,15 +861,26 @@ int build_write_request(ab_tag_p tag, int slot, int byte_offset)
 	/* set the size of the request */
 	req->request_size = data - (req->data);
 
+	/* the reply is just the reply header. */
+	req->allow_packing = tag->allow_packing;
+	req->resp_size_hint = 4;
+
+	/* the IO thread sends it on the tag's connection once that is open. */
+	req->connection = tag->connection;
+
 	/* mark it as ready to send */
 	req->send_request = 1;
 
+	/* the IO thread sends it by priority and fails it if it is not done in time. */
+	req->timeout_ms = tag->timeout_ms;
+	req->priority = tag->priority;
+
 	/* add the request to the session's list. */
 	rc = request_add(tag->session, req);
 
 	if(rc != PLCTAG_STATUS_OK) {
 		pdebug(debug,"Unable to lock add request to session! rc=%d",rc);
-		plc_tag_abort((plc_tag)tag);
+		ab_tag_abort(tag);
 		request_destroy(&req);
 		tag->status = rc;
 		return rc;
@@ -744,6 +953,12 @@ static int check_read_status(ab_tag_p tag)
 
     	pdebug(debug,"processing request %d",i);
 
+		if(req->status != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Request failed in IO thread, status: %d",req->status);
+			rc = req->status;
+			break;
+		}
+
  		/* point to the data */
 		cip_resp = (eip_cip_uc_resp*)(req->data);
 
@@ -775,6 +990,15 @@ static int check_read_status(ab_tag_p tag)
 		if(cip_resp->status != AB_CIP_STATUS_OK && cip_resp->status != AB_CIP_STATUS_FRAG) {
 			pdebug(debug,"CIP read failed with status: %d",cip_resp->status);
 			pdebug(debug,cip_decode_status(cip_resp->status));
+
+			/* try again by name if the instance ID is no good. */
+			if(tag->instance_state == AB_INSTANCE_USED
+			   && (cip_resp->status == AB_CIP_STATUS_PATH_SEGMENT_ERR || cip_resp->status == AB_CIP_STATUS_PATH_DEST_UNKNOWN)) {
+				use_symbolic_name(tag);
+				ab_tag_abort(tag);
+				return eip_cip_tag_read_start(tag);
+			}
+
 			switch(cip_resp->status) {
 				case 0x04:		/* FIXME - should be defined constants */
 				case 0x05:
@@ -812,10 +1036,7 @@ static int check_read_status(ab_tag_p tag)
 		/* check for a simple/base type */
 		if((*data) >= AB_CIP_DATA_BIT && (*data) <= AB_CIP_DATA_STRINGI) {
 			/* copy the type info for later. */
-			if(tag->encoded_type_info_size == 0) {
-				tag->encoded_type_info_size = 2;
-				mem_copy(tag->encoded_type_info,data,tag->encoded_type_info_size);
-			}
+			check_type_info(tag, data, 2);
 
 			/* skip the type byte and zero length byte */
 			data += 2;
@@ -839,10 +1060,7 @@ static int check_read_status(ab_tag_p tag)
 			}
 
 			/* copy the type info for later. */
-			if(tag->encoded_type_info_size == 0) {
-				tag->encoded_type_info_size = type_length;
-				mem_copy(tag->encoded_type_info,data,tag->encoded_type_info_size);
-			}
+			check_type_info(tag, data, type_length);
 
 			data += type_length;
 		} else {
@@ -870,6 +1088,29 @@ static int check_read_status(ab_tag_p tag)
 			mem_copy(tag->data  + byte_offset, data, (data_end - data));
 		}
 
+		/*
+		 * a fragment that is not the size we planned means the rest of
+		 * the plan is off.  Drop the requests after it and plan again
+		 * from here.
+		 */
+		if(tag->read_req_sizes[i] && tag->read_req_sizes[i] != (data_end - data)) {
+			int j;
+
+			pdebug(debug,"Fragment %d is %d bytes, expected %d.  Planning the read again.",i,(int)(data_end - data),tag->read_req_sizes[i]);
+
+			for(j = i + 1; j < tag->num_read_requests; j++) {
+				if(tag->reqs[j]) {
+					tag->reqs[j]->abort_request = 1;
+					tag->reqs[j] = NULL;
+				}
+
+				tag->read_req_sizes[j] = 0;
+			}
+
+			tag->num_read_requests = i + 1;
+			tag->first_read = 1;
+		}
+
 		/* save the size of the response for next time */
 		tag->read_req_sizes[i] = (data_end - data);
 
@@ -905,6 +1146,12 @@ static int check_read_status(ab_tag_p tag)
 			}
 		} else {
 			/* done! */
+
+			/* keep what we found out for the next run. */
+			if(tag->metadata_cache && (tag->first_read || tag->metadata_dirty)) {
+				tag_cache_store(tag);
+			}
+
 			tag->first_read = 0;
 
 			tag->read_in_progress = 0;
@@ -952,6 +1199,9 @@ static int check_read_status(ab_tag_p tag)
     } else {
     	/* error ! */
     	pdebug(debug,"Error received!");
+
+    	/* let the IO thread clean up the requests */
+    	ab_tag_abort(tag);
     }
 
     tag->status = rc;
@@ -980,6 +1230,7 @@ static int check_write_status(ab_tag_p tag)
     int rc = PLCTAG_STATUS_OK;
     int i;
     ab_request_p req;
+    int plc_refused = 0;
     int debug = tag->debug;
 
     /* is there an outstanding request? */
@@ -1013,6 +1264,12 @@ static int check_write_status(ab_tag_p tag)
     		break;
     	}
 
+		if(req->status != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Request failed in IO thread, status: %d",req->status);
+			rc = req->status;
+			break;
+		}
+
 		/* point to the data */
 		cip_resp = (eip_cip_uc_resp*)(req->data);
 
@@ -1040,11 +1297,40 @@ static int check_write_status(ab_tag_p tag)
 		if(cip_resp->status != AB_CIP_STATUS_OK && cip_resp->status != AB_CIP_STATUS_FRAG) {
 			pdebug(debug,"CIP read failed with status: %d",cip_resp->status);
 			pdebug(debug,cip_decode_status(cip_resp->status));
+
+			/* try again by name if the instance ID is no good. */
+			if(tag->instance_state == AB_INSTANCE_USED
+			   && (cip_resp->status == AB_CIP_STATUS_PATH_SEGMENT_ERR || cip_resp->status == AB_CIP_STATUS_PATH_DEST_UNKNOWN)) {
+				use_symbolic_name(tag);
+				ab_tag_abort(tag);
+				return eip_cip_tag_write_start(tag);
+			}
+
 			rc = PLCTAG_ERR_REMOTE_ERR;
+			plc_refused = 1;
 			break;
 		}
     }
 
+	/* this triggers the clean up */
+	ab_tag_abort(tag);
+
+	/*
+	 * a write with type info from the cache that the PLC turned down
+	 * may have the wrong type.  Forget it and find out again.
+	 */
+	if(plc_refused && tag->metadata_unchecked) {
+		pdebug(debug,"Write with cached metadata failed, dropping the cache entry.");
+
+		tag_cache_remove(tag);
+
+		tag->metadata_unchecked = 0;
+		tag->encoded_type_info_size = 0;
+		tag->num_read_requests = 0;
+		tag->num_write_requests = 0;
+		tag->first_read = 1;
+	}
+
     /*
      * Now remove the requests from the session's request list.
 	 * 
@@ -1073,9 +1359,6 @@ static int check_write_status(ab_tag_p tag)
 	//	/* mark it as freed */
 	//	tag->reqs[i] = NULL;
     //}
-	
-	/* this triggers the clean up */
-	ab_tag_abort(tag);
 
     tag->write_in_progress = 0;
     tag->status = rc;
@@ -1093,6 +1376,7 @@ static int check_write_status(ab_tag_p tag)
 int calculate_write_sizes(ab_tag_p tag)
 {
 	int overhead;
+	int max_packet;
 	int data_per_packet;
 	int num_reqs;
 	int rc = PLCTAG_STATUS_OK;
@@ -1117,13 +1401,18 @@ int calculate_write_sizes(ab_tag_p tag)
 			   + 4								/* byte offset, 32-bit int */
 			   + 8;								/* MAGIC fudge factor */
 
-	data_per_packet = MAX_EIP_PACKET_SIZE - overhead;
+	/* a Large Forward Open connection lets us send much bigger packets. */
+	critical_block(tag->session->mutex) {
+		max_packet = cip_max_packet_size(tag->connection);
+	}
+
+	data_per_packet = max_packet - overhead;
 
 	/* we want a multiple of 4 bytes */
 	data_per_packet &= 0xFFFFFFFC;
 
 	if(data_per_packet <= 0) {
-		pdebug(debug,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, MAX_EIP_PACKET_SIZE);
+		pdebug(debug,"Unable to send request.  Packet overhead, %d bytes, is too large for packet, %d bytes!", overhead, max_packet);
 		tag->status = PLCTAG_ERR_TOO_LONG;
 		return PLCTAG_ERR_TOO_LONG;
 	}
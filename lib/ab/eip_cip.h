@@ -31,5 +31,6 @@
 int eip_cip_tag_status(ab_tag_p tag);
 int eip_cip_tag_read_start(ab_tag_p tag);
 int eip_cip_tag_write_start(ab_tag_p tag);
+int eip_cip_tag_restore(ab_tag_p tag);
 
 #endif
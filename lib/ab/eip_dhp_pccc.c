@@ -70,20 +70,12 @@ int eip_dhp_pccc_tag_status(ab_tag_p tag)
 	}
 
 	/*
-	 * if the session we are using is not yet connected,
-	 * then return PENDING and let the tag that started
-	 * the connection finish it.
-	 *
-	 * FIXME - if the tag that started the connection
-	 * fails to connect or is aborted/destroyed, then the
-	 * connection will never be created.
+	 * the IO thread sets up new sessions in the background.  The
+	 * tag is pending until the session is ready and gets the
+	 * error if it could not be set up.
 	 */
 	if(tag->session) {
-		if(!tag->session->is_connected) {
-			tag->status = PLCTAG_STATUS_PENDING;
-		} else {
-			tag->status = PLCTAG_STATUS_OK;
-		}
+		tag->status = ab_session_status(tag->session);
 	}
 
 	return tag->status;
@@ -132,7 +124,7 @@ int eip_dhp_pccc_tag_read_start(ab_tag_p tag)
 
 
     /* get a request buffer */
-    rc = request_create(&req);
+    rc = request_create(&req, MAX_REQ_RESP_SIZE);
 
     if(rc != PLCTAG_STATUS_OK) {
     	pdebug(debug,"Unable to get new request.  rc=%d",rc);
@@ -199,6 +191,10 @@ int eip_dhp_pccc_tag_read_start(ab_tag_p tag)
     //req->conn_id = tag->connection->orig_connection_id;
     req->conn_seq = conn_seq_id;
 
+    /* the IO thread sends it by priority and fails it if it is not done in time. */
+    req->timeout_ms = tag->timeout_ms;
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = request_add(tag->session, req);
 
@@ -262,7 +258,7 @@ int eip_dhp_pccc_tag_write_start(ab_tag_p tag)
 
 
     /* get a request buffer */
-    rc = request_create(&req);
+    rc = request_create(&req, MAX_REQ_RESP_SIZE);
 
     if(rc != PLCTAG_STATUS_OK) {
     	pdebug(debug,"Unable to get new request.  rc=%d",rc);
@@ -368,6 +364,10 @@ int eip_dhp_pccc_tag_write_start(ab_tag_p tag)
     //req->conn_id = tag->connection->orig_connection_id;
     //req->conn_seq = connection_get_new_seq_id(tag->connection);
 
+    /* the IO thread sends it by priority and fails it if it is not done in time. */
+    req->timeout_ms = tag->timeout_ms;
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = request_add(tag->session, req);
 
@@ -443,7 +443,7 @@ static int check_read_status(ab_tag_p tag)
  		pdebug(debug,"Unable to remove the request from the list! rc=%d",rc);
 
  		/* since we could not remove it, maybe the thread can. */
- 		plc_tag_abort((plc_tag)tag);
+ 		ab_tag_abort(tag);
 
  		/* not our request any more */
  		req = NULL;
@@ -456,6 +456,12 @@ static int check_read_status(ab_tag_p tag)
 
      /* fake exception */
      do {
+		if(req->status != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Request failed in IO thread, status: %d",req->status);
+			rc = req->status;
+			break;
+		}
+
 		pccc_resp = (eip_pccc_dhp_resp_old*)(req->data);
 
 		data_end = (req->data + pccc_resp->encap_length + sizeof(eip_encap_t));
@@ -575,7 +581,7 @@ static int check_write_status(ab_tag_p tag)
  		pdebug(debug,"Unable to remove the request from the list! rc=%d",rc);
 
  		/* since we could not remove it, maybe the thread can. */
- 		plc_tag_abort((plc_tag)tag);
+ 		ab_tag_abort(tag);
 
  		/* not our request any more */
  		req = NULL;
@@ -588,6 +594,12 @@ static int check_write_status(ab_tag_p tag)
 
  	/* fake exception */
  	do {
+		if(req->status != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Request failed in IO thread, status: %d",req->status);
+			rc = req->status;
+			break;
+		}
+
 		pccc_resp = (eip_pccc_dhp_resp_old*)(req->data);
 
 		/* check the response status */
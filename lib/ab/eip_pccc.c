@@ -66,15 +66,12 @@ int eip_pccc_tag_status(ab_tag_p tag)
 	}
 
 	/*
-	 * If the session is not completely set up,
-	 * mark this tag as pending.
+	 * the IO thread sets up new sessions in the background.  The
+	 * tag is pending until the session is ready and gets the
+	 * error if it could not be set up.
 	 */
 	if(tag->session) {
-		if(!tag->session->is_connected) {
-			tag->status = PLCTAG_STATUS_PENDING;
-		} else {
-			tag->status = PLCTAG_STATUS_OK;
-		}
+		tag->status = ab_session_status(tag->session);
 	}
 
 	return tag->status;
@@ -137,7 +134,7 @@ int eip_pccc_tag_read_start(ab_tag_p tag)
 
 
 	/* get a request buffer */
-	rc = request_create(&req);
+	rc = request_create(&req, MAX_REQ_RESP_SIZE);
 
 	if(rc != PLCTAG_STATUS_OK) {
 		pdebug(debug,"Unable to get new request.  rc=%d",rc);
@@ -252,6 +249,10 @@ int eip_pccc_tag_read_start(ab_tag_p tag)
 	/* mark it as ready to send */
 	req->send_request = 1;
 
+	/* the IO thread sends it by priority and fails it if it is not done in time. */
+	req->timeout_ms = tag->timeout_ms;
+	req->priority = tag->priority;
+
 	/* add the request to the session's list. */
 	rc = request_add(tag->session, req);
 
@@ -297,7 +298,7 @@ int eip_pccc_tag_write_start(ab_tag_p tag)
     pdebug(debug,"Starting.");
 
     /* get a request buffer */
-    rc = request_create(&req);
+    rc = request_create(&req, MAX_REQ_RESP_SIZE);
 
     if(rc != PLCTAG_STATUS_OK) {
     	pdebug(debug,"Unable to get new request.  rc=%d",rc);
@@ -410,6 +411,10 @@ int eip_pccc_tag_write_start(ab_tag_p tag)
     //req->conn_id = tag->connection->orig_connection_id;
     req->conn_seq = conn_seq_id;
 
+    /* the IO thread sends it by priority and fails it if it is not done in time. */
+    req->timeout_ms = tag->timeout_ms;
+    req->priority = tag->priority;
+
     /* add the request to the session's list. */
     rc = request_add(tag->session, req);
 
@@ -470,7 +475,7 @@ static int check_write_status(ab_tag_p tag)
 		pdebug(debug,"Unable to remove the request from the list! rc=%d",rc);
 
 		/* since we could not remove it, maybe the thread can. */
-		plc_tag_abort((plc_tag)tag);
+		ab_tag_abort(tag);
 
 		/* not our request any more */
 		req = NULL;
@@ -482,6 +487,12 @@ static int check_write_status(ab_tag_p tag)
 
     /* fake exception */
     do {
+		if(req->status != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Request failed in IO thread, status: %d",req->status);
+			rc = req->status;
+			break;
+		}
+
 		pccc_resp = (eip_pccc_resp_old*)(req->data);
 
 		/* check the response status */
@@ -570,6 +581,12 @@ static int check_read_status(ab_tag_p tag)
 
     /* fake exceptions */
     do {
+		if(req->status != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Request failed in IO thread, status: %d",req->status);
+			rc = req->status;
+			break;
+		}
+
     	pccc_resp = (eip_pccc_resp_old*)(req->data);
 
 		data_end = (req->data + pccc_resp->encap_length + sizeof(eip_encap_t));
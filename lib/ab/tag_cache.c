@@ -0,0 +1,505 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Process Control Engineers                       *
+ *   Author Kyle Hayes  kylehayes@processcontrolengineers.com              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#include <stdio.h>
+#include <platform.h>
+#include <libplctag.h>
+#include <ab/ab_defs.h>
+#include <ab/tag_cache.h>
+#include <util/attr.h>
+
+
+/*
+ * Tag metadata cache.
+ *
+ * A Logix tag learns its type info and how big a fragment the PLC
+ * sends back on its first read.  With the metadata_cache attribute set,
+ * that is kept in a memory mapped file so that the next run of the
+ * program starts with it and skips the discovery round trips.
+ *
+ * The file is a header and a fixed size hash table of entries keyed on
+ * the gateway, path and tag name.  Entries are only hints.  The first
+ * replies for a restored tag are checked against them, and a fragment or
+ * type that does not match makes the tag fall back to discovery and
+ * write the entry again.  Values are in host byte order, so the file is
+ * not meant to be moved between machines.
+ *
+ * Several processes can use the same file.  Each access to the mapping
+ * is done with an exclusive lock on the file held, and threads in this
+ * process also take the cache mutex first.  A file with some other
+ * layout is left alone and the tags run without the cache.
+ */
+
+#define TAG_CACHE_MAGIC "PLCTAGMC"
+#define TAG_CACHE_VERSION (1)
+#define TAG_CACHE_ENTRIES (1024)
+#define TAG_CACHE_PROBES (16)
+#define TAG_CACHE_KEY_SIZE (384)
+#define TAG_CACHE_ENTRY_VALID (0x56414C44)
+
+struct tag_cache_header_t {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_entries;
+	uint32_t entry_size;
+	uint32_t reserved;
+};
+
+struct tag_cache_entry_t {
+	uint32_t valid;
+	uint32_t hash;
+	int32_t size;
+	int32_t frag_size;
+	int32_t encoded_type_info_size;
+	uint8_t encoded_type_info[MAX_TAG_TYPE_INFO];
+	char key[TAG_CACHE_KEY_SIZE];
+};
+
+struct ab_tag_cache_t {
+	ab_tag_cache_p next;
+	char *file_name;
+	int refs;
+	file_map_p map;
+	mutex_p mutex;
+	struct tag_cache_entry_t *entries;
+};
+
+/* open cache files, protected by the IO thread mutex */
+static ab_tag_cache_p caches = AB_TAG_CACHE_NULL;
+
+
+static int tag_cache_create(ab_tag_cache_p *cache, const char *file_name, int debug);
+static void tag_cache_destroy(ab_tag_cache_p *cache);
+static uint32_t tag_cache_hash(const char *key);
+static struct tag_cache_entry_t *tag_cache_find_unsafe(ab_tag_cache_p cache, const char *key, uint32_t hash);
+
+
+
+/*
+ * tag_cache_open_unsafe
+ *
+ * Attach the tag to the cache file named by its metadata_cache
+ * attribute, opening the file if no other tag has.  Tags without
+ * the attribute are left alone.  Call with the IO thread mutex held.
+ */
+int tag_cache_open_unsafe(ab_tag_p tag, attr attribs)
+{
+	const char *file_name = attr_get_str(attribs,"metadata_cache",NULL);
+	char key[TAG_CACHE_KEY_SIZE];
+	ab_tag_cache_p cache;
+	int debug = tag->debug;
+	int rc;
+
+	if(!file_name || !*file_name) {
+		return PLCTAG_STATUS_OK;
+	}
+
+	/* only Logix tags have anything to cache. */
+	if(tag->protocol_type != AB_PROTOCOL_LGX) {
+		pdebug(debug,"Metadata cache is only used for Logix tags.");
+		return PLCTAG_STATUS_OK;
+	}
+
+	rc = snprintf(key, sizeof(key), "%s:%d,%s,%s",
+					attr_get_str(attribs,"gateway",""),
+					attr_get_int(attribs,"gateway_port",AB_EIP_DEFAULT_PORT),
+					attr_get_str(attribs,"path",""),
+					attr_get_str(attribs,"name",""));
+
+	if(rc < 0 || rc >= (int)sizeof(key)) {
+		pdebug(debug,"Tag key is too long for the metadata cache.");
+		return PLCTAG_ERR_TOO_LONG;
+	}
+
+	for(cache = caches; cache; cache = cache->next) {
+		if(str_cmp(cache->file_name, file_name) == 0) {
+			break;
+		}
+	}
+
+	if(!cache) {
+		rc = tag_cache_create(&cache, file_name, debug);
+
+		if(rc != PLCTAG_STATUS_OK) {
+			pdebug(debug,"Unable to open metadata cache %s!",file_name);
+			return rc;
+		}
+
+		cache->next = caches;
+		caches = cache;
+	}
+
+	tag->metadata_cache_key = str_dup(key);
+
+	if(!tag->metadata_cache_key) {
+		/* the cache is kept open for the next tag. */
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	cache->refs++;
+	tag->metadata_cache = cache;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * tag_cache_close_unsafe
+ *
+ * Detach the tag from its cache file.  The file is unmapped when the
+ * last tag using it goes.  Call with the IO thread mutex held.
+ */
+int tag_cache_close_unsafe(ab_tag_p tag)
+{
+	ab_tag_cache_p cache = tag->metadata_cache;
+	ab_tag_cache_p *walker;
+
+	if(tag->metadata_cache_key) {
+		mem_free(tag->metadata_cache_key);
+		tag->metadata_cache_key = NULL;
+	}
+
+	if(!cache) {
+		return PLCTAG_STATUS_OK;
+	}
+
+	tag->metadata_cache = NULL;
+
+	cache->refs--;
+
+	if(cache->refs > 0) {
+		return PLCTAG_STATUS_OK;
+	}
+
+	for(walker = &caches; *walker; walker = &(*walker)->next) {
+		if(*walker == cache) {
+			*walker = cache->next;
+			break;
+		}
+	}
+
+	tag_cache_destroy(&cache);
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * tag_cache_lookup
+ *
+ * Copy the cached type info into the tag and return the fragment size
+ * the PLC used last time.  Returns PLCTAG_ERR_NOT_FOUND if there is no
+ * usable entry for the tag.
+ */
+int tag_cache_lookup(ab_tag_p tag, int *frag_size)
+{
+	ab_tag_cache_p cache = tag->metadata_cache;
+	struct tag_cache_entry_t *entry;
+	int rc = PLCTAG_ERR_NOT_FOUND;
+
+	if(!cache) {
+		return PLCTAG_ERR_NOT_FOUND;
+	}
+
+	critical_block(cache->mutex) {
+		if(file_map_lock(cache->map) != PLCTAG_STATUS_OK) {
+			pdebug(tag->debug,"Unable to lock metadata cache!");
+			break;
+		}
+
+		entry = tag_cache_find_unsafe(cache, tag->metadata_cache_key, tag_cache_hash(tag->metadata_cache_key));
+
+		/* the file may have been written by anyone, check it makes sense. */
+		if(entry
+			&& entry->size == tag->size
+			&& entry->frag_size > 0
+			&& entry->frag_size <= tag->size
+			&& entry->encoded_type_info_size > 0
+			&& entry->encoded_type_info_size <= MAX_TAG_TYPE_INFO) {
+			tag->encoded_type_info_size = entry->encoded_type_info_size;
+			mem_copy(tag->encoded_type_info, entry->encoded_type_info, entry->encoded_type_info_size);
+			*frag_size = entry->frag_size;
+
+			rc = PLCTAG_STATUS_OK;
+		}
+
+		file_map_unlock(cache->map);
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * tag_cache_store
+ *
+ * Write the tag's type info and fragment size to its entry.  A new
+ * entry takes the first free slot near its hash, or the home slot if
+ * they are all used.
+ */
+int tag_cache_store(ab_tag_p tag)
+{
+	ab_tag_cache_p cache = tag->metadata_cache;
+	struct tag_cache_entry_t *entry;
+	uint32_t hash;
+	int rc = PLCTAG_STATUS_OK;
+	int i;
+
+	if(!cache) {
+		return PLCTAG_STATUS_OK;
+	}
+
+	if(!tag->encoded_type_info_size || tag->num_read_requests < 1 || tag->read_req_sizes[0] <= 0) {
+		return PLCTAG_ERR_NO_DATA;
+	}
+
+	hash = tag_cache_hash(tag->metadata_cache_key);
+
+	critical_block(cache->mutex) {
+		rc = file_map_lock(cache->map);
+
+		if(rc != PLCTAG_STATUS_OK) {
+			pdebug(tag->debug,"Unable to lock metadata cache!");
+			break;
+		}
+
+		entry = tag_cache_find_unsafe(cache, tag->metadata_cache_key, hash);
+
+		if(!entry) {
+			entry = &cache->entries[hash % TAG_CACHE_ENTRIES];
+
+			for(i = 0; i < TAG_CACHE_PROBES; i++) {
+				struct tag_cache_entry_t *e = &cache->entries[(hash + i) % TAG_CACHE_ENTRIES];
+
+				if(e->valid != TAG_CACHE_ENTRY_VALID) {
+					entry = e;
+					break;
+				}
+			}
+		}
+
+		/* a process that dies part way through leaves the entry unused. */
+		entry->valid = 0;
+
+		entry->hash = hash;
+		entry->size = tag->size;
+		entry->frag_size = tag->read_req_sizes[0];
+		entry->encoded_type_info_size = tag->encoded_type_info_size;
+		mem_copy(entry->encoded_type_info, tag->encoded_type_info, tag->encoded_type_info_size);
+		str_copy(entry->key, tag->metadata_cache_key, TAG_CACHE_KEY_SIZE);
+
+		entry->valid = TAG_CACHE_ENTRY_VALID;
+
+		file_map_unlock(cache->map);
+	}
+
+	if(rc != PLCTAG_STATUS_OK) {
+		return rc;
+	}
+
+	tag->metadata_dirty = 0;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * tag_cache_remove
+ *
+ * Drop the tag's entry when the PLC says it is wrong.
+ */
+int tag_cache_remove(ab_tag_p tag)
+{
+	ab_tag_cache_p cache = tag->metadata_cache;
+	struct tag_cache_entry_t *entry;
+
+	if(!cache) {
+		return PLCTAG_STATUS_OK;
+	}
+
+	critical_block(cache->mutex) {
+		if(file_map_lock(cache->map) != PLCTAG_STATUS_OK) {
+			pdebug(tag->debug,"Unable to lock metadata cache!");
+			break;
+		}
+
+		entry = tag_cache_find_unsafe(cache, tag->metadata_cache_key, tag_cache_hash(tag->metadata_cache_key));
+
+		if(entry) {
+			entry->valid = 0;
+		}
+
+		file_map_unlock(cache->map);
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * tag_cache_create
+ *
+ * Map the cache file.  A new file is given a header.  A file with
+ * another layout may be in use by another version of the library, so
+ * it is not touched and PLCTAG_ERR_BAD_DATA is returned.
+ */
+static int tag_cache_create(ab_tag_cache_p *cache, const char *file_name, int debug)
+{
+	ab_tag_cache_p c;
+	struct tag_cache_header_t *header;
+	int size = (int)(sizeof(struct tag_cache_header_t) + TAG_CACHE_ENTRIES * sizeof(struct tag_cache_entry_t));
+	int rc;
+
+	*cache = AB_TAG_CACHE_NULL;
+
+	c = (ab_tag_cache_p)mem_alloc(sizeof(struct ab_tag_cache_t));
+
+	if(!c) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	c->file_name = str_dup(file_name);
+
+	if(!c->file_name) {
+		tag_cache_destroy(&c);
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	rc = mutex_create(&c->mutex);
+
+	if(rc != PLCTAG_STATUS_OK) {
+		tag_cache_destroy(&c);
+		return rc;
+	}
+
+	rc = file_map_open(&c->map, file_name, size);
+
+	if(rc != PLCTAG_STATUS_OK) {
+		tag_cache_destroy(&c);
+		return rc;
+	}
+
+	header = (struct tag_cache_header_t *)file_map_data(c->map);
+	c->entries = (struct tag_cache_entry_t *)(header + 1);
+
+	/* another process may be setting up the same file. */
+	rc = file_map_lock(c->map);
+
+	if(rc != PLCTAG_STATUS_OK) {
+		tag_cache_destroy(&c);
+		return rc;
+	}
+
+	/* a new file is all zeros.  The magic goes in last. */
+	if(!header->magic[0]) {
+		pdebug(debug,"Initializing metadata cache %s.",file_name);
+
+		mem_set(header, 0, size);
+		header->version = TAG_CACHE_VERSION;
+		header->num_entries = TAG_CACHE_ENTRIES;
+		header->entry_size = sizeof(struct tag_cache_entry_t);
+		mem_copy(header->magic, TAG_CACHE_MAGIC, sizeof(header->magic));
+	} else if(mem_cmp(header->magic, TAG_CACHE_MAGIC, sizeof(header->magic))
+		|| header->version != TAG_CACHE_VERSION
+		|| header->num_entries != TAG_CACHE_ENTRIES
+		|| header->entry_size != sizeof(struct tag_cache_entry_t)) {
+		pdebug(debug,"File %s is not a metadata cache this library can use!",file_name);
+		rc = PLCTAG_ERR_BAD_DATA;
+	}
+
+	file_map_unlock(c->map);
+
+	if(rc != PLCTAG_STATUS_OK) {
+		tag_cache_destroy(&c);
+		return rc;
+	}
+
+	*cache = c;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+static void tag_cache_destroy(ab_tag_cache_p *cache)
+{
+	ab_tag_cache_p c = *cache;
+
+	if(c->map) {
+		file_map_destroy(&c->map);
+	}
+
+	if(c->mutex) {
+		mutex_destroy(&c->mutex);
+	}
+
+	if(c->file_name) {
+		mem_free(c->file_name);
+	}
+
+	mem_free(c);
+
+	*cache = AB_TAG_CACHE_NULL;
+}
+
+
+
+static uint32_t tag_cache_hash(const char *key)
+{
+	uint32_t h = 2166136261u;
+
+	while(*key) {
+		h = (h ^ (unsigned char)*key++) * 16777619u;
+	}
+
+	return h;
+}
+
+
+
+/*
+ * tag_cache_find_unsafe
+ *
+ * Find the valid entry for the key.  Every slot in the probe range is
+ * checked because removed entries leave holes.  Call with the cache
+ * mutex and the file lock held.
+ */
+static struct tag_cache_entry_t *tag_cache_find_unsafe(ab_tag_cache_p cache, const char *key, uint32_t hash)
+{
+	int i;
+
+	for(i = 0; i < TAG_CACHE_PROBES; i++) {
+		struct tag_cache_entry_t *e = &cache->entries[(hash + i) % TAG_CACHE_ENTRIES];
+
+		if(e->valid == TAG_CACHE_ENTRY_VALID
+			&& e->hash == hash
+			&& mem_cmp(e->key, (void *)key, str_length(key) + 1) == 0) {
+			return e;
+		}
+	}
+
+	return NULL;
+}
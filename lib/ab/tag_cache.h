@@ -0,0 +1,34 @@
+/***************************************************************************
+ *   Copyright (C) 2012 by Process Control Engineers                       *
+ *   Author Kyle Hayes  kylehayes@processcontrolengineers.com              *
+ *                                                                         *
+ *   This program is free software; you can redistribute it and/or modify  *
+ *   it under the terms of the GNU Library General Public License as       *
+ *   published by the Free Software Foundation; either version 2 of the    *
+ *   License, or (at your option) any later version.                       *
+ *                                                                         *
+ *   This program is distributed in the hope that it will be useful,       *
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of        *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         *
+ *   GNU Library General Public License for more details.                  *
+ *                                                                         *
+ *   You should have received a copy of the GNU Library General Public     *
+ *   License along with this program; if not, write to the                 *
+ *   Free Software Foundation, Inc.,                                       *
+ *   59 Temple Place - Suite 330, Boston, MA  02111-1307, USA.             *
+ ***************************************************************************/
+
+
+#ifndef __LIBPLCTAG_AB_TAG_CACHE_H__
+#define __LIBPLCTAG_AB_TAG_CACHE_H__
+
+#include <ab/ab_defs.h>
+#include <util/attr.h>
+
+int tag_cache_open_unsafe(ab_tag_p tag, attr attribs);
+int tag_cache_close_unsafe(ab_tag_p tag);
+int tag_cache_lookup(ab_tag_p tag, int *frag_size);
+int tag_cache_store(ab_tag_p tag);
+int tag_cache_remove(ab_tag_p tag);
+
+#endif
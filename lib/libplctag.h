@@ -102,6 +102,15 @@ typedef struct plc_tag_t *plc_tag;
 
 
 
+/* events passed to tag callbacks */
+#define PLCTAG_EVENT_READ_COMPLETED		(1)
+#define PLCTAG_EVENT_WRITE_COMPLETED	(2)
+#define PLCTAG_EVENT_ABORTED			(3)
+
+typedef void (*plc_tag_callback_func)(plc_tag tag, int event, int status, void *userdata);
+
+
+
 
 /*
  * tag functions
@@ -121,6 +130,39 @@ typedef struct plc_tag_t *plc_tag;
  *
  * An opaque pointer is returned on success.  NULL is returned on allocation
  * failure.  Other failures will set the tag status.
+ *
+ * This does not wait for the connection to the PLC.  The tag status is
+ * PLCTAG_STATUS_PENDING until the connection is set up, or an error if
+ * that fails.  Reads and writes started before then are sent once the
+ * connection is ready.
+ *
+ * Tags created with auto_sync_read_ms=N are read by the library every N
+ * milliseconds.  With auto_sync_write_ms=N, changes made with the
+ * plc_tag_set_* functions are written out within about N milliseconds.
+ * The status and plc_tag_get_* functions use the data from the last
+ * scan while the next one is running.  Use plc_tag_register_callback()
+ * to find out when new data arrives.
+ *
+ * With timeout_ms=N, the library fails any read or write of the tag
+ * that is not done within N milliseconds with PLCTAG_ERR_TIMEOUT, even
+ * if nothing is waiting on it.  The default is to wait forever.
+ *
+ * priority=high|normal|bulk sets the order in which requests for tags
+ * on the same PLC are sent.  Within a priority, requests with earlier
+ * timeouts go first.  Bulk requests never use the last free request
+ * slot, so high and normal priority tags do not wait behind them.
+ *
+ * metadata_cache=/path/to/file keeps the type and fragment size a Logix
+ * tag finds out on its first read in that file, so the next run skips
+ * the discovery round trips.  The first replies are checked against
+ * the cached values and a stale entry is replaced.  Several programs
+ * can share one file.
+ *
+ * use_instance_id=1 addresses Logix tags by Symbol Object instance ID.
+ * The IO thread reads the PLC's whole symbol table once the tag's
+ * connection is open, which is a lot of traffic on a large controller.
+ * Until then, and if the PLC does not know the instance, tags are
+ * addressed by name.  By default tags are always addressed by name.
  */
 
 LIB_EXPORT plc_tag plc_tag_create(const char *attrib_str);
@@ -235,6 +277,96 @@ LIB_EXPORT int plc_tag_write(plc_tag tag, int timeout);
 
 
 
+/*
+ * plc_tag_read_many
+ *
+ * Start reads on all the passed tags at once so that the requests can
+ * be combined and pipelined, then wait for all of them to finish or for
+ * the timeout, in milliseconds, to pass.  Tags that are not done by then
+ * are aborted and get PLCTAG_ERR_TIMEOUT.
+ *
+ * If statuses is not NULL, it must have room for num_tags entries and
+ * gets the status of each tag.  The return value is PLCTAG_STATUS_OK if
+ * all the reads worked, otherwise the first error found.  If the timeout
+ * is zero, the reads are only started and PLCTAG_STATUS_PENDING is
+ * returned if any are still in progress.
+ */
+LIB_EXPORT int plc_tag_read_many(plc_tag *tags, int num_tags, int *statuses, int timeout);
+
+
+
+/*
+ * plc_tag_write_many
+ *
+ * The same as plc_tag_read_many, but for writes.
+ */
+LIB_EXPORT int plc_tag_write_many(plc_tag *tags, int num_tags, int *statuses, int timeout);
+
+
+
+
+/*
+ * plc_tag_register_callback
+ *
+ * Have the library call the passed function when a read or write on
+ * the tag finishes or is aborted.  The event is one of the
+ * PLCTAG_EVENT_* values and the status is that of the operation.
+ *
+ * The callback is usually called from an internal IO thread, but can
+ * be called from the thread that started or aborted the operation.
+ * It may start new reads and writes, but must not create or destroy
+ * tags.
+ *
+ * The function may be NULL if you only want the event file descriptor
+ * (see plc_tag_get_event_fd) to be signalled for this tag.
+ */
+LIB_EXPORT int plc_tag_register_callback(plc_tag tag, plc_tag_callback_func func, void *userdata);
+
+
+
+/*
+ * plc_tag_unregister_callback
+ *
+ * Stop notifications for the tag.
+ */
+LIB_EXPORT int plc_tag_unregister_callback(plc_tag tag);
+
+
+
+/*
+ * plc_tag_get_event_fd
+ *
+ * Get a file descriptor that becomes readable whenever an operation on
+ * a tag with a registered callback finishes.  Add it to your own
+ * poll/epoll loop, read it to clear it, then check your tags.  The
+ * descriptor is shared by all tags and belongs to the library.
+ *
+ * Returns the descriptor or a negative error.  This is only supported
+ * on platforms that have eventfd.
+ */
+LIB_EXPORT int plc_tag_get_event_fd(void);
+
+
+
+/*
+ * plc_tag_get_request_pool_stats
+ *
+ * The library keeps the requests and request buffers it is done with
+ * and reuses them.  This gets how many were reused (hits), how many
+ * had to be allocated (misses) and how many are in the pools now.
+ * Each array has PLCTAG_POOL_COUNT entries, one for the requests and
+ * one for each buffer size.  Any of the arrays can be NULL.
+ */
+#define PLCTAG_POOL_REQUESTS	(0)
+#define PLCTAG_POOL_SMALL_BUFS	(1)
+#define PLCTAG_POOL_LARGE_BUFS	(2)
+#define PLCTAG_POOL_COUNT		(3)
+
+LIB_EXPORT int plc_tag_get_request_pool_stats(uint64_t *hits, uint64_t *misses, int *num_free);
+
+
+
+
 /*
  * Tag data accessors.
  */
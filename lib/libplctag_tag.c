@@ -41,6 +41,20 @@
 
 
 
+/* made on request for applications that want to poll for tag callbacks. */
+static volatile int event_fd = -1;
+static volatile lock_t event_fd_lock = LOCK_INIT;
+
+
+static int start_op(plc_tag tag, int do_write);
+static void abort_auto_op_unsafe(plc_tag tag);
+static void mark_dirty(plc_tag tag);
+static void notify_tag(plc_tag tag, int event, int status);
+static int start_many(plc_tag *tags, int num_tags, int *statuses, int do_write);
+static int wait_many(plc_tag *tags, int num_tags, int *statuses, int timeout);
+
+
+
 /**************************************************************************
  ***************************  API Functions  ******************************
  **************************************************************************/
@@ -86,6 +100,24 @@ LIB_EXPORT plc_tag plc_tag_create(const char *attrib_str)
 		
 		tag->status = rc;
 	}
+
+	/* even failed tags need this so that the status can be checked. */
+	if(tag && mutex_create(&tag->api_mut) != PLCTAG_STATUS_OK) {
+		tag->status = PLCTAG_ERR_MUTEX_INIT;
+	}
+
+	/* auto sync tags have no data until the first scan finishes. */
+	if(tag) {
+		tag->last_status = PLCTAG_STATUS_PENDING;
+	}
+
+	/*
+	 * the tag is ready for use, so background work like auto sync
+	 * scans can start now.
+	 */
+	if(tag && tag->status == PLCTAG_STATUS_OK && tag->vtable && tag->vtable->start) {
+		tag->status = tag->vtable->start(tag);
+	}
 	
     /*
      * Release memory for attributes
@@ -177,6 +209,8 @@ LIB_EXPORT int plc_tag_unlock(plc_tag tag)
 LIB_EXPORT int plc_tag_abort(plc_tag tag)
 {
 	int debug = tag->debug;
+	int rc;
+	int notify = 0;
 
     pdebug(debug, "Starting.");
 
@@ -192,8 +226,24 @@ LIB_EXPORT int plc_tag_abort(plc_tag tag)
         return PLCTAG_ERR_NOT_IMPLEMENTED;
     }
 
+    rc = tag->status;
+
     /* this may be synchronous. */
-    return tag->vtable->abort(tag);
+    critical_block(tag->api_mut) {
+    	rc = tag->vtable->abort(tag);
+
+    	if(tag->pending_event) {
+    		tag->pending_event = 0;
+    		tag->auto_op = 0;
+    		notify = tag->notify;
+    	}
+    }
+
+    if(notify) {
+    	notify_tag(tag, PLCTAG_EVENT_ABORTED, PLCTAG_ERR_ABORT);
+    }
+
+    return rc;
 }
 
 
@@ -222,6 +272,9 @@ LIB_EXPORT int plc_tag_destroy(plc_tag tag)
     if(!tag)
         return PLCTAG_STATUS_OK;
 
+    /* no more callbacks */
+    plc_tag_unregister_callback(tag);
+
     /* clear the mutex */
 	if(tag->mut) {
 		mutex_destroy(&tag->mut);
@@ -276,7 +329,7 @@ LIB_EXPORT int plc_tag_read(plc_tag tag, int timeout)
     /*tag->status = PLCTAG_STATUS_OK;*/
 
     /* the protocol implementation does not do the timeout. */
-    rc = tag->vtable->read(tag);
+    rc = start_op(tag, 0);
 
     /* if error, return now */
     if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK) {
@@ -284,38 +337,19 @@ LIB_EXPORT int plc_tag_read(plc_tag tag, int timeout)
     }
 
     /*
-     * if there is a timeout, then loop until we get
+     * if there is a timeout, then wait until we get
      * an error or we timeout.
      */
-    if(timeout) {
-    	uint64_t timeout_time = timeout + time_ms();
+    if(timeout && rc == PLCTAG_STATUS_PENDING) {
     	uint64_t start_time = time_ms();
-
-    	while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
-			rc = plc_tag_status(tag);
-
-			/*
-			 * terminate early and do not wait again if the
-			 * IO is done.
-			 */
-			if(rc != PLCTAG_STATUS_PENDING) {
-				break;
-			}
-
-			sleep_ms(5); /* MAGIC */
-    	}
+    	int status = rc;
 
     	/*
-    	 * if we dropped out of the while loop but the status is
-    	 * still pending, then we timed out.
-    	 *
-    	 * Abort the operation and set the status to show the timeout.
+    	 * sleep until the IO thread finishes requests rather than
+    	 * polling.  This aborts the operation and sets the status
+    	 * to PLCTAG_ERR_TIMEOUT if it does not finish in time.
     	 */
-    	if(rc == PLCTAG_STATUS_PENDING) {
-    		plc_tag_abort(tag);
-    		tag->status = PLCTAG_ERR_TIMEOUT;
-    		rc = PLCTAG_ERR_TIMEOUT;
-    	}
+    	rc = wait_many(&tag, 1, &status, timeout);
 
     	pdebug(debug,"elapsed time %ldms",(time_ms()-start_time));
     }
@@ -341,6 +375,10 @@ LIB_EXPORT int plc_tag_read(plc_tag tag, int timeout)
  */
 LIB_EXPORT int plc_tag_status(plc_tag tag)
 {
+	int rc;
+	int event = 0;
+	int notify = 0;
+
     /*pdebug("Starting.");*/
 
     if(!tag)
@@ -360,7 +398,34 @@ LIB_EXPORT int plc_tag_status(plc_tag tag)
     /* clear the status */
     /*tag->status = PLCTAG_STATUS_OK;*/
 
-    return tag->vtable->status(tag);
+    rc = tag->status;
+
+    critical_block(tag->api_mut) {
+    	rc = tag->vtable->status(tag);
+
+    	/* tell the callback once when the operation finishes. */
+    	if(rc != PLCTAG_STATUS_PENDING && tag->pending_event) {
+    		event = tag->pending_event;
+    		tag->pending_event = 0;
+    		tag->auto_op = 0;
+    		tag->last_status = rc;
+    		notify = tag->notify;
+    	}
+
+    	/* background scans do not hide the data from the last one. */
+    	if(rc == PLCTAG_STATUS_PENDING && tag->auto_op) {
+    		rc = tag->last_status;
+    	} else if(rc == PLCTAG_STATUS_OK && tag->auto_sync_read_ms > 0 && tag->last_status == PLCTAG_STATUS_PENDING) {
+    		/* there is no data until the first scan finishes. */
+    		rc = PLCTAG_STATUS_PENDING;
+    	}
+    }
+
+    if(notify) {
+    	notify_tag(tag, event, rc);
+    }
+
+    return rc;
 }
 
 
@@ -400,44 +465,21 @@ LIB_EXPORT int plc_tag_write(plc_tag tag, int timeout)
     }
 
     /* the protocol implementation does not do the timeout. */
-    rc = tag->vtable->write(tag);
+    rc = start_op(tag, 1);
 
     /* if error, return now */
     if(rc != PLCTAG_STATUS_PENDING && rc != PLCTAG_STATUS_OK)
         return rc;
 
     /*
-     * if there is a timeout, then loop until we get
+     * if there is a timeout, then wait until we get
      * an error or we timeout.
      */
-    if(timeout) {
-    	uint64_t timeout_time = timeout + time_ms();
-
-    	while(rc == PLCTAG_STATUS_PENDING && timeout_time > time_ms()) {
-			rc = plc_tag_status(tag);
+    if(timeout && rc == PLCTAG_STATUS_PENDING) {
+    	int status = rc;
 
-			/*
-			 * terminate early and do not wait again if the
-			 * IO is done.
-			 */
-			if(rc != PLCTAG_STATUS_PENDING) {
-				break;
-			}
-
-			sleep_ms(5); /* MAGIC */
-    	}
-
-    	/*
-    	 * if we dropped out of the while loop but the status is
-    	 * still pending, then we timed out.
-    	 *
-    	 * Abort the operation and set the status to show the timeout.
-    	 */
-    	if(rc == PLCTAG_STATUS_PENDING) {
-    		plc_tag_abort(tag);
-    		tag->status = PLCTAG_ERR_TIMEOUT;
-    		rc = PLCTAG_ERR_TIMEOUT;
-    	}
+    	/* same as for reads, wait for the IO thread instead of polling. */
+    	rc = wait_many(&tag, 1, &status, timeout);
     }
 
     pdebug(debug, "Done");
@@ -449,6 +491,196 @@ LIB_EXPORT int plc_tag_write(plc_tag tag, int timeout)
 
 
 
+/*
+ * plc_tag_read_many()
+ *
+ * Start reads on all the tags before waiting on any of them.  That
+ * lets the IO layer pack and pipeline the requests.
+ */
+
+LIB_EXPORT int plc_tag_read_many(plc_tag *tags, int num_tags, int *statuses, int timeout)
+{
+	int *tmp_statuses = NULL;
+	int rc;
+
+	if(!tags || num_tags <= 0) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	if(!statuses) {
+		tmp_statuses = (int *)mem_alloc(num_tags * sizeof(int));
+
+		if(!tmp_statuses) {
+			return PLCTAG_ERR_NO_MEM;
+		}
+
+		statuses = tmp_statuses;
+	}
+
+	rc = start_many(tags, num_tags, statuses, 0);
+
+	if(rc == PLCTAG_STATUS_PENDING && timeout) {
+		rc = wait_many(tags, num_tags, statuses, timeout);
+	}
+
+	if(tmp_statuses) {
+		mem_free(tmp_statuses);
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * plc_tag_write_many()
+ *
+ * The write version of plc_tag_read_many().
+ */
+
+LIB_EXPORT int plc_tag_write_many(plc_tag *tags, int num_tags, int *statuses, int timeout)
+{
+	int *tmp_statuses = NULL;
+	int rc;
+
+	if(!tags || num_tags <= 0) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	if(!statuses) {
+		tmp_statuses = (int *)mem_alloc(num_tags * sizeof(int));
+
+		if(!tmp_statuses) {
+			return PLCTAG_ERR_NO_MEM;
+		}
+
+		statuses = tmp_statuses;
+	}
+
+	rc = start_many(tags, num_tags, statuses, 1);
+
+	if(rc == PLCTAG_STATUS_PENDING && timeout) {
+		rc = wait_many(tags, num_tags, statuses, timeout);
+	}
+
+	if(tmp_statuses) {
+		mem_free(tmp_statuses);
+	}
+
+	return rc;
+}
+
+
+
+
+
+/*
+ * plc_tag_register_callback()
+ *
+ * Set up the function to call when reads and writes on the tag
+ * finish.  This replaces any previous callback.
+ */
+
+LIB_EXPORT int plc_tag_register_callback(plc_tag tag, plc_tag_callback_func func, void *userdata)
+{
+	int rc = PLCTAG_ERR_NULL_PTR;
+
+	if(!tag) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	critical_block(tag->api_mut) {
+		tag->callback = func;
+		tag->userdata = userdata;
+		tag->notify = 1;
+
+		rc = PLCTAG_STATUS_OK;
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * plc_tag_unregister_callback()
+ *
+ * A callback that is already running in another thread may still
+ * finish after this returns.
+ */
+
+LIB_EXPORT int plc_tag_unregister_callback(plc_tag tag)
+{
+	int rc = PLCTAG_ERR_NULL_PTR;
+
+	if(!tag) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	critical_block(tag->api_mut) {
+		tag->notify = 0;
+		tag->callback = NULL;
+		tag->userdata = NULL;
+
+		rc = PLCTAG_STATUS_OK;
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * plc_tag_get_request_pool_stats()
+ *
+ * The pools belong to the protocol code.
+ */
+
+LIB_EXPORT int plc_tag_get_request_pool_stats(uint64_t *hits, uint64_t *misses, int *num_free)
+{
+	return ab_request_pool_stats(hits, misses, num_free);
+}
+
+
+
+/*
+ * plc_tag_get_event_fd()
+ *
+ * Make the shared notification descriptor the first time through.
+ */
+
+LIB_EXPORT int plc_tag_get_event_fd(void)
+{
+	int rc = PLCTAG_STATUS_OK;
+
+	if(event_fd >= 0) {
+		return event_fd;
+	}
+
+	while(!lock_acquire((lock_t *)&event_fd_lock)) {
+		sleep_ms(1);
+	}
+
+	if(event_fd < 0) {
+		int fd = -1;
+
+		rc = notify_fd_create(&fd);
+
+		if(rc == PLCTAG_STATUS_OK) {
+			event_fd = fd;
+		}
+	}
+
+	lock_release((lock_t *)&event_fd_lock);
+
+	return (rc == PLCTAG_STATUS_OK ? event_fd : rc);
+}
+
+
+
+
+
+
 /*
  * Tag data accessors.
  */
@@ -526,6 +758,9 @@ LIB_EXPORT int plc_tag_set_uint32(plc_tag t, int offset, uint32_t val)
 		return rc;
 	}
 
+	/* the new value needs to go out and must not be overwritten by a scan. */
+	mark_dirty(t);
+
 	/* is there data? */
 	if(!t->data) {
 		t->status = PLCTAG_ERR_NULL_PTR;
@@ -626,6 +861,9 @@ LIB_EXPORT int plc_tag_set_int32(plc_tag t, int offset, int32_t ival)
 		return rc;
 	}
 
+	/* the new value needs to go out and must not be overwritten by a scan. */
+	mark_dirty(t);
+
 	/* is there data? */
 	if(!t->data) {
 		t->status = PLCTAG_ERR_NULL_PTR;
@@ -721,6 +959,9 @@ LIB_EXPORT int plc_tag_set_uint16(plc_tag t, int offset, uint16_t val)
 		return rc;
 	}
 
+	/* the new value needs to go out and must not be overwritten by a scan. */
+	mark_dirty(t);
+
 	/* is there data? */
 	if(!t->data) {
 		t->status = PLCTAG_ERR_NULL_PTR;
@@ -815,6 +1056,9 @@ LIB_EXPORT int plc_tag_set_int16(plc_tag t, int offset, int16_t ival)
 		return rc;
 	}
 
+	/* the new value needs to go out and must not be overwritten by a scan. */
+	mark_dirty(t);
+
 	/* is there data? */
 	if(!t->data) {
 		t->status = PLCTAG_ERR_NULL_PTR;
@@ -900,6 +1144,9 @@ LIB_EXPORT int plc_tag_set_uint8(plc_tag t, int offset, uint8_t val)
 		return rc;
 	}
 
+	/* the new value needs to go out and must not be overwritten by a scan. */
+	mark_dirty(t);
+
 	/* is there data? */
 	if(!t->data) {
 		t->status = PLCTAG_ERR_NULL_PTR;
@@ -979,6 +1226,9 @@ LIB_EXPORT int plc_tag_set_int8(plc_tag t, int offset, int8_t val)
 		return rc;
 	}
 
+	/* the new value needs to go out and must not be overwritten by a scan. */
+	mark_dirty(t);
+
 	/* is there data? */
 	if(!t->data) {
 		t->status = PLCTAG_ERR_NULL_PTR;
@@ -1082,6 +1332,9 @@ LIB_EXPORT int plc_tag_set_float32(plc_tag t, int offset, float fval)
 		return rc;
 	}
 
+	/* the new value needs to go out and must not be overwritten by a scan. */
+	mark_dirty(t);
+
 	/* is there data? */
 	if(!t->data) {
 		t->status = PLCTAG_ERR_NULL_PTR;
@@ -1114,3 +1367,279 @@ LIB_EXPORT int plc_tag_set_float32(plc_tag t, int offset, float fval)
 
 
 
+
+
+
+
+/**************************************************************************
+ ***************************  Helper Functions  ***************************
+ **************************************************************************/
+
+
+/*
+ * start_op
+ *
+ * Start a read or write through the vtable.  If it does not finish
+ * right away, remember what to tell the callback when it does.
+ */
+static int start_op(plc_tag tag, int do_write)
+{
+	int event = (do_write ? PLCTAG_EVENT_WRITE_COMPLETED : PLCTAG_EVENT_READ_COMPLETED);
+	int notify = 0;
+	int rc = tag->status;
+
+	critical_block(tag->api_mut) {
+		/* the application's request replaces any background scan. */
+		abort_auto_op_unsafe(tag);
+
+		rc = (do_write ? tag->vtable->write(tag) : tag->vtable->read(tag));
+
+		if(rc == PLCTAG_STATUS_PENDING) {
+			tag->pending_event = event;
+		} else {
+			notify = tag->notify;
+		}
+
+		/* a write by the application sends any changes. */
+		if(do_write) {
+			tag->auto_dirty = 0;
+		}
+	}
+
+	if(notify) {
+		notify_tag(tag, event, rc);
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * abort_auto_op_unsafe
+ *
+ * Stop a background scan so that something else can use the tag.
+ * The callback is not told since the application did not start it.
+ *
+ * You must hold the tag's api_mut.
+ */
+static void abort_auto_op_unsafe(plc_tag tag)
+{
+	if(tag->auto_op && tag->pending_event) {
+		tag->vtable->abort(tag);
+		tag->pending_event = 0;
+		tag->auto_op = 0;
+	}
+}
+
+
+
+/*
+ * mark_dirty
+ *
+ * Note that the data of an auto sync write tag changed.  A scan read
+ * that finishes now would overwrite the new data, so it is stopped.
+ */
+static void mark_dirty(plc_tag tag)
+{
+	if(!tag->auto_sync_write_ms) {
+		return;
+	}
+
+	critical_block(tag->api_mut) {
+		if(tag->pending_event == PLCTAG_EVENT_READ_COMPLETED) {
+			abort_auto_op_unsafe(tag);
+		}
+
+		tag->auto_dirty = 1;
+	}
+}
+
+
+
+/*
+ * tag_auto_sync
+ *
+ * Start the background scan of a tag.  Nothing is done if another
+ * operation is still running on the tag.
+ */
+int tag_auto_sync(plc_tag tag, int do_read)
+{
+	int event = 0;
+	int notify = 0;
+	int rc = PLCTAG_STATUS_OK;
+
+	if(!tag || !tag->vtable || !tag->vtable->read || !tag->vtable->write) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	critical_block(tag->api_mut) {
+		if(tag->pending_event) {
+			rc = PLCTAG_STATUS_PENDING;
+			break;
+		}
+
+		if(tag->auto_dirty) {
+			event = PLCTAG_EVENT_WRITE_COMPLETED;
+			tag->auto_dirty = 0;
+			rc = tag->vtable->write(tag);
+		} else if(do_read) {
+			event = PLCTAG_EVENT_READ_COMPLETED;
+			rc = tag->vtable->read(tag);
+		} else {
+			break;
+		}
+
+		if(rc == PLCTAG_STATUS_PENDING) {
+			tag->pending_event = event;
+			tag->auto_op = 1;
+		} else {
+			tag->last_status = rc;
+			notify = tag->notify;
+		}
+	}
+
+	if(notify) {
+		notify_tag(tag, event, rc);
+	}
+
+	return rc;
+}
+
+
+
+/*
+ * notify_tag
+ *
+ * Call the tag's callback and signal the event fd if there is one.
+ * This must be called without the tag's api_mut held so that the
+ * callback can use the tag.
+ */
+static void notify_tag(plc_tag tag, int event, int status)
+{
+	plc_tag_callback_func callback = NULL;
+	void *userdata = NULL;
+
+	critical_block(tag->api_mut) {
+		callback = tag->callback;
+		userdata = tag->userdata;
+	}
+
+	if(callback) {
+		callback(tag, event, status, userdata);
+	}
+
+	if(event_fd >= 0) {
+		notify_fd_signal(event_fd);
+	}
+}
+
+
+
+/*
+ * start_many
+ *
+ * Start a read or write on each tag.  The status of each is put in
+ * statuses.  Returns PLCTAG_STATUS_PENDING if any are still going,
+ * otherwise the first error or PLCTAG_STATUS_OK.
+ */
+static int start_many(plc_tag *tags, int num_tags, int *statuses, int do_write)
+{
+	int result = PLCTAG_STATUS_OK;
+	int pending = 0;
+	int i;
+
+	for(i = 0; i < num_tags; i++) {
+		plc_tag tag = tags[i];
+
+		if(!tag) {
+			statuses[i] = PLCTAG_ERR_NULL_PTR;
+		} else if(!tag->vtable || (do_write ? !tag->vtable->write : !tag->vtable->read)) {
+			tag->status = PLCTAG_ERR_NOT_IMPLEMENTED;
+			statuses[i] = PLCTAG_ERR_NOT_IMPLEMENTED;
+		} else {
+			statuses[i] = start_op(tag, do_write);
+		}
+
+		if(statuses[i] == PLCTAG_STATUS_PENDING) {
+			pending++;
+		} else if(statuses[i] != PLCTAG_STATUS_OK && result == PLCTAG_STATUS_OK) {
+			result = statuses[i];
+		}
+	}
+
+	return (pending ? PLCTAG_STATUS_PENDING : result);
+}
+
+
+
+/*
+ * wait_many
+ *
+ * Wait until none of the tags are pending or the timeout passes.  This
+ * sleeps on the IO event of the first pending tag, so it wakes up when
+ * requests on that tag's session finish and then checks all the tags
+ * again.  Tags that are still pending at the end are aborted.
+ */
+static int wait_many(plc_tag *tags, int num_tags, int *statuses, int timeout)
+{
+	int64_t timeout_time = time_ms() + timeout;
+	int64_t now;
+	int result = PLCTAG_STATUS_OK;
+	int pending;
+	int i;
+
+	while(1) {
+		event_p io_event = NULL;
+		uint64_t count = 0;
+
+		pending = 0;
+
+		for(i = 0; i < num_tags; i++) {
+			if(statuses[i] != PLCTAG_STATUS_PENDING) {
+				continue;
+			}
+
+			/*
+			 * until one is found that is still pending, get the count first
+			 * so that we do not miss anything that finishes while we check.
+			 */
+			if(!pending) {
+				io_event = tags[i]->io_event;
+				count = (io_event ? event_count(io_event) : 0);
+			}
+
+			statuses[i] = plc_tag_status(tags[i]);
+
+			if(statuses[i] == PLCTAG_STATUS_PENDING) {
+				pending++;
+			}
+		}
+
+		now = time_ms();
+
+		if(!pending || now >= timeout_time) {
+			break;
+		}
+
+		if(io_event) {
+			event_wait(io_event, count, (int)(timeout_time - now));
+		} else {
+			sleep_ms(1);
+		}
+	}
+
+	for(i = 0; i < num_tags; i++) {
+		if(statuses[i] == PLCTAG_STATUS_PENDING) {
+			plc_tag_abort(tags[i]);
+			tags[i]->status = PLCTAG_ERR_TIMEOUT;
+			statuses[i] = PLCTAG_ERR_TIMEOUT;
+		}
+
+		if(statuses[i] != PLCTAG_STATUS_OK && result == PLCTAG_STATUS_OK) {
+			result = statuses[i];
+		}
+	}
+
+	return result;
+}
@@ -68,6 +68,7 @@
 typedef int (*tag_abort_func)(plc_tag tag);
 typedef int (*tag_destroy_func)(plc_tag tag);
 typedef int (*tag_read_func)(plc_tag);
+typedef int (*tag_start_func)(plc_tag tag);
 typedef int (*tag_status_func)(plc_tag);
 typedef int (*tag_write_func)(plc_tag tag);
 
@@ -76,6 +77,7 @@ struct tag_vtable_t {
 	tag_abort_func 			abort;
 	tag_destroy_func 		destroy;
 	tag_read_func			read;
+	tag_start_func			start;
 	tag_status_func 		status;
 	tag_write_func 			write;
 };
@@ -88,10 +90,34 @@ typedef struct tag_vtable_t *tag_vtable_p;
  * by the protocol-specific implementations.
  *
  * The base type only has a vtable for operations.
+ *
+ * api_mut serializes calls into the vtable so that an IO thread
+ * can check the status of a tag with a callback while the
+ * application uses the same tag.
+ *
+ * io_event is set by the protocol to an event that is signalled when
+ * requests for the tag may have finished.  Threads waiting on the tag
+ * sleep on it.
+ *
+ * The auto_sync fields are set by the protocol for tags that are
+ * scanned in the background.  auto_op is set while a background
+ * read or write is running and last_status is what the application
+ * sees during it.
  */
 
 #define TAG_BASE_STRUCT tag_vtable_p vtable; \
 						mutex_p mut; \
+						mutex_p api_mut; \
+						plc_tag_callback_func callback; \
+						void *userdata; \
+						int notify; \
+						int pending_event; \
+						event_p io_event; \
+						int last_status; \
+						int auto_sync_read_ms; \
+						int auto_sync_write_ms; \
+						int auto_op; \
+						int auto_dirty; \
 						int status; \
 						int endian; \
 						int debug; \
@@ -104,6 +130,15 @@ struct plc_tag_t {
 
 
 
+/*
+ * Protocol IO threads call this when an auto sync tag is due.  The
+ * tag is written if it was changed, otherwise it is read if do_read
+ * is set.
+ */
+extern int tag_auto_sync(plc_tag tag, int do_read);
+
+
+
 
 
 #endif
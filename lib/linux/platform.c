@@ -41,11 +41,19 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
 #include <fcntl.h>
 #include <time.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include "libplctag.h"
 
@@ -120,6 +128,31 @@ extern void mem_copy(void *d1, void *d2, int size)
 
 
 
+/*
+ * mem_move
+ *
+ * like mem_copy, but the two areas may overlap.
+ */
+extern void mem_move(void *d1, void *d2, int size)
+{
+	memmove(d1, d2, size);
+}
+
+
+
+/*
+ * mem_cmp
+ *
+ * compare the passed number of bytes of memory.  Returns zero if they are
+ * the same, like memcmp.
+ */
+extern int mem_cmp(void *d1, void *d2, int size)
+{
+	return memcmp(d1, d2, size);
+}
+
+
+
 
 /***************************************************************************
  ******************************* Strings ***********************************
@@ -550,6 +583,28 @@ extern int thread_destroy(thread_p *t)
 }
 
 
+/*
+ * thread_detach
+ *
+ * Let the thread run on its own.  Its resources are released when it
+ * exits and the thread struct is freed now.
+ */
+extern int thread_detach(thread_p *t)
+{
+	if(!t || ! *t) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	pthread_detach((*t)->p_thread);
+
+	mem_free(*t);
+
+	*t = NULL;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
 
 
 
@@ -593,18 +648,83 @@ extern void lock_release(lock_t *lock)
 }
 
 
+
+/*
+ * atomic_ptr_exchange
+ *
+ * Store val and return what was there before.
+ */
+extern void *atomic_ptr_exchange(void * volatile *ptr, void *val)
+{
+	void *old_val;
+
+	do {
+		old_val = *ptr;
+	} while(!__sync_bool_compare_and_swap(ptr, old_val, val));
+
+	return old_val;
+}
+
+
+
+/*
+ * atomic_ptr_cas
+ *
+ * Store new_val only if the pointer still holds old_val.  Returns
+ * non-zero if it was stored.
+ */
+extern int atomic_ptr_cas(void * volatile *ptr, void *old_val, void *new_val)
+{
+	return __sync_bool_compare_and_swap(ptr, old_val, new_val);
+}
+
+
+
+/*
+ * atomic_int_add
+ *
+ * Add val to the counter and return the new value.
+ */
+extern int atomic_int_add(volatile int *ptr, int val)
+{
+	return __sync_add_and_fetch(ptr, val);
+}
+
+
 /***************************************************************************
  ******************************* Sockets ***********************************
  **************************************************************************/
 
+#define MAX_IPS (8)
+
+/*
+ * Host names are looked up on a separate thread so that connecting to
+ * a gateway never blocks the caller.  The lookup is shared by the
+ * thread and the socket, whichever lets go of it last frees it.
+ */
+struct sock_resolve_t {
+	lock_t lock;
+	int refs;
+	int done;
+	int num_ips;
+	in_addr_t ips[MAX_IPS];
+	char host[];
+};
+
 struct sock_t {
 	int fd;
 	int port;
 	int is_open;
+
+	/* non-blocking connect state */
+	struct sock_resolve_t *resolve;
+	in_addr_t ips[MAX_IPS];
+	int num_ips;
+	int next_ip;
+	int connecting;
 };
 
 
-#define MAX_IPS (8)
 
 extern int socket_create(sock_p *s)
 {
@@ -626,139 +746,277 @@ extern int socket_create(sock_p *s)
 }
 
 
-extern int socket_connect_tcp(sock_p s, const char *host, int port)
+
+static void socket_resolve_release(struct sock_resolve_t *r)
 {
-	in_addr_t ips[MAX_IPS];
+	int refs;
+
+	while(!lock_acquire(&r->lock)) {
+		/* spin */
+	}
+
+	refs = --r->refs;
+
+	lock_release(&r->lock);
+
+	if(!refs) {
+		mem_free(r);
+	}
+}
+
+
+
+static void *socket_resolve_func(void *arg)
+{
+	struct sock_resolve_t *r = (struct sock_resolve_t *)arg;
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	struct addrinfo *ai;
 	int num_ips = 0;
-	struct sockaddr_in gw_addr;
-    int sock_opt = 1;
-    int i = 0;
-    int done = 0;
-	int fd;
-    int flags;
-    struct timeval timeout; /* used for timing out connections etc. */
 
-	/*pdebug("Starting.");*/
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
 
-    /* Open a socket for communication with the gateway. */
-    fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if(!getaddrinfo(r->host, NULL, &hints, &res)) {
+		for(ai = res; ai && num_ips < MAX_IPS; ai = ai->ai_next) {
+			r->ips[num_ips++] = ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr;
+		}
 
-    /* check for errors */
-    if(fd < 0) {
-        /*pdebug("Socket creation failed, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
+		freeaddrinfo(res);
+	}
+
+	while(!lock_acquire(&r->lock)) {
+		/* spin */
+	}
+
+	r->num_ips = num_ips;
+	r->done = 1;
+
+	lock_release(&r->lock);
+
+	socket_resolve_release(r);
+
+	return NULL;
+}
+
+
+
+/*
+ * socket_connect_tcp_start
+ *
+ * Start connecting to the host without blocking.  Numeric addresses
+ * are used directly, names are looked up on a separate thread.  Call
+ * socket_connect_tcp_check() until it stops returning
+ * PLCTAG_STATUS_PENDING.
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port)
+{
+	struct sock_resolve_t *r;
+	thread_p t = NULL;
+	int host_len;
+
+	if(!s || !host) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	s->port = port;
+	s->num_ips = 0;
+	s->next_ip = 0;
+
+	/* try a numeric IP address conversion first. */
+	if(inet_pton(AF_INET, host, (struct in_addr *)s->ips) > 0) {
+		/*pdebug("Found numeric IP address: %s",host);*/
+		s->num_ips = 1;
+		return PLCTAG_STATUS_PENDING;
+	}
+
+	/* not numeric, look it up in the background. */
+	host_len = str_length(host);
+
+	r = (struct sock_resolve_t *)mem_alloc(sizeof(struct sock_resolve_t) + host_len + 1);
+
+	if(!r) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	mem_copy(r->host, (void *)host, host_len);
+	r->host[host_len] = 0;
+	r->refs = 2;
+
+	if(thread_create(&t, socket_resolve_func, 32*1024, r) != PLCTAG_STATUS_OK) {
+		mem_free(t);
+		mem_free(r);
+		return PLCTAG_ERR_THREAD_CREATE;
+	}
+
+	thread_detach(&t);
+
+	s->resolve = r;
+
+	return PLCTAG_STATUS_PENDING;
+}
+
+
+
+static int socket_open_fd(void)
+{
+	int fd;
+	int flags;
+	int sock_opt = 1;
+
+	/* Open a socket for communication with the gateway. */
+	fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if(fd < 0) {
+		return -1;
+	}
 
-    /* set up our socket to allow reuse if we crash suddenly. */
-    sock_opt = 1;
+	/* set up our socket to allow reuse if we crash suddenly. */
+	sock_opt = 1;
 
-    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
+	if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
 		close(fd);
-        /*pdebug("Error setting socket reuse option, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
+		return -1;
+	}
 
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+	/*
+	 * requests are gathered into as few writes as possible, so send
+	 * each write right away rather than waiting on outstanding ACKs.
+	 */
+	sock_opt = 1;
 
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&sock_opt, sizeof(sock_opt))) {
 		close(fd);
-        /*pdebug("Error setting socket receive timeout option, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
+		return -1;
+	}
+
+	/* the socket is non-blocking from the start, connect() included. */
+	flags = fcntl(fd,F_GETFL,0);
 
-    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
+	if(flags < 0 || fcntl(fd,F_SETFL,flags | O_NONBLOCK) < 0) {
 		close(fd);
-        /*pdebug("Error setting socket set timeout option, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
+		return -1;
+	}
 
-    /* figure out what address we are connecting to. */
+	return fd;
+}
 
-    /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
-        /*pdebug("Found numeric IP address: %s",host);*/
-        num_ips = 1;
-    } else {
-        struct hostent *h=NULL;
 
-    	/* not numeric, try DNS */
-        h = gethostbyname(host);
 
-        if(!h) {
-            /*pdebug("Call to gethostbyname() failed, errno: %d!", errno);*/
-            return PLCTAG_ERR_OPEN;
-        }
+/*
+ * socket_connect_tcp_check
+ *
+ * Move a connect started by socket_connect_tcp_start() along.  This
+ * never blocks.  Returns PLCTAG_STATUS_PENDING while the name lookup
+ * or the TCP handshake is still going, PLCTAG_STATUS_OK once the
+ * socket is connected and PLCTAG_ERR_OPEN if none of the host's
+ * addresses could be reached.
+ */
+extern int socket_connect_tcp_check(sock_p s)
+{
+	struct sockaddr_in gw_addr;
 
-        /* copy the IP list */
-        for(num_ips = 0; h->h_addr_list[num_ips] && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips] = *((in_addr_t *)h->h_addr_list[num_ips]);
-        }
+	if(!s) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
 
-        free(h);
-    }
+	if(s->is_open && !s->connecting) {
+		return PLCTAG_STATUS_OK;
+	}
 
+	/* wait for the name lookup. */
+	if(s->resolve) {
+		struct sock_resolve_t *r = s->resolve;
+		int done;
 
-    /* now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
+		while(!lock_acquire(&r->lock)) {
+			/* spin */
+		}
 
-    i = 0;
-    done = 0;
+		done = r->done;
 
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons(port);
+		if(done) {
+			s->num_ips = r->num_ips;
+			mem_copy(s->ips, r->ips, sizeof(s->ips));
+		}
 
-    do {
-    	int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i];
+		lock_release(&r->lock);
 
-        /*pdebug("Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));*/
+		if(!done) {
+			return PLCTAG_STATUS_PENDING;
+		}
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+		s->resolve = NULL;
+		socket_resolve_release(r);
 
-        if( rc == 0) {
-            /*pdebug("Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));*/
-            done = 1;
-        } else {
-            /*pdebug("Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);*/
-            i++;
-        }
-    } while(!done && i < num_ips);
+		if(!s->num_ips) {
+			/*pdebug("Unable to look up host!");*/
+			return PLCTAG_ERR_OPEN;
+		}
+	}
 
-    if(!done) {
-		close(fd);
-        /*pdebug("Unable to connect to any gateway host IP address!");*/
-        return PLCTAG_ERR_OPEN;
-    }
+	/* is the current attempt finished? */
+	if(s->connecting) {
+		struct pollfd pfd;
+		int err = 0;
+		socklen_t err_len = sizeof(err);
 
+		pfd.fd = s->fd;
+		pfd.events = POLLOUT;
+		pfd.revents = 0;
 
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect(). */
-    flags=fcntl(fd,F_GETFL,0);
+		if(poll(&pfd, 1, 0) == 0) {
+			return PLCTAG_STATUS_PENDING;
+		}
 
-    if(flags<0) {
-      /*pdebug("Error getting socket options, errno: %d", errno);*/
-      close(fd);
-      return PLCTAG_ERR_OPEN;
-    }
+		s->connecting = 0;
 
-    flags |= O_NONBLOCK;
+		if(!getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &err_len) && !err) {
+			/*pdebug("Attempt to connect succeeded.");*/
+			return PLCTAG_STATUS_OK;
+		}
 
-    if(fcntl(fd,F_SETFL,flags)<0) {
-        /*pdebug("Error setting socket to non-blocking, errno: %d", errno);*/
-        close(fd);
-        return PLCTAG_ERR_OPEN;
-    }
+		/* try the next address. */
+		close(s->fd);
+		s->is_open = 0;
+		s->next_ip++;
+	}
 
-    /* save the values */
-	s->fd = fd;
-	s->port = port;
+	memset((void *)&gw_addr,0, sizeof(gw_addr));
+	gw_addr.sin_family = AF_INET ;
+	gw_addr.sin_port = htons(s->port);
 
-	return PLCTAG_STATUS_OK;
+	/* try each IP until we run out or one is under way. */
+	while(s->next_ip < s->num_ips) {
+		int fd = socket_open_fd();
+
+		if(fd < 0) {
+			return PLCTAG_ERR_OPEN;
+		}
+
+		s->fd = fd;
+		s->is_open = 1;
+
+		gw_addr.sin_addr.s_addr = s->ips[s->next_ip];
+
+		if(!connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr))) {
+			return PLCTAG_STATUS_OK;
+		}
+
+		if(errno == EINPROGRESS) {
+			s->connecting = 1;
+			return PLCTAG_STATUS_PENDING;
+		}
+
+		/*pdebug("Attempt to connect failed, errno: %d",errno);*/
+		close(fd);
+		s->is_open = 0;
+		s->next_ip++;
+	}
+
+	/*pdebug("Unable to connect to any gateway host IP address!");*/
+	return PLCTAG_ERR_OPEN;
 }
 
 
@@ -811,11 +1069,82 @@ extern int socket_write(sock_p s, uint8_t *buf, int size)
 
 
 
+/*
+ * socket_write_many
+ *
+ * Write several buffers with one system call.  Returns the total
+ * number of bytes written, which may stop part way through any of
+ * the buffers.
+ */
+extern int socket_write_many(sock_p s, uint8_t **bufs, int *sizes, int count)
+{
+    struct iovec iov[SOCKET_MAX_WRITE_BUFS];
+    int i;
+    ssize_t rc;
+
+    if(!s || !bufs || !sizes) {
+    	return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(count > SOCKET_MAX_WRITE_BUFS) {
+    	count = SOCKET_MAX_WRITE_BUFS;
+    }
+
+    for(i = 0; i < count; i++) {
+    	iov[i].iov_base = bufs[i];
+    	iov[i].iov_len = (size_t)sizes[i];
+    }
+
+    /* The socket is non-blocking. */
+    rc = writev(s->fd, iov, count);
+
+    if(rc < 0) {
+    	if(errno == EAGAIN || errno == EWOULDBLOCK) {
+    		return PLCTAG_ERR_NO_DATA;
+    	} else {
+    		return PLCTAG_ERR_WRITE;
+    	}
+    }
+
+    return (int)rc;
+}
+
+
+/*
+ * socket_cork
+ *
+ * Hold back partial segments while corked so that a run of writes
+ * goes out in full segments.  Uncorking sends whatever is left.
+ */
+extern int socket_cork(sock_p s, int cork)
+{
+    int sock_opt = (cork ? 1 : 0);
+
+    if(!s) {
+    	return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(setsockopt(s->fd, IPPROTO_TCP, TCP_CORK, (char*)&sock_opt, sizeof(sock_opt))) {
+    	return PLCTAG_ERR_WRITE;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 extern int socket_close(sock_p s)
 {
 	if(!s)
 		return PLCTAG_ERR_NULL_PTR;
 
+	if(!s->is_open) {
+		return PLCTAG_STATUS_OK;
+	}
+
+	s->is_open = 0;
+	s->connecting = 0;
+
 	return close(s->fd);
 }
 
@@ -827,6 +1156,11 @@ extern int socket_destroy(sock_p *s)
 
 	socket_close(*s);
 
+	/* a name lookup still running cleans up after itself. */
+	if((*s)->resolve) {
+		socket_resolve_release((*s)->resolve);
+	}
+
 	mem_free(*s);
 
 	*s = 0;
@@ -840,6 +1174,572 @@ extern int socket_destroy(sock_p *s)
 
 
 
+/***************************************************************************
+ ******************************* Pollers ***********************************
+ **************************************************************************/
+
+/*
+ * A poller wraps an epoll instance and an eventfd.  The IO thread sleeps
+ * in poller_wait() until one of the registered sockets becomes readable
+ * (or writable, if asked for) or until another thread calls poller_wake().
+ *
+ * Sockets are watched level-triggered, so any data left unread in the
+ * kernel buffer will cause the next poller_wait() to return immediately.
+ */
+
+struct poller_t {
+	int epoll_fd;
+	int wake_fd;
+};
+
+
+extern int poller_create(poller_p *p)
+{
+	struct epoll_event ev;
+
+	if(!p) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	*p = (poller_p)mem_alloc(sizeof(struct poller_t));
+
+	if(! *p) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	(*p)->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if((*p)->epoll_fd < 0) {
+		mem_free(*p);
+		*p = NULL;
+		return PLCTAG_ERR_CREATE;
+	}
+
+	(*p)->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if((*p)->wake_fd < 0) {
+		close((*p)->epoll_fd);
+		mem_free(*p);
+		*p = NULL;
+		return PLCTAG_ERR_CREATE;
+	}
+
+	/* the wake up fd uses a NULL data pointer so we can tell it apart. */
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+
+	if(epoll_ctl((*p)->epoll_fd, EPOLL_CTL_ADD, (*p)->wake_fd, &ev)) {
+		close((*p)->wake_fd);
+		close((*p)->epoll_fd);
+		mem_free(*p);
+		*p = NULL;
+		return PLCTAG_ERR_CREATE;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * poller_add_socket
+ *
+ * Start watching the socket for incoming data.
+ */
+extern int poller_add_socket(poller_p p, sock_p s)
+{
+	struct epoll_event ev;
+
+	if(!p || !s) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = s;
+
+	if(epoll_ctl(p->epoll_fd, EPOLL_CTL_ADD, s->fd, &ev)) {
+		return PLCTAG_ERR_CREATE;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * poller_watch_write
+ *
+ * Turn on or off interest in the socket becoming writable.  Only
+ * turn this on when there is data that could not be written, otherwise
+ * the poller will wake up constantly.
+ */
+extern int poller_watch_write(poller_p p, sock_p s, int watch_write)
+{
+	struct epoll_event ev;
+
+	if(!p || !s) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | (watch_write ? EPOLLOUT : 0);
+	ev.data.ptr = s;
+
+	if(epoll_ctl(p->epoll_fd, EPOLL_CTL_MOD, s->fd, &ev)) {
+		return PLCTAG_ERR_SET;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int poller_remove_socket(poller_p p, sock_p s)
+{
+	struct epoll_event ev;
+
+	if(!p || !s) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	/* older kernels want a non-NULL event pointer even for a delete. */
+	memset(&ev, 0, sizeof(ev));
+
+	if(epoll_ctl(p->epoll_fd, EPOLL_CTL_DEL, s->fd, &ev)) {
+		return PLCTAG_ERR_NOT_FOUND;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * poller_wake
+ *
+ * Make a thread sleeping in poller_wait() return.  This is safe to
+ * call from any thread and does not block.
+ */
+extern int poller_wake(poller_p p)
+{
+	uint64_t one = 1;
+
+	if(!p) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	/* if the counter is already non-zero the waiter will wake anyway. */
+	if(write(p->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		return PLCTAG_ERR_WRITE;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+#define POLLER_MAX_EVENTS (64)
+
+/*
+ * poller_wait
+ *
+ * Sleep until a watched socket is ready, poller_wake() is called or
+ * timeout_ms passes.  A negative timeout waits forever.  Returns the
+ * number of ready events (zero on timeout) or an error.
+ */
+extern int poller_wait(poller_p p, int timeout_ms)
+{
+	struct epoll_event events[POLLER_MAX_EVENTS];
+	int rc;
+	int i;
+
+	if(!p) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	rc = epoll_wait(p->epoll_fd, events, POLLER_MAX_EVENTS, timeout_ms);
+
+	if(rc < 0) {
+		/* a signal is not an error, just a spurious wake up. */
+		return (errno == EINTR) ? 0 : PLCTAG_ERR_READ;
+	}
+
+	/* reset the wake up counter if it fired. */
+	for(i = 0; i < rc; i++) {
+		if(events[i].data.ptr == NULL) {
+			uint64_t count;
+
+			if(read(p->wake_fd, &count, sizeof(count)) < 0) {
+				/* nothing to do, someone else drained it. */
+			}
+		}
+	}
+
+	return rc;
+}
+
+
+
+extern int poller_destroy(poller_p *p)
+{
+	if(!p || !*p) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	close((*p)->wake_fd);
+	close((*p)->epoll_fd);
+
+	mem_free(*p);
+
+	*p = NULL;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+
+/***************************************************************************
+ ******************************** Events ***********************************
+ **************************************************************************/
+
+/*
+ * An event is a counter that goes up each time it is signalled.  A
+ * waiter reads the count, checks whatever it is waiting for and then
+ * waits for the count to change.  Because the count is read before
+ * checking, a signal that comes in between is never lost.
+ */
+
+struct event_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	uint64_t count;
+};
+
+
+extern int event_create(event_p *e)
+{
+	pthread_condattr_t attr;
+
+	*e = (event_p)mem_alloc(sizeof(struct event_t));
+
+	if(! *e) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	if(pthread_mutex_init(&((*e)->mutex), NULL)) {
+		mem_free(*e);
+		*e = NULL;
+		return PLCTAG_ERR_MUTEX_INIT;
+	}
+
+	/* timeouts must not jump with the wall clock. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+	if(pthread_cond_init(&((*e)->cond), &attr)) {
+		pthread_condattr_destroy(&attr);
+		pthread_mutex_destroy(&((*e)->mutex));
+		mem_free(*e);
+		*e = NULL;
+		return PLCTAG_ERR_CREATE;
+	}
+
+	pthread_condattr_destroy(&attr);
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * event_count
+ *
+ * Get the current count to pass to event_wait() later.
+ */
+extern uint64_t event_count(event_p e)
+{
+	uint64_t count;
+
+	pthread_mutex_lock(&(e->mutex));
+	count = e->count;
+	pthread_mutex_unlock(&(e->mutex));
+
+	return count;
+}
+
+
+
+/*
+ * event_signal
+ *
+ * Bump the count and wake up all waiters.
+ */
+extern int event_signal(event_p e)
+{
+	if(!e) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	pthread_mutex_lock(&(e->mutex));
+	e->count++;
+	pthread_cond_broadcast(&(e->cond));
+	pthread_mutex_unlock(&(e->mutex));
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+/*
+ * event_wait
+ *
+ * Wait until the count is different from the passed one or the timeout,
+ * in milliseconds, passes.  Returns PLCTAG_ERR_TIMEOUT if the count did
+ * not change.
+ */
+extern int event_wait(event_p e, uint64_t count, int timeout_ms)
+{
+	struct timespec deadline;
+	int rc = PLCTAG_STATUS_OK;
+
+	if(!e) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+
+	if(deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&(e->mutex));
+
+	while(e->count == count) {
+		if(pthread_cond_timedwait(&(e->cond), &(e->mutex), &deadline) == ETIMEDOUT) {
+			break;
+		}
+	}
+
+	if(e->count == count) {
+		rc = PLCTAG_ERR_TIMEOUT;
+	}
+
+	pthread_mutex_unlock(&(e->mutex));
+
+	return rc;
+}
+
+
+
+extern int event_destroy(event_p *e)
+{
+	if(!e || ! *e) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	pthread_cond_destroy(&((*e)->cond));
+	pthread_mutex_destroy(&((*e)->mutex));
+
+	mem_free(*e);
+
+	*e = NULL;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+/*
+ * notify_fd_create
+ *
+ * Make an eventfd that the application can wait on in its own
+ * poll loop.  Each signal makes it readable until it is read.
+ */
+extern int notify_fd_create(int *fd)
+{
+	*fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(*fd < 0) {
+		return PLCTAG_ERR_CREATE;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int notify_fd_signal(int fd)
+{
+	uint64_t one = 1;
+
+	/* if the counter is full, it is readable anyway. */
+	if(write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+		return PLCTAG_ERR_WRITE;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int notify_fd_destroy(int fd)
+{
+	close(fd);
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+/***************************************************************************
+ ****************************** File Mapping *******************************
+ **************************************************************************/
+
+
+struct file_map_t {
+	int fd;
+	int size;
+	void *data;
+};
+
+
+/*
+ * file_map_open
+ *
+ * Map the file at path into memory, creating it or growing it to size
+ * bytes first if needed.  New bytes read as zero.  Changes are written
+ * back to the file and seen by other processes mapping it.
+ */
+extern int file_map_open(file_map_p *m, const char *path, int size)
+{
+	struct stat st;
+	file_map_p map;
+
+	*m = NULL;
+
+	map = (file_map_p)mem_alloc(sizeof(struct file_map_t));
+
+	if(!map) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	map->size = size;
+	map->data = MAP_FAILED;
+
+	map->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if(map->fd < 0) {
+		mem_free(map);
+		return PLCTAG_ERR_OPEN;
+	}
+
+	if(fstat(map->fd, &st) < 0 || (st.st_size < size && ftruncate(map->fd, size) < 0)) {
+		close(map->fd);
+		mem_free(map);
+		return PLCTAG_ERR_OPEN;
+	}
+
+	map->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, map->fd, 0);
+
+	if(map->data == MAP_FAILED) {
+		close(map->fd);
+		mem_free(map);
+		return PLCTAG_ERR_OPEN;
+	}
+
+	*m = map;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern void *file_map_data(file_map_p m)
+{
+	if(!m) {
+		return NULL;
+	}
+
+	return m->data;
+}
+
+
+
+/*
+ * file_map_lock
+ *
+ * Take an exclusive lock on the mapped file.  It only keeps other
+ * processes out, threads in this process need their own mutex.  This
+ * blocks until the lock is free.
+ */
+extern int file_map_lock(file_map_p m)
+{
+	if(!m) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	while(flock(m->fd, LOCK_EX) < 0) {
+		if(errno != EINTR) {
+			return PLCTAG_ERR_MUTEX_LOCK;
+		}
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int file_map_unlock(file_map_p m)
+{
+	if(!m) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	if(flock(m->fd, LOCK_UN) < 0) {
+		return PLCTAG_ERR_MUTEX_UNLOCK;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int file_map_destroy(file_map_p *m)
+{
+	if(!m || !*m) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	munmap((*m)->data, (*m)->size);
+	close((*m)->fd);
+
+	mem_free(*m);
+	*m = NULL;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
 /***************************************************************************
  ********************************* Endian **********************************
  **************************************************************************/
@@ -141,6 +141,31 @@ extern void mem_copy(void *d1, void *d2, int size)
 
 
 
+/*
+ * mem_move
+ *
+ * like mem_copy, but the two areas may overlap.
+ */
+extern void mem_move(void *d1, void *d2, int size)
+{
+	memmove(d1, d2, size);
+}
+
+
+
+/*
+ * mem_cmp
+ *
+ * compare the passed number of bytes of memory.  Returns zero if they are
+ * the same, like memcmp.
+ */
+extern int mem_cmp(void *d1, void *d2, int size)
+{
+	return memcmp(d1, d2, size);
+}
+
+
+
 
 
 
@@ -612,6 +637,29 @@ extern int thread_destroy(thread_p *t)
 
 
 
+/*
+ * thread_detach
+ *
+ * Let the thread run on its own.  Its resources are released when it
+ * exits and the thread struct is freed now.
+ */
+extern int thread_detach(thread_p *t)
+{
+	if(!t || ! *t) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	CloseHandle((*t)->h_thread);
+
+	mem_free(*t);
+
+	*t = NULL;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
 
 
 /***************************************************************************
@@ -655,6 +703,43 @@ extern void lock_release(lock_t *lock)
 
 
 
+/*
+ * atomic_ptr_exchange
+ *
+ * Store val and return what was there before.
+ */
+extern void *atomic_ptr_exchange(void * volatile *ptr, void *val)
+{
+	return InterlockedExchangePointer((PVOID volatile *)ptr, val);
+}
+
+
+
+/*
+ * atomic_ptr_cas
+ *
+ * Store new_val only if the pointer still holds old_val.  Returns
+ * non-zero if it was stored.
+ */
+extern int atomic_ptr_cas(void * volatile *ptr, void *old_val, void *new_val)
+{
+	return InterlockedCompareExchangePointer((PVOID volatile *)ptr, new_val, old_val) == old_val;
+}
+
+
+
+/*
+ * atomic_int_add
+ *
+ * Add val to the counter and return the new value.
+ */
+extern int atomic_int_add(volatile int *ptr, int val)
+{
+	return (int)InterlockedExchangeAdd((volatile LONG *)ptr, (LONG)val) + val;
+}
+
+
+
 
 
 
@@ -666,14 +751,34 @@ extern void lock_release(lock_t *lock)
  **************************************************************************/
 
 
+#define MAX_IPS (8)
+
+/*
+ * Host names are looked up on a separate thread so that connecting to
+ * a gateway never blocks the caller.  The lookup is shared by the
+ * thread and the socket, whichever lets go of it last frees it.
+ */
+struct sock_resolve_t {
+	lock_t lock;
+	int refs;
+	int done;
+	int num_ips;
+	IN_ADDR ips[MAX_IPS];
+	char host[1];
+};
+
 struct sock_t {
 	int fd;
 	int port;
 	int is_open;
-};
-
 
-#define MAX_IPS (8)
+	/* non-blocking connect state */
+	struct sock_resolve_t *resolve;
+	IN_ADDR ips[MAX_IPS];
+	int num_ips;
+	int next_ip;
+	int connecting;
+};
 
 
 /* windows needs to have the Winsock library initialized 
@@ -723,132 +828,278 @@ extern int socket_create(sock_p *s)
 
 
 
-extern int socket_connect_tcp(sock_p s, const char *host, int port)
+static void socket_resolve_release(struct sock_resolve_t *r)
 {
-	IN_ADDR ips[MAX_IPS];
+	int refs;
+
+	while(!lock_acquire(&r->lock)) {
+		/* spin */
+	}
+
+	refs = --r->refs;
+
+	lock_release(&r->lock);
+
+	if(!refs) {
+		mem_free(r);
+	}
+}
+
+
+
+static DWORD __stdcall socket_resolve_func(LPVOID arg)
+{
+	struct sock_resolve_t *r = (struct sock_resolve_t *)arg;
+	struct addrinfo hints;
+	struct addrinfo *res = NULL;
+	struct addrinfo *ai;
 	int num_ips = 0;
-	struct sockaddr_in gw_addr;
-    int sock_opt = 1;
-	u_long non_blocking=1;
-    int i = 0;
-    int done = 0;
-	int fd;
-    struct timeval timeout; /* used for timing out connections etc. */
 
-	/*pdebug("Starting.");*/
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	if(!getaddrinfo(r->host, NULL, &hints, &res)) {
+		for(ai = res; ai && num_ips < MAX_IPS; ai = ai->ai_next) {
+			r->ips[num_ips++] = ((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+		}
 
-    /* Open a socket for communication with the gateway. */
-    fd = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
+		freeaddrinfo(res);
+	}
 
-    /* check for errors */
-    if(fd < 0) {
-        /*pdebug("Socket creation failed, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
+	while(!lock_acquire(&r->lock)) {
+		/* spin */
+	}
+
+	r->num_ips = num_ips;
+	r->done = 1;
+
+	lock_release(&r->lock);
+
+	socket_resolve_release(r);
+
+	return 0;
+}
+
+
+
+/*
+ * socket_connect_tcp_start
+ *
+ * Start connecting to the host without blocking.  Numeric addresses
+ * are used directly, names are looked up on a separate thread.  Call
+ * socket_connect_tcp_check() until it stops returning
+ * PLCTAG_STATUS_PENDING.
+ */
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port)
+{
+	struct sock_resolve_t *r;
+	thread_p t = NULL;
+	int host_len;
+
+	if(!s || !host) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	s->port = port;
+	s->num_ips = 0;
+	s->next_ip = 0;
+
+	/* try a numeric IP address conversion first. */
+	if(inet_pton(AF_INET, host, (struct in_addr *)s->ips) > 0) {
+		/*pdebug("Found numeric IP address: %s",host);*/
+		s->num_ips = 1;
+		return PLCTAG_STATUS_PENDING;
+	}
+
+	/* not numeric, look it up in the background. */
+	host_len = str_length(host);
+
+	r = (struct sock_resolve_t *)mem_alloc(sizeof(struct sock_resolve_t) + host_len);
+
+	if(!r) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	mem_copy(r->host, (void *)host, host_len);
+	r->host[host_len] = 0;
+	r->refs = 2;
+
+	if(thread_create(&t, socket_resolve_func, 32*1024, r) != PLCTAG_STATUS_OK) {
+		mem_free(t);
+		mem_free(r);
+		return PLCTAG_ERR_THREAD_CREATE;
+	}
+
+	thread_detach(&t);
+
+	s->resolve = r;
+
+	return PLCTAG_STATUS_PENDING;
+}
+
+
+
+static int socket_open_fd(void)
+{
+	int fd;
+	int sock_opt = 1;
+	u_long non_blocking=1;
+
+	/* Open a socket for communication with the gateway. */
+	fd = socket(AF_INET, SOCK_STREAM, 0/*IPPROTO_TCP*/);
+
+	if(fd < 0) {
+		return -1;
+	}
 
-    /* set up our socket to allow reuse if we crash suddenly. */
-    sock_opt = 1;
+	/* set up our socket to allow reuse if we crash suddenly. */
+	sock_opt = 1;
 
-    if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
+	if(setsockopt(fd,SOL_SOCKET,SO_REUSEADDR,(char*)&sock_opt,sizeof(sock_opt))) {
 		closesocket(fd);
-        /*pdebug("Error setting socket reuse option, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
+		return -1;
+	}
 
-    timeout.tv_sec = 10;
-    timeout.tv_usec = 0;
+	/*
+	 * requests are gathered into as few writes as possible, so send
+	 * each write right away rather than waiting on outstanding ACKs.
+	 */
+	sock_opt = 1;
 
-    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char*)&timeout, sizeof(timeout))) {
+	if(setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char*)&sock_opt, sizeof(sock_opt))) {
 		closesocket(fd);
-        /*pdebug("Error setting socket receive timeout option, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
+		return -1;
+	}
 
-    if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, (char*)&timeout, sizeof(timeout))) {
+	/* the socket is non-blocking from the start, connect() included. */
+	if(ioctlsocket(fd,FIONBIO,&non_blocking)) {
 		closesocket(fd);
-        /*pdebug("Error setting socket set timeout option, errno: %d",errno);*/
-        return PLCTAG_ERR_OPEN;
-    }
+		return -1;
+	}
+
+	return fd;
+}
 
-    /* figure out what address we are connecting to. */
 
-    /* try a numeric IP address conversion first. */
-    if(inet_pton(AF_INET,host,(struct in_addr *)ips) > 0) {
-        /*pdebug("Found numeric IP address: %s",host);*/
-        num_ips = 1;
-    } else {
-        struct hostent *h=NULL;
 
-    	/* not numeric, try DNS */
-        h = gethostbyname(host);
+/*
+ * socket_connect_tcp_check
+ *
+ * Move a connect started by socket_connect_tcp_start() along.  This
+ * never blocks.  Returns PLCTAG_STATUS_PENDING while the name lookup
+ * or the TCP handshake is still going, PLCTAG_STATUS_OK once the
+ * socket is connected and PLCTAG_ERR_OPEN if none of the host's
+ * addresses could be reached.
+ */
+extern int socket_connect_tcp_check(sock_p s)
+{
+	struct sockaddr_in gw_addr;
 
-        if(!h) {
-            /*pdebug("Call to gethostbyname() failed, errno: %d!", errno);*/
-            return PLCTAG_ERR_OPEN;
-        }
+	if(!s) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
 
-        /* copy the IP list */
-        for(num_ips = 0; h->h_addr_list[num_ips] && num_ips < MAX_IPS; num_ips++) {
-            ips[num_ips] = *((IN_ADDR *)h->h_addr_list[num_ips]);
-        }
+	if(s->is_open && !s->connecting) {
+		return PLCTAG_STATUS_OK;
+	}
 
-        free(h);
-    }
+	/* wait for the name lookup. */
+	if(s->resolve) {
+		struct sock_resolve_t *r = s->resolve;
+		int done;
 
+		while(!lock_acquire(&r->lock)) {
+			/* spin */
+		}
 
-    /* now try to connect to the remote gateway.  We may need to
-     * try several of the IPs we have.
-     */
+		done = r->done;
 
-    i = 0;
-    done = 0;
+		if(done) {
+			s->num_ips = r->num_ips;
+			mem_copy(s->ips, r->ips, sizeof(s->ips));
+		}
 
-    memset((void *)&gw_addr,0, sizeof(gw_addr));
-    gw_addr.sin_family = AF_INET ;
-    gw_addr.sin_port = htons(port);
+		lock_release(&r->lock);
 
-    do {
-    	int rc;
-        /* try each IP until we run out or get a connection. */
-        gw_addr.sin_addr.s_addr = ips[i].S_un.S_addr;
+		if(!done) {
+			return PLCTAG_STATUS_PENDING;
+		}
 
-        /*pdebug("Attempting to connect to %s",inet_ntoa(*((struct in_addr *)&ips[i])));*/
+		s->resolve = NULL;
+		socket_resolve_release(r);
 
-        rc = connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr));
+		if(!s->num_ips) {
+			/*pdebug("Unable to look up host!");*/
+			return PLCTAG_ERR_OPEN;
+		}
+	}
 
-        if( rc == 0) {
-            /*pdebug("Attempt to connect to %s succeeded.",inet_ntoa(*((struct in_addr *)&ips[i])));*/
-            done = 1;
-        } else {
-            /*pdebug("Attempt to connect to %s failed, errno: %d",inet_ntoa(*((struct in_addr *)&ips[i])),errno);*/
-            i++;
-        }
-    } while(!done && i < num_ips);
+	/* is the current attempt finished? */
+	if(s->connecting) {
+		fd_set write_set;
+		fd_set err_set;
+		struct timeval no_wait;
 
-    if(!done) {
-		closesocket(fd);
-        /*pdebug("Unable to connect to any gateway host IP address!");*/
-        return PLCTAG_ERR_OPEN;
-    }
+		FD_ZERO(&write_set);
+		FD_ZERO(&err_set);
+		FD_SET(s->fd, &write_set);
+		FD_SET(s->fd, &err_set);
 
+		no_wait.tv_sec = 0;
+		no_wait.tv_usec = 0;
 
-    /* FIXME
-     * connect() is a little easier to handle in blocking mode, for now
-     * we make the socket non-blocking here, after connect(). 
-	 */
-    
-    if(ioctlsocket(fd,FIONBIO,&non_blocking)) {
-      /*pdebug("Error getting socket options, errno: %d", errno);*/
-      closesocket(fd);
-      return PLCTAG_ERR_OPEN;
-    }
+		if(select(0, NULL, &write_set, &err_set, &no_wait) <= 0) {
+			return PLCTAG_STATUS_PENDING;
+		}
 
-    /* save the values */
-	s->fd = fd;
-	s->port = port;
-	s->is_open = 1;
+		s->connecting = 0;
 
-	return PLCTAG_STATUS_OK;
+		if(FD_ISSET(s->fd, &write_set) && !FD_ISSET(s->fd, &err_set)) {
+			/*pdebug("Attempt to connect succeeded.");*/
+			return PLCTAG_STATUS_OK;
+		}
+
+		/* try the next address. */
+		closesocket(s->fd);
+		s->is_open = 0;
+		s->next_ip++;
+	}
+
+	memset((void *)&gw_addr,0, sizeof(gw_addr));
+	gw_addr.sin_family = AF_INET ;
+	gw_addr.sin_port = htons(s->port);
+
+	/* try each IP until we run out or one is under way. */
+	while(s->next_ip < s->num_ips) {
+		int fd = socket_open_fd();
+
+		if(fd < 0) {
+			return PLCTAG_ERR_OPEN;
+		}
+
+		s->fd = fd;
+		s->is_open = 1;
+
+		gw_addr.sin_addr.s_addr = s->ips[s->next_ip].S_un.S_addr;
+
+		if(!connect(fd,(struct sockaddr *)&gw_addr,sizeof(gw_addr))) {
+			return PLCTAG_STATUS_OK;
+		}
+
+		if(WSAGetLastError() == WSAEWOULDBLOCK) {
+			s->connecting = 1;
+			return PLCTAG_STATUS_PENDING;
+		}
+
+		/*pdebug("Attempt to connect failed, errno: %d",errno);*/
+		closesocket(fd);
+		s->is_open = 0;
+		s->next_ip++;
+	}
+
+	/*pdebug("Unable to connect to any gateway host IP address!");*/
+	return PLCTAG_ERR_OPEN;
 }
 
 
@@ -911,6 +1162,70 @@ extern int socket_write(sock_p s, uint8_t *buf, int size)
 
 
 
+/*
+ * socket_write_many
+ *
+ * Write several buffers with one call to WSASend().  Returns the total
+ * number of bytes written, which may stop part way through any of
+ * the buffers.
+ */
+extern int socket_write_many(sock_p s, uint8_t **bufs, int *sizes, int count)
+{
+    WSABUF wsa_bufs[SOCKET_MAX_WRITE_BUFS];
+    DWORD sent = 0;
+    int i;
+    int rc;
+	int err;
+
+    if(!s || !bufs || !sizes) {
+    	return PLCTAG_ERR_NULL_PTR;
+    }
+
+    if(count > SOCKET_MAX_WRITE_BUFS) {
+    	count = SOCKET_MAX_WRITE_BUFS;
+    }
+
+    for(i = 0; i < count; i++) {
+    	wsa_bufs[i].buf = (char *)bufs[i];
+    	wsa_bufs[i].len = (ULONG)sizes[i];
+    }
+
+    /* The socket is non-blocking. */
+    rc = WSASend(s->fd, wsa_bufs, (DWORD)count, &sent, 0, NULL, NULL);
+
+    if(rc == SOCKET_ERROR) {
+		err=WSAGetLastError();
+    	if(err == WSAEWOULDBLOCK) {
+    		return PLCTAG_ERR_NO_DATA;
+    	} else {
+    		return PLCTAG_ERR_WRITE;
+    	}
+    }
+
+    return (int)sent;
+}
+
+
+/*
+ * socket_cork
+ *
+ * Windows has no TCP_CORK.  The gathered write in socket_write_many()
+ * already hands the stack everything at once, so there is nothing
+ * to do here.
+ */
+extern int socket_cork(sock_p s, int cork)
+{
+	(void)cork;
+
+    if(!s) {
+    	return PLCTAG_ERR_NULL_PTR;
+    }
+
+    return PLCTAG_STATUS_OK;
+}
+
+
+
 extern int socket_close(sock_p s)
 {
 	if(!s)
@@ -920,12 +1235,14 @@ extern int socket_close(sock_p s)
 		return PLCTAG_STATUS_OK;
 	}
 
-	if(!closesocket(s->fd)) {
+	s->is_open = 0;
+	s->connecting = 0;
+
+	if(closesocket(s->fd)) {
 		return PLCTAG_ERR_CLOSE;
 	}
 
 	s->fd = 0;
-	s->is_open = 0;
 
 	return PLCTAG_STATUS_OK;
 }
@@ -938,6 +1255,11 @@ extern int socket_destroy(sock_p *s)
 
 	socket_close(*s);
 
+	/* a name lookup still running cleans up after itself. */
+	if((*s)->resolve) {
+		socket_resolve_release((*s)->resolve);
+	}
+
 	mem_free(*s);
 
 	*s = 0;
@@ -951,6 +1273,533 @@ extern int socket_destroy(sock_p *s)
 
 
 
+/***************************************************************************
+ ******************************* Pollers ***********************************
+ **************************************************************************/
+
+/*
+ * Windows does not have epoll or eventfd.  We use select() over the
+ * registered sockets plus a UDP socket bound to the loopback interface.
+ * poller_wake() sends a datagram to that socket to wake up the waiter.
+ *
+ * This is limited to FD_SETSIZE sockets per poller.
+ */
+
+struct poller_t {
+	CRITICAL_SECTION lock;
+	SOCKET wake_sock;
+	struct sockaddr_in wake_addr;
+	int num_socks;
+	SOCKET socks[FD_SETSIZE - 1];
+	int watch_write[FD_SETSIZE - 1];
+};
+
+
+extern int poller_create(poller_p *p)
+{
+	int addr_len = sizeof(struct sockaddr_in);
+	u_long non_blocking=1;
+
+	if(!p) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	if(!socket_lib_init()) {
+		return PLCTAG_ERR_CREATE;
+	}
+
+	*p = (poller_p)mem_alloc(sizeof(struct poller_t));
+
+	if(! *p) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	(*p)->wake_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+	if((*p)->wake_sock == INVALID_SOCKET) {
+		mem_free(*p);
+		*p = NULL;
+		return PLCTAG_ERR_CREATE;
+	}
+
+	memset((void *)&(*p)->wake_addr, 0, sizeof((*p)->wake_addr));
+	(*p)->wake_addr.sin_family = AF_INET;
+	(*p)->wake_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	(*p)->wake_addr.sin_port = 0;
+
+	/* let the OS pick the port, then find out what it was. */
+	if(bind((*p)->wake_sock, (struct sockaddr *)&(*p)->wake_addr, sizeof((*p)->wake_addr))
+	   || getsockname((*p)->wake_sock, (struct sockaddr *)&(*p)->wake_addr, &addr_len)
+	   || ioctlsocket((*p)->wake_sock,FIONBIO,&non_blocking)) {
+		closesocket((*p)->wake_sock);
+		mem_free(*p);
+		*p = NULL;
+		return PLCTAG_ERR_CREATE;
+	}
+
+	InitializeCriticalSection(&((*p)->lock));
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int poller_add_socket(poller_p p, sock_p s)
+{
+	int rc = PLCTAG_STATUS_OK;
+
+	if(!p || !s) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	EnterCriticalSection(&p->lock);
+
+	if(p->num_socks < (FD_SETSIZE - 1)) {
+		p->socks[p->num_socks] = (SOCKET)s->fd;
+		p->watch_write[p->num_socks] = 0;
+		p->num_socks++;
+	} else {
+		rc = PLCTAG_ERR_TOO_LONG;
+	}
+
+	LeaveCriticalSection(&p->lock);
+
+	return rc;
+}
+
+
+
+extern int poller_watch_write(poller_p p, sock_p s, int watch_write)
+{
+	int i;
+	int rc = PLCTAG_ERR_NOT_FOUND;
+
+	if(!p || !s) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	EnterCriticalSection(&p->lock);
+
+	for(i=0; i < p->num_socks; i++) {
+		if(p->socks[i] == (SOCKET)s->fd) {
+			p->watch_write[i] = watch_write;
+			rc = PLCTAG_STATUS_OK;
+			break;
+		}
+	}
+
+	LeaveCriticalSection(&p->lock);
+
+	return rc;
+}
+
+
+
+extern int poller_remove_socket(poller_p p, sock_p s)
+{
+	int i;
+	int rc = PLCTAG_ERR_NOT_FOUND;
+
+	if(!p || !s) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	EnterCriticalSection(&p->lock);
+
+	for(i=0; i < p->num_socks; i++) {
+		if(p->socks[i] == (SOCKET)s->fd) {
+			/* move the last entry into this slot */
+			p->num_socks--;
+			p->socks[i] = p->socks[p->num_socks];
+			p->watch_write[i] = p->watch_write[p->num_socks];
+			rc = PLCTAG_STATUS_OK;
+			break;
+		}
+	}
+
+	LeaveCriticalSection(&p->lock);
+
+	return rc;
+}
+
+
+
+extern int poller_wake(poller_p p)
+{
+	char dummy = 0;
+
+	if(!p) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	/* a full buffer means the waiter will wake anyway. */
+	sendto(p->wake_sock, &dummy, 1, 0, (struct sockaddr *)&p->wake_addr, sizeof(p->wake_addr));
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int poller_wait(poller_p p, int timeout_ms)
+{
+	fd_set read_set;
+	fd_set write_set;
+	struct timeval tv;
+	int i;
+	int rc;
+
+	if(!p) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	FD_ZERO(&read_set);
+	FD_ZERO(&write_set);
+
+	FD_SET(p->wake_sock, &read_set);
+
+	EnterCriticalSection(&p->lock);
+
+	for(i=0; i < p->num_socks; i++) {
+		FD_SET(p->socks[i], &read_set);
+
+		if(p->watch_write[i]) {
+			FD_SET(p->socks[i], &write_set);
+		}
+	}
+
+	LeaveCriticalSection(&p->lock);
+
+	tv.tv_sec = timeout_ms / 1000;
+	tv.tv_usec = (timeout_ms % 1000) * 1000;
+
+	rc = select(0, &read_set, &write_set, NULL, (timeout_ms < 0 ? NULL : &tv));
+
+	if(rc == SOCKET_ERROR) {
+		/* a socket may have been closed under us, just try again. */
+		return 0;
+	}
+
+	/* drain the wake up datagrams */
+	if(FD_ISSET(p->wake_sock, &read_set)) {
+		char buf[64];
+
+		while(recv(p->wake_sock, buf, sizeof(buf), 0) > 0) { }
+	}
+
+	return rc;
+}
+
+
+
+extern int poller_destroy(poller_p *p)
+{
+	if(!p || !*p) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	closesocket((*p)->wake_sock);
+	DeleteCriticalSection(&((*p)->lock));
+
+	mem_free(*p);
+
+	*p = NULL;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+
+
+/***************************************************************************
+ ******************************** Events ***********************************
+ **************************************************************************/
+
+/*
+ * An event is a counter that goes up each time it is signalled.  A
+ * waiter reads the count, checks whatever it is waiting for and then
+ * waits for the count to change.  Because the count is read before
+ * checking, a signal that comes in between is never lost.
+ */
+
+struct event_t {
+	CRITICAL_SECTION lock;
+	CONDITION_VARIABLE cond;
+	uint64_t count;
+};
+
+
+extern int event_create(event_p *e)
+{
+	*e = (event_p)mem_alloc(sizeof(struct event_t));
+
+	if(! *e) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	InitializeCriticalSection(&((*e)->lock));
+	InitializeConditionVariable(&((*e)->cond));
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern uint64_t event_count(event_p e)
+{
+	uint64_t count;
+
+	EnterCriticalSection(&e->lock);
+	count = e->count;
+	LeaveCriticalSection(&e->lock);
+
+	return count;
+}
+
+
+
+extern int event_signal(event_p e)
+{
+	if(!e) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	EnterCriticalSection(&e->lock);
+	e->count++;
+	WakeAllConditionVariable(&e->cond);
+	LeaveCriticalSection(&e->lock);
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int event_wait(event_p e, uint64_t count, int timeout_ms)
+{
+	int64_t end_time;
+	int64_t now;
+	int rc = PLCTAG_STATUS_OK;
+
+	if(!e) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	end_time = time_ms() + timeout_ms;
+
+	EnterCriticalSection(&e->lock);
+
+	while(e->count == count && (now = time_ms()) < end_time) {
+		SleepConditionVariableCS(&e->cond, &e->lock, (DWORD)(end_time - now));
+	}
+
+	if(e->count == count) {
+		rc = PLCTAG_ERR_TIMEOUT;
+	}
+
+	LeaveCriticalSection(&e->lock);
+
+	return rc;
+}
+
+
+
+extern int event_destroy(event_p *e)
+{
+	if(!e || !*e) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	DeleteCriticalSection(&((*e)->lock));
+
+	mem_free(*e);
+
+	*e = NULL;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
+
+
+/*
+ * There is no eventfd on Windows.  Applications should use
+ * callbacks instead.
+ */
+extern int notify_fd_create(int *fd)
+{
+	*fd = -1;
+
+	return PLCTAG_ERR_UNSUPPORTED;
+}
+
+
+
+extern int notify_fd_signal(int fd)
+{
+	return PLCTAG_ERR_UNSUPPORTED;
+}
+
+
+
+extern int notify_fd_destroy(int fd)
+{
+	return PLCTAG_ERR_UNSUPPORTED;
+}
+
+
+
+
+
+
+
+
+/***************************************************************************
+ ****************************** File Mapping *******************************
+ **************************************************************************/
+
+
+struct file_map_t {
+	HANDLE hFile;
+	HANDLE hMapping;
+	void *data;
+};
+
+
+/*
+ * file_map_open
+ *
+ * Map the file at path into memory, creating it or growing it to size
+ * bytes first if needed.  New bytes read as zero.  Changes are written
+ * back to the file and seen by other processes mapping it.
+ */
+extern int file_map_open(file_map_p *m, const char *path, int size)
+{
+	file_map_p map;
+
+	*m = NULL;
+
+	map = (file_map_p)mem_alloc(sizeof(struct file_map_t));
+
+	if(!map) {
+		return PLCTAG_ERR_NO_MEM;
+	}
+
+	map->hFile = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if(map->hFile == INVALID_HANDLE_VALUE) {
+		mem_free(map);
+		return PLCTAG_ERR_OPEN;
+	}
+
+	/* the mapping grows a shorter file to size. */
+	map->hMapping = CreateFileMapping(map->hFile, NULL, PAGE_READWRITE, 0, (DWORD)size, NULL);
+
+	if(!map->hMapping) {
+		CloseHandle(map->hFile);
+		mem_free(map);
+		return PLCTAG_ERR_OPEN;
+	}
+
+	map->data = MapViewOfFile(map->hMapping, FILE_MAP_ALL_ACCESS, 0, 0, (SIZE_T)size);
+
+	if(!map->data) {
+		CloseHandle(map->hMapping);
+		CloseHandle(map->hFile);
+		mem_free(map);
+		return PLCTAG_ERR_OPEN;
+	}
+
+	*m = map;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern void *file_map_data(file_map_p m)
+{
+	if(!m) {
+		return NULL;
+	}
+
+	return m->data;
+}
+
+
+
+/*
+ * file_map_lock
+ *
+ * Take an exclusive lock on the mapped file.  It only keeps other
+ * processes out, threads in this process need their own mutex.  This
+ * blocks until the lock is free.
+ */
+extern int file_map_lock(file_map_p m)
+{
+	OVERLAPPED ov;
+
+	if(!m) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	memset(&ov, 0, sizeof(ov));
+
+	if(!LockFileEx(m->hFile, LOCKFILE_EXCLUSIVE_LOCK, 0, 1, 0, &ov)) {
+		return PLCTAG_ERR_MUTEX_LOCK;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int file_map_unlock(file_map_p m)
+{
+	OVERLAPPED ov;
+
+	if(!m) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	memset(&ov, 0, sizeof(ov));
+
+	if(!UnlockFileEx(m->hFile, 0, 1, 0, &ov)) {
+		return PLCTAG_ERR_MUTEX_UNLOCK;
+	}
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+extern int file_map_destroy(file_map_p *m)
+{
+	if(!m || !*m) {
+		return PLCTAG_ERR_NULL_PTR;
+	}
+
+	UnmapViewOfFile((*m)->data);
+	CloseHandle((*m)->hMapping);
+	CloseHandle((*m)->hFile);
+
+	mem_free(*m);
+	*m = NULL;
+
+	return PLCTAG_STATUS_OK;
+}
+
+
+
+
+
+
 /***************************************************************************
  ****************************** Serial Port ********************************
  **************************************************************************/
@@ -95,6 +95,8 @@ extern void *mem_alloc(int size);
 extern void mem_free(const void *mem);
 extern void mem_set(void *d1, int c, int size);
 extern void mem_copy(void *d1, void *d2, int size);
+extern void mem_move(void *d1, void *d2, int size);
+extern int mem_cmp(void *d1, void *d2, int size);
 
 /* string functions/defs */
 extern int str_cmp(const char *first, const char *second);
@@ -148,6 +150,7 @@ extern int thread_create(thread_p *t, LPTHREAD_START_ROUTINE func, int stacksize
 extern void thread_stop(void);
 extern int thread_join(thread_p t);
 extern int thread_destroy(thread_p *t);
+extern int thread_detach(thread_p *t);
 
 /* atomic operations */
 typedef volatile long int lock_t;
@@ -158,15 +161,60 @@ typedef volatile long int lock_t;
 extern int lock_acquire(lock_t *lock);
 extern void lock_release(lock_t *lock);
 
+/* pointer swaps for lock-free lists, both are full barriers */
+extern void *atomic_ptr_exchange(void * volatile *ptr, void *val);
+extern int atomic_ptr_cas(void * volatile *ptr, void *old_val, void *new_val);
+
+/* counter update, returns the new value.  Also a full barrier. */
+extern int atomic_int_add(volatile int *ptr, int val);
+
 /* socket functions */
+
+/* most buffers socket_write_many() takes in one call */
+#define SOCKET_MAX_WRITE_BUFS (64)
+
 typedef struct sock_t *sock_p;
 extern int socket_create(sock_p *s);
-extern int socket_connect_tcp(sock_p s, const char *host, int port);
+extern int socket_connect_tcp_start(sock_p s, const char *host, int port);
+extern int socket_connect_tcp_check(sock_p s);
 extern int socket_read(sock_p s, uint8_t *buf, int size);
 extern int socket_write(sock_p s, uint8_t *buf, int size);
+extern int socket_write_many(sock_p s, uint8_t **bufs, int *sizes, int count);
+extern int socket_cork(sock_p s, int cork);
 extern int socket_close(sock_p s);
 extern int socket_destroy(sock_p *s);
 
+/* socket event polling */
+typedef struct poller_t *poller_p;
+extern int poller_create(poller_p *p);
+extern int poller_add_socket(poller_p p, sock_p s);
+extern int poller_watch_write(poller_p p, sock_p s, int watch_write);
+extern int poller_remove_socket(poller_p p, sock_p s);
+extern int poller_wake(poller_p p);
+extern int poller_wait(poller_p p, int timeout_ms);
+extern int poller_destroy(poller_p *p);
+
+/* waiting on events from other threads */
+typedef struct event_t *event_p;
+extern int event_create(event_p *e);
+extern uint64_t event_count(event_p e);
+extern int event_signal(event_p e);
+extern int event_wait(event_p e, uint64_t count, int timeout_ms);
+extern int event_destroy(event_p *e);
+
+/* file descriptors that applications can poll for notifications */
+extern int notify_fd_create(int *fd);
+extern int notify_fd_signal(int fd);
+extern int notify_fd_destroy(int fd);
+
+/* files mapped into memory, shared with other processes that map them */
+typedef struct file_map_t *file_map_p;
+extern int file_map_open(file_map_p *m, const char *path, int size);
+extern void *file_map_data(file_map_p m);
+extern int file_map_lock(file_map_p m);
+extern int file_map_unlock(file_map_p m);
+extern int file_map_destroy(file_map_p *m);
+
 /* serial handling */
 typedef struct serial_port_t *serial_port_p;
 #define PLC_SERIAL_PORT_NULL ((plc_serial_port)NULL)